@@ -0,0 +1,32 @@
+-- bench.lua - wrk script for run-bench.sh
+--
+-- GZIP=1        send Accept-Encoding: gzip
+-- COND_RATIO=x  send If-None-Match: $ETAG with probability x
+-- Prints "requests requests/s p50(us) p99(us)" as the last line.
+
+local gzip = os.getenv("GZIP") == "1"
+local ratio = tonumber(os.getenv("COND_RATIO") or "0")
+local etag = os.getenv("ETAG") or ""
+
+init = function(args)
+  math.randomseed(os.time() + tonumber(tostring({}):sub(8), 16))
+end
+
+request = function()
+  local headers = {}
+  if gzip then
+    headers["Accept-Encoding"] = "gzip"
+  end
+  if etag ~= "" and math.random() < ratio then
+    headers["If-None-Match"] = etag
+  end
+  return wrk.format("GET", nil, headers)
+end
+
+done = function(summary, latency, requests)
+  io.write(string.format("%d %.2f %d %d\n",
+    summary.requests,
+    summary.requests / (summary.duration / 1e6),
+    latency:percentile(50),
+    latency:percentile(99)))
+end
@@ -0,0 +1,59 @@
+#!/bin/bash
+#
+# build-microbench.sh - build the microbenchmarks (microbench.c), the
+# decision log replay tool (replay.c), and the large tree generator
+# (gentree.c) and scaling benchmark (scaling.c); microbench-nostatx is
+# microbench with plain stat()/fstat() instead of statx()
+#
+# The module is compiled into each program together with shim.c, which
+# implements the few httpd functions the benchmarked helpers call. Hooks,
+# filters and logging are never reached, so the rest of httpd is left
+# unresolved (hence a non-PIE executable). The --wrap options count the
+# allocating APR calls.
+#
+# Requirements: apxs (httpd headers), apr-1-config and apu-1-config.
+#
+#     ./build-microbench.sh && ./microbench
+#     ./build-microbench.sh && ./replay decisions.log
+#     ./build-microbench.sh && ./gentree /tmp/tree && ./scaling /tmp/tree
+#
+set -eu
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+
+APXS=${APXS:-$(command -v apxs || command -v apxs2)}
+APR_CONFIG=${APR_CONFIG:-$("$APXS" -q APR_CONFIG 2>/dev/null || command -v apr-1-config)}
+APU_CONFIG=${APU_CONFIG:-$("$APXS" -q APU_CONFIG 2>/dev/null || command -v apu-1-config)}
+CC=${CC:-$("$APXS" -q CC)}
+CFLAGS=${CFLAGS:--O2 -g}
+OUTDIR=${OUTDIR:-$HERE}
+
+WRAP=
+for fn in apr_palloc apr_pcalloc apr_pstrdup apr_pstrmemdup apr_pstrndup \
+    apr_pmemdup apr_psprintf apr_pstrcat apr_array_make apr_table_make; do
+  WRAP="$WRAP -Wl,--wrap=$fn"
+done
+
+# build <program> [<output> <extra cflags>]
+build() {
+  # shellcheck disable=SC2046,SC2086
+  "$CC" $CFLAGS ${3:-} \
+    -I"$("$APXS" -q INCLUDEDIR)" \
+    $("$APR_CONFIG" --includes --cppflags --cflags) \
+    $("$APU_CONFIG" --includes) \
+    -o "$OUTDIR/${2:-$1}" "$HERE/$1.c" "$HERE/shim.c" \
+    -no-pie -Wl,--unresolved-symbols=ignore-all $WRAP \
+    $("$APU_CONFIG" --link-ld --libs) \
+    $("$APR_CONFIG" --link-ld --libs)
+  echo "built $OUTDIR/${2:-$1}"
+}
+
+build microbench
+build microbench microbench-nostatx -DXSENDFILE_NO_STATX
+build replay
+build scaling
+
+# plain C
+# shellcheck disable=SC2086
+"$CC" $CFLAGS -o "$OUTDIR/gentree" "$HERE/gentree.c"
+echo "built $OUTDIR/gentree"
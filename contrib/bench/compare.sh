@@ -0,0 +1,32 @@
+#!/bin/bash
+#
+# compare.sh - compare two result files of run-bench.sh
+#
+#     ./compare.sh before.jsonl after.jsonl
+#
+# Prints requests/s, p99, CPU and TCP segments per request of both runs
+# for every scenario found in both files, along with the relative change.
+# Requires jq.
+#
+set -eu
+
+if [ $# -ne 2 ]; then
+  echo "usage: $0 <before.jsonl> <after.jsonl>" >&2
+  exit 2
+fi
+
+jq -rn --slurpfile a "$1" --slurpfile b "$2" '
+  def key: "\(.mpm) \(.backend) roots=\(.roots) size=\(.size) gzip=\(.gzip) cond=\(.cond) cork=\(.cork // "off") buckets=\(.buckets // "off")";
+  def pct(x; y): if x == 0 then "n/a" else "\(((y - x) / x * 1000 | round) / 10)%" end;
+  ($a | map({(key): .}) | add) as $before
+  | $b[]
+  | key as $k
+  | select($before[$k])
+  | $before[$k] as $o
+  | "\($k)\n  rps \($o.rps) -> \(.rps) (\(pct($o.rps; .rps)))"
+    + "  p99 \($o.p99_us)us -> \(.p99_us)us (\(pct($o.p99_us; .p99_us)))"
+    + "  cpu \($o.cpu_us_per_req)us -> \(.cpu_us_per_req)us (\(pct($o.cpu_us_per_req; .cpu_us_per_req)))"
+    + (if $o.segs_per_req and .segs_per_req then
+        "  segs \($o.segs_per_req) -> \(.segs_per_req) (\(pct($o.segs_per_req; .segs_per_req)))"
+      else "" end)
+'
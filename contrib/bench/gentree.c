@@ -0,0 +1,273 @@
+/****
+ * gentree.c: generate a synthetic content tree for scaling.c
+ *
+ * Creates <roots> directories root0000, root0001, ... below the target,
+ * each holding a tree of <depth> levels of <fanout> subdirectories, with
+ * <files> files in every leaf directory. Names are random lower-case
+ * strings of the given length range. A share of the files is made
+ * compressible (.js, .css, .html, each with an up-to-date .gz variant
+ * next to it, so no variant ever needs to be created), the rest get
+ * non-compressible extensions, a share of which are symlinks to a sibling.
+ *
+ * A uniform random sample of the files is written to paths.tsv in the
+ * target directory ("<root index>\t<path relative to the root>"), which
+ * is what scaling.c resolves.
+ *
+ * No APR needed: cc -O2 -o gentree gentree.c
+ *
+ *     ./gentree -d 12 -f 4 -n 3 -r 1000 /mnt/bench/tree
+ *
+ * Beware: that is roots * fanout^depth * files files (~50M above).
+ *
+ * Licensed under the Apache License, Version 2.0, see mod_xsendfile.c
+ ****/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+typedef struct gentree_t {
+  int fanout;
+  int depth;
+  int files;
+  int roots;
+  double symlinks;
+  double compressible;
+  int minLen;
+  int maxLen;
+  long size;
+  long sample;
+
+  unsigned long long rng;
+  unsigned long long generated;
+  unsigned long long seen; /* files eligible for the sample */
+  char **samples;
+  long nsamples;
+  int root; /* current */
+} gentree_t;
+
+static const char *const compressible_exts[] = { ".js", ".css", ".html" };
+static const char *const other_exts[] = { ".bin", ".jpg", ".png", ".pdf", ".mp4" };
+
+/* xorshift64*, deterministic for a given seed */
+static unsigned long long gentree_rand(gentree_t *g) {
+  g->rng ^= g->rng >> 12;
+  g->rng ^= g->rng << 25;
+  g->rng ^= g->rng >> 27;
+  return g->rng * 2685821657736338717ULL;
+}
+
+static double gentree_uniform(gentree_t *g) {
+  return (gentree_rand(g) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void gentree_name(gentree_t *g, char *d) {
+  int len = g->minLen + (int)(gentree_rand(g) % (unsigned)(g->maxLen - g->minLen + 1));
+  int i;
+
+  for (i = 0; i < len; ++i) {
+    d[i] = 'a' + (char)(gentree_rand(g) % 26);
+  }
+  d[len] = '\0';
+}
+
+static int gentree_file(gentree_t *g, const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  if (g->size > 0 && ftruncate(fd, g->size) != 0) {
+    perror(path);
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+/* reservoir sampling over all files generated */
+static void gentree_sample(gentree_t *g, const char *rel) {
+  long i;
+
+  g->seen++;
+  if (g->nsamples < g->sample) {
+    i = g->nsamples++;
+  }
+  else {
+    i = (long)(gentree_rand(g) % g->seen);
+    if (i >= g->sample) {
+      return;
+    }
+    free(g->samples[i]);
+  }
+  g->samples[i] = malloc(strlen(rel) + 16);
+  sprintf(g->samples[i], "%d\t%s", g->root, rel);
+}
+
+/* path is the absolute directory, rel the part below the root */
+static int gentree_dir(gentree_t *g, char *path, size_t plen, char *rel, size_t rlen, int level) {
+  char name[256], *last = NULL;
+  int i;
+
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+    perror(path);
+    return -1;
+  }
+
+  if (level == g->depth) {
+    for (i = 0; i < g->files; ++i) {
+      const char *ext;
+      int compressible = gentree_uniform(g) < g->compressible;
+      size_t n;
+
+      gentree_name(g, name);
+      ext = compressible
+        ? compressible_exts[gentree_rand(g) % 3]
+        : other_exts[gentree_rand(g) % 5];
+      n = (size_t)sprintf(path + plen, "/%s%s", name, ext);
+      sprintf(rel + rlen, "%s%s%s", rlen ? "/" : "", name, ext);
+
+      /* compressible ones would need their .gz linked as well */
+      if (!compressible && last && gentree_uniform(g) < g->symlinks) {
+        if (symlink(last, path) != 0) {
+          perror(path);
+          return -1;
+        }
+      }
+      else {
+        if (gentree_file(g, path) != 0) {
+          return -1;
+        }
+        if (compressible) {
+          /* the variant mustn't be older than the original */
+          strcpy(path + plen + n, ".gz");
+          if (gentree_file(g, path) != 0) {
+            return -1;
+          }
+          path[plen + n] = '\0';
+        }
+        free(last);
+        last = strdup(path + plen + 1);
+      }
+      g->generated++;
+      gentree_sample(g, rel);
+    }
+    free(last);
+    path[plen] = '\0';
+    rel[rlen] = '\0';
+    return 0;
+  }
+
+  for (i = 0; i < g->fanout; ++i) {
+    size_t n, m;
+
+    gentree_name(g, name);
+    n = (size_t)sprintf(path + plen, "/%s", name);
+    m = (size_t)sprintf(rel + rlen, "%s%s", rlen ? "/" : "", name);
+    if (gentree_dir(g, path, plen + n, rel, rlen + m, level + 1) != 0) {
+      return -1;
+    }
+  }
+  path[plen] = '\0';
+  rel[rlen] = '\0';
+  return 0;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+    "usage: %s [-f fanout] [-d depth] [-n files-per-leaf] [-r roots] [-s symlink-share]\n"
+    "          [-c compressible-share] [-l min-max name length] [-b file size]\n"
+    "          [-p sample size] [-S seed] <target directory>\n",
+    argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  gentree_t g;
+  char path[8192], rel[8192];
+  struct timeval t0, t1;
+  FILE *fp;
+  size_t plen;
+  long i;
+  int opt;
+
+  memset(&g, 0, sizeof(g));
+  g.fanout = 10;
+  g.depth = 3;
+  g.files = 20;
+  g.roots = 1;
+  g.symlinks = 0.02;
+  g.compressible = 0.3;
+  g.minLen = 6;
+  g.maxLen = 20;
+  g.sample = 100000;
+  g.rng = 88172645463325252ULL;
+
+  while ((opt = getopt(argc, argv, "f:d:n:r:s:c:l:b:p:S:h")) != -1) {
+    switch (opt) {
+    case 'f': g.fanout = atoi(optarg); break;
+    case 'd': g.depth = atoi(optarg); break;
+    case 'n': g.files = atoi(optarg); break;
+    case 'r': g.roots = atoi(optarg); break;
+    case 's': g.symlinks = atof(optarg); break;
+    case 'c': g.compressible = atof(optarg); break;
+    case 'l':
+      if (sscanf(optarg, "%d-%d", &g.minLen, &g.maxLen) != 2) {
+        usage(argv[0]);
+      }
+      break;
+    case 'b': g.size = atol(optarg); break;
+    case 'p': g.sample = atol(optarg); break;
+    case 'S': g.rng = strtoull(optarg, NULL, 10) | 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || g.fanout < 1 || g.depth < 0 || g.files < 1 || g.roots < 1
+    || g.minLen < 1 || g.maxLen < g.minLen || g.maxLen > 200 || g.sample < 1
+    || (size_t)g.depth * (g.maxLen + 1) + strlen(argv[optind]) + 64 > sizeof(path)) {
+    usage(argv[0]);
+  }
+
+  g.samples = calloc((size_t)g.sample, sizeof(char*));
+  plen = strlen(argv[optind]);
+  memcpy(path, argv[optind], plen + 1);
+  if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+    perror(path);
+    return 1;
+  }
+
+  gettimeofday(&t0, NULL);
+  for (g.root = 0; g.root < g.roots; ++g.root) {
+    size_t n = (size_t)sprintf(path + plen, "/root%04d", g.root);
+    rel[0] = '\0';
+    if (gentree_dir(&g, path, plen + n, rel, 0, 0) != 0) {
+      return 1;
+    }
+    path[plen] = '\0';
+  }
+  gettimeofday(&t1, NULL);
+
+  strcpy(path + plen, "/paths.tsv");
+  if (!(fp = fopen(path, "w"))) {
+    perror(path);
+    return 1;
+  }
+  for (i = 0; i < g.nsamples; ++i) {
+    fprintf(fp, "%s\n", g.samples[i]);
+  }
+  fclose(fp);
+
+  fprintf(stderr, "gentree: %llu files in %d roots, %.1fs, %ld sampled into %s\n",
+    g.generated, g.roots,
+    (t1.tv_sec - t0.tv_sec) + (t1.tv_usec - t0.tv_usec) / 1e6,
+    g.nsamples, path);
+  return 0;
+}
@@ -0,0 +1,188 @@
+#!/bin/bash
+#
+# h2-bench.sh - stream fairness of X-Sendfile responses under mod_http2
+#
+# Starts a throwaway httpd with mod_http2 (h2c, on loopback) and has
+# CLIENTS nghttp processes at a time each open one connection with LARGE
+# downloads of a LARGE_SIZE file and SMALL downloads of a SMALL_SIZE file
+# as concurrent streams, ROUNDS times, for every XSendFileH2BucketSize in
+#   H2BUCKETS="off 64k 256k 1m"
+# Every setting appends one JSON line to $OUT (default: h2-results.jsonl):
+#   - small_p50_ms, small_p99_ms: when the small streams completed, i.e.
+#     how long they had to wait for the large ones
+#   - large_avg_ms: the large streams' completion
+#   - mib_s: MiB received per second of the rounds' wall clock time
+#
+# Requirements: apxs, httpd 2.4 with mod_http2 and shared MPMs, mod_asis,
+# nghttp (nghttp2-client) and curl.
+#
+#     ./h2-bench.sh
+#     H2BUCKETS="off on" CLIENTS=32 ./h2-bench.sh
+#
+set -eu
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+SRC=$(cd "$HERE/../.." && pwd)
+
+APXS=${APXS:-$(command -v apxs || command -v apxs2)}
+HTTPD=${HTTPD:-$("$APXS" -q SBINDIR)/$("$APXS" -q TARGET)}
+MODULES=${MODULES:-$("$APXS" -q LIBEXECDIR)}
+PORT=${PORT:-8089}
+MPM=${MPM:-event}
+H2BUCKETS=${H2BUCKETS:-"off 64k 256k 1m"}
+LARGE=${LARGE:-4}
+LARGE_SIZE=${LARGE_SIZE:-64m}
+SMALL=${SMALL:-32}
+SMALL_SIZE=${SMALL_SIZE:-16k}
+CLIENTS=${CLIENTS:-8}
+ROUNDS=${ROUNDS:-5}
+OUT=${OUT:-$PWD/h2-results.jsonl}
+WORK=${WORK:-$(mktemp -d /tmp/xsendfile-h2bench.XXXXXX)}
+
+VERSION=$(cd "$SRC" && git describe --always --dirty 2>/dev/null || echo unknown)
+
+log() {
+  echo "h2-bench: $*" >&2
+}
+
+size_bytes() {
+  case "$1" in
+    *k) echo $(( ${1%k} * 1024 )) ;;
+    *m) echo $(( ${1%m} * 1024 * 1024 )) ;;
+    *) echo "$1" ;;
+  esac
+}
+
+build() {
+  log "building module ($VERSION) in $WORK"
+  mkdir -p "$WORK/build" "$WORK/logs" "$WORK/htdocs" "$WORK/files" "$WORK/stats"
+  cp "$SRC/mod_xsendfile.c" "$WORK/build/"
+  (cd "$WORK/build" && "$APXS" -c mod_xsendfile.c >/dev/null)
+}
+
+make_files() {
+  local name
+  head -c "$(size_bytes "$LARGE_SIZE")" /dev/urandom > "$WORK/files/large.bin"
+  head -c "$(size_bytes "$SMALL_SIZE")" /dev/urandom > "$WORK/files/small.bin"
+  for name in large small; do
+    printf 'Status: 200 OK\nContent-Type: application/octet-stream\nX-Sendfile: %s\n\n' \
+      "$WORK/files/$name.bin" > "$WORK/htdocs/$name.asis"
+  done
+}
+
+write_conf() {
+  local buckets=$1
+  {
+    echo "ServerRoot \"$WORK\""
+    echo "Listen 127.0.0.1:$PORT"
+    echo "PidFile $WORK/logs/httpd.pid"
+    echo "ErrorLog $WORK/logs/error_log"
+    echo "LogLevel warn"
+    echo "DocumentRoot \"$WORK/htdocs\""
+    echo "LoadModule mpm_${MPM}_module $MODULES/mod_mpm_${MPM}.so"
+    for m in authz_core mime asis http2; do
+      echo "LoadModule ${m}_module $MODULES/mod_${m}.so"
+    done
+    echo "LoadModule xsendfile_module $WORK/build/.libs/mod_xsendfile.so"
+    echo "Protocols h2c http/1.1"
+    echo "ServerLimit 16"
+    echo "MaxRequestWorkers 400"
+    echo "EnableSendfile On"
+    echo "<Directory \"$WORK/htdocs\">"
+    echo "  Require all granted"
+    echo "  AddHandler send-as-is .asis"
+    echo "  XSendFile On"
+    echo "  XSendFileH2BucketSize $buckets"
+    echo "</Directory>"
+    echo "XSendFilePath \"$WORK/files\""
+  } > "$WORK/httpd.conf"
+}
+
+start_httpd() {
+  "$HTTPD" -f "$WORK/httpd.conf" -k start
+  for _ in $(seq 50); do
+    curl -fs -o /dev/null "http://127.0.0.1:$PORT/small.asis" && return 0
+    sleep 0.1
+  done
+  log "httpd did not come up, see $WORK/logs/error_log"
+  exit 1
+}
+
+stop_httpd() {
+  local pid
+  pid=$(cat "$WORK/logs/httpd.pid" 2>/dev/null) || return 0
+  "$HTTPD" -f "$WORK/httpd.conf" -k stop
+  while kill -0 "$pid" 2>/dev/null; do
+    sleep 0.1
+  done
+}
+
+# one connection: the large streams first, so the small ones queue behind
+run_client() {
+  local url="http://127.0.0.1:$PORT" uris=() i
+  for (( i = 0; i < LARGE; i++ )); do
+    uris+=("$url/large.asis")
+  done
+  for (( i = 0; i < SMALL; i++ )); do
+    uris+=("$url/small.asis")
+  done
+  nghttp -ns -m 1 --no-dep "${uris[@]}"
+}
+
+# "path microseconds" for every completed stream of nghttp -s output
+parse_stats() {
+  awk '
+    function us(t) {
+      sub(/^\+/, "", t)
+      if (t ~ /us$/) { sub(/us$/, "", t); return t + 0 }
+      if (t ~ /ms$/) { sub(/ms$/, "", t); return t * 1000 }
+      if (t ~ /s$/) { sub(/s$/, "", t); return t * 1000000 }
+      return t + 0
+    }
+    $1 ~ /^[0-9]+$/ && $5 == 200 { print $NF, us($2) }
+  ' "$@"
+}
+
+run_one() {
+  local buckets=$1 round c t0 t1 bytes
+  rm -f "$WORK"/stats/*
+
+  t0=$(date +%s%N)
+  for (( round = 0; round < ROUNDS; round++ )); do
+    for (( c = 0; c < CLIENTS; c++ )); do
+      run_client > "$WORK/stats/$round-$c.txt" &
+    done
+    wait
+  done
+  t1=$(date +%s%N)
+
+  bytes=$(( ROUNDS * CLIENTS * (LARGE * $(size_bytes "$LARGE_SIZE") + SMALL * $(size_bytes "$SMALL_SIZE")) ))
+  parse_stats "$WORK"/stats/*.txt | sort -k2,2n | awk -v version="$VERSION" -v mpm="$MPM" -v buckets="$buckets" \
+      -v clients="$CLIENTS" -v large="$LARGE" -v small="$SMALL" -v bytes="$bytes" -v ns=$(( t1 - t0 )) '
+    # a is sorted
+    function pct(a, n, p,   i) {
+      i = int(n * p)
+      return n ? a[i < n ? i + 1 : n] / 1000 : 0
+    }
+    $1 ~ /small/ { s[++ns_] = $2 }
+    $1 ~ /large/ { lsum += $2; ++nl }
+    END {
+      printf "{\"version\":\"%s\",\"mpm\":\"%s\",\"h2_buckets\":\"%s\",\"clients\":%d,\"large\":%d,\"small\":%d,", \
+        version, mpm, buckets, clients, large, small
+      printf "\"small_p50_ms\":%.2f,\"small_p99_ms\":%.2f,\"large_avg_ms\":%.2f,\"mib_s\":%.1f}\n", \
+        pct(s, ns_, 0.5), pct(s, ns_, 0.99), nl ? lsum / nl / 1000 : 0, bytes / (ns / 1e9) / 1048576
+    }' | tee -a "$OUT"
+}
+
+trap stop_httpd EXIT
+
+build
+make_files
+for buckets in $H2BUCKETS; do
+  write_conf "$buckets"
+  start_httpd
+  run_client > /dev/null
+  run_one "$buckets"
+  stop_httpd
+done
+log "results appended to $OUT"
@@ -0,0 +1,340 @@
+/****
+ * microbench.c: microbenchmarks of mod_xsendfile's request-time helpers
+ *
+ * The module source is compiled right into this program, so its static
+ * functions can be called directly, against the httpd bits in shim.c and
+ * the real APR. Every benchmark runs its function over all records of an
+ * inputs file (inputs/default.tsv unless given with -i) and reports the
+ * time and the number of allocating APR calls per operation.
+ *
+ * Setting up the request (pool clear, tables, headers) is measured
+ * separately and subtracted, so the numbers are the function alone.
+ *
+ * Build with build-microbench.sh, then
+ *     ./microbench                      all benchmarks
+ *     ./microbench -r 20 get_filepath   with 20 extra white-listed paths
+ *     ./microbench -j > before.jsonl    one JSON line per benchmark
+ *
+ * microbench-nostatx is the same with plain stat()/fstat() (built with
+ * XSENDFILE_NO_STATX), to compare the two on a given file system.
+ *
+ * Inputs are tab separated, '#' starts a comment:
+ *     root  <path> [AllowFileDelete]
+ *     req   <the_request> <uri> <filename> <header> <value> [<Accept-Encoding>]
+ * where <header> is X-Sendfile or X-Sendfile-Temporary.
+ *
+ * Licensed under the Apache License, Version 2.0, see mod_xsendfile.c
+ ****/
+
+#include "../../mod_xsendfile.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "apr_general.h"
+
+#include "shim.h"
+
+typedef struct bench_record_t {
+  const char *the_request;
+  const char *uri;
+  const char *filename;
+  const char *file; /* header value */
+  int temporary; /* X-Sendfile-Temporary */
+  const char *acceptEncoding; /* NULL if not sent */
+} bench_record_t;
+
+typedef struct bench_t {
+  apr_array_header_t *records;
+  xsendfile_conf_t *conf;
+} bench_t;
+
+typedef void (*bench_fn_t)(const bench_t *b, const bench_record_t *rec, request_rec *r);
+
+/* what every benchmark pays for, and gets subtracted again */
+static void bench_setup(const bench_record_t *rec, request_rec *r) {
+  r->the_request = (char*)rec->the_request;
+  r->uri = (char*)rec->uri;
+  r->filename = (char*)rec->filename;
+  apr_table_clear(r->headers_in);
+  apr_table_clear(r->headers_out);
+  apr_table_clear(r->err_headers_out);
+  if (rec->acceptEncoding) {
+    apr_table_setn(r->headers_in, "Accept-Encoding", rec->acceptEncoding);
+  }
+  apr_table_setn(r->headers_out,
+    rec->temporary ? "X-Sendfile-Temporary" : "X-Sendfile", rec->file);
+}
+
+static void bench_baseline(const bench_t *b, const bench_record_t *rec, request_rec *r) {
+  bench_setup(rec, r);
+}
+
+static void bench_scan_headers(const bench_t *b, const bench_record_t *rec, request_rec *r) {
+  int shouldDeleteFile = 0, accel = 0;
+
+  bench_setup(rec, r);
+  ap_xsendfile_scan_headers(r, b->conf, &shouldDeleteFile, &accel);
+}
+
+static void bench_original_path(const bench_t *b, const bench_record_t *rec, request_rec *r) {
+  xsendfile_ctx_t ctx;
+
+  bench_setup(rec, r);
+  memset(&ctx, 0, sizeof(ctx));
+  ap_xsendfile_get_orginal_path(r, &ctx);
+}
+
+static void bench_accepts_gzip(const bench_t *b, const bench_record_t *rec, request_rec *r) {
+  bench_setup(rec, r);
+  ap_xsendfile_accepts_gzip(r);
+}
+
+static void bench_is_compressible(const bench_t *b, const bench_record_t *rec, request_rec *r) {
+  bench_setup(rec, r);
+  ap_xsendfile_is_compressible(&xsendfile_default_profile, rec->file);
+}
+
+static void bench_get_filepath(const bench_t *b, const bench_record_t *rec, request_rec *r) {
+  xsendfile_ctx_t ctx;
+  char *path = NULL;
+
+  bench_setup(rec, r);
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.root = -1;
+  ap_xsendfile_get_filepath(r, b->conf, &ctx, rec->file, rec->temporary, &path);
+}
+
+static void bench_open_file(const bench_t *b, const bench_record_t *rec, request_rec *r) {
+  xsendfile_ctx_t ctx;
+  char *path = NULL;
+  apr_file_t *fd;
+  apr_finfo_t finfo;
+
+  bench_setup(rec, r);
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.root = -1;
+  ap_xsendfile_get_filepath(r, b->conf, &ctx, rec->file, rec->temporary, &path);
+  if (path && apr_file_open(&fd, path, APR_READ | APR_BINARY, 0, r->pool) == APR_SUCCESS) {
+    xsendfile_fd_info(&finfo, fd);
+    apr_file_close(fd);
+  }
+}
+
+static const struct {
+  const char *name;
+  bench_fn_t fn;
+} benchmarks[] = {
+  { "scan_headers", bench_scan_headers },
+  { "get_orginal_path", bench_original_path },
+  { "accepts_gzip", bench_accepts_gzip },
+  { "is_compressible", bench_is_compressible },
+  /* includes the stat()s of the .gz lookup, against the real file system */
+  { "get_filepath", bench_get_filepath },
+  /* and opening it, as the filter does; compare with microbench-nostatx */
+  { "open_file", bench_open_file },
+};
+#define BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+typedef struct bench_result_t {
+  apr_uint64_t ops;
+  apr_uint64_t ns;
+  apr_uint64_t allocs;
+} bench_result_t;
+
+/*
+  run fn over all records until minNs have passed; the pool is cleared
+  after every pass, as a request pool would be
+*/
+static void bench_run(const bench_t *b, bench_fn_t fn, apr_pool_t *p,
+    apr_uint64_t minNs, bench_result_t *res) {
+  const bench_record_t *recs = (const bench_record_t*)b->records->elts;
+  apr_pool_t *rp;
+  request_rec *r;
+  apr_uint64_t start, allocs;
+  int i;
+
+  apr_pool_create(&rp, p);
+  r = shim_request_create(p);
+
+  memset(res, 0, sizeof(*res));
+  start = xsendfile_clock();
+  allocs = shim_allocs;
+  do {
+    shim_request_reset(r, rp);
+    for (i = 0; i < b->records->nelts; ++i) {
+      fn(b, &recs[i], r);
+    }
+    apr_pool_clear(rp);
+    res->ops += b->records->nelts;
+    res->ns = xsendfile_clock() - start;
+  } while (res->ns < minNs);
+  res->allocs = shim_allocs - allocs;
+
+  apr_pool_destroy(rp);
+}
+
+static char *bench_field(char **last) {
+  char *field = apr_strtok(NULL, "\t", last);
+  return field && strcmp(field, "-") ? field : NULL;
+}
+
+static int bench_load(bench_t *b, apr_pool_t *p, const char *fname, int extraRoots) {
+  char line[8192];
+  FILE *fp;
+  int lineno = 0;
+  int i;
+
+  if (!(fp = fopen(fname, "r"))) {
+    perror(fname);
+    return -1;
+  }
+
+  b->records = apr_array_make(p, 64, sizeof(bench_record_t));
+  b->conf = xsendfile_config_create(p);
+
+  /* decoys first, they are tried in order */
+  for (i = 0; i < extraRoots; ++i) {
+    xsendfile_path_t *root = (xsendfile_path_t*)apr_array_push(b->conf->paths);
+    root->path = apr_psprintf(p, "/srv/decoy/%d", i);
+    root->allowFileDelete = 0;
+    root->limitRate = 0;
+    root->profile = &xsendfile_default_profile;
+    root->prefixLen = xsendfile_prefix_len(root->path);
+    root->id = XSENDFILE_ROOT_OTHER;
+  }
+
+  while (fgets(line, sizeof(line), fp)) {
+    char *kind, *last;
+
+    ++lineno;
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!*line || *line == '#') {
+      continue;
+    }
+
+    kind = apr_strtok(line, "\t", &last);
+    if (strcmp(kind, "root") == 0) {
+      xsendfile_path_t *root = (xsendfile_path_t*)apr_array_push(b->conf->paths);
+      const char *flag;
+
+      root->path = apr_pstrdup(p, bench_field(&last));
+      if (!root->path) {
+        fprintf(stderr, "%s:%d: root without a path\n", fname, lineno);
+        fclose(fp);
+        return -1;
+      }
+      flag = bench_field(&last);
+      root->allowFileDelete = flag && strcmp(flag, "AllowFileDelete") == 0;
+      root->limitRate = 0;
+      root->profile = &xsendfile_default_profile;
+      root->prefixLen = xsendfile_prefix_len(root->path);
+      root->id = XSENDFILE_ROOT_OTHER;
+    }
+    else if (strcmp(kind, "req") == 0) {
+      bench_record_t *rec = (bench_record_t*)apr_array_push(b->records);
+      const char *header, *ae;
+
+      rec->the_request = apr_pstrdup(p, bench_field(&last));
+      rec->uri = apr_pstrdup(p, bench_field(&last));
+      rec->filename = apr_pstrdup(p, bench_field(&last));
+      header = bench_field(&last);
+      rec->file = apr_pstrdup(p, bench_field(&last));
+      ae = bench_field(&last);
+      rec->acceptEncoding = ae ? apr_pstrdup(p, ae) : NULL;
+      if (!rec->the_request || !rec->uri || !rec->filename || !header || !rec->file) {
+        fprintf(stderr, "%s:%d: incomplete record\n", fname, lineno);
+        fclose(fp);
+        return -1;
+      }
+      rec->temporary = strcasecmp(header, "X-Sendfile-Temporary") == 0;
+    }
+    else {
+      fprintf(stderr, "%s:%d: unknown record type %s\n", fname, lineno, kind);
+      fclose(fp);
+      return -1;
+    }
+  }
+  fclose(fp);
+
+  if (!b->records->nelts) {
+    fprintf(stderr, "%s: no records\n", fname);
+    return -1;
+  }
+  return 0;
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+    "usage: %s [-i inputs.tsv] [-t ms] [-r extra-roots] [-d docroot] [-j] [benchmark...]\n",
+    argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *inputs = "inputs/default.tsv";
+  apr_uint64_t minNs = 500 * 1000000ULL;
+  int extraRoots = 0;
+  int json = 0;
+  apr_pool_t *p;
+  bench_t b;
+  bench_result_t base, res;
+  size_t i;
+  int opt, first;
+
+  while ((opt = getopt(argc, argv, "i:t:r:d:jh")) != -1) {
+    switch (opt) {
+    case 'i': inputs = optarg; break;
+    case 't': minNs = (apr_uint64_t)atoi(optarg) * 1000000; break;
+    case 'r': extraRoots = atoi(optarg); break;
+    case 'd': shim_document_root = optarg; break;
+    case 'j': json = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  first = optind;
+
+  apr_app_initialize(&argc, (const char * const **)&argv, NULL);
+  atexit(apr_terminate);
+  apr_pool_create(&p, NULL);
+
+  if (bench_load(&b, p, inputs, extraRoots) != 0) {
+    return 1;
+  }
+
+  bench_run(&b, bench_baseline, p, minNs, &base);
+  if (!json) {
+    printf("%-18s %8s %12s %10s %10s\n", "benchmark", "records", "ops", "ns/op", "allocs/op");
+  }
+
+  for (i = 0; i < BENCHMARKS; ++i) {
+    double ns, allocs;
+
+    if (first < argc) {
+      int j, wanted = 0;
+      for (j = first; j < argc; ++j) {
+        wanted |= strcmp(argv[j], benchmarks[i].name) == 0;
+      }
+      if (!wanted) {
+        continue;
+      }
+    }
+
+    bench_run(&b, benchmarks[i].fn, p, minNs, &res);
+    ns = (double)res.ns / res.ops - (double)base.ns / base.ops;
+    allocs = (double)res.allocs / res.ops - (double)base.allocs / base.ops;
+    if (json) {
+      printf("{\"bench\":\"%s\",\"inputs\":\"%s\",\"records\":%d,\"roots\":%d,"
+        "\"ops\":%" APR_UINT64_T_FMT ",\"ns_per_op\":%.1f,\"allocs_per_op\":%.2f}\n",
+        benchmarks[i].name, inputs, b.records->nelts, b.conf->paths->nelts,
+        res.ops, ns, allocs);
+    }
+    else {
+      printf("%-18s %8d %12" APR_UINT64_T_FMT " %10.1f %10.2f\n",
+        benchmarks[i].name, b.records->nelts, res.ops, ns, allocs);
+    }
+  }
+
+  apr_pool_destroy(p);
+  return 0;
+}
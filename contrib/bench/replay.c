@@ -0,0 +1,459 @@
+/****
+ * replay.c: replay an XSendFileDecisionLog against a file system snapshot
+ *
+ * Every logged decision is run again through the module's own resolution
+ * code (ap_xsendfile_get_filepath, i.e. script directory, white-listed
+ * paths and .gz variant lookup) plus an open/fstat/close of the result,
+ * timing each part. Alongside, LRU caches of several sizes are simulated
+ * on the same stream:
+ *   path      (root set, directory, header value) -> resolved path,
+ *             saves resolution and variant lookup
+ *   metadata  resolved path -> stat results, saves the variant lookup
+ *   fd        resolved path -> open file, saves the open
+ * and their hit rates and the resulting cost per request are reported.
+ *
+ * -s prefixes all logged paths (roots, script directories and absolute
+ * header values), so a snapshot mounted elsewhere can be used. Decisions
+ * that resolved in production but don't against the snapshot are counted
+ * as diverged. Missing or stale .gz variants get created just like in
+ * production, so mount the snapshot read-only unless that is wanted.
+ *
+ * Build with build-microbench.sh, then
+ *     ./replay -s /mnt/snapshot decisions.log
+ *     ./replay -c 100,10000 -j decisions.log
+ *
+ * Licensed under the Apache License, Version 2.0, see mod_xsendfile.c
+ ****/
+
+#include "../../mod_xsendfile.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "apr_general.h"
+
+#include "shim.h"
+
+/* LRU set of keys, only hits and misses matter */
+typedef struct lru_node_t {
+  struct lru_node_t *prev;
+  struct lru_node_t *next;
+  char *key;
+  apr_size_t klen;
+} lru_node_t;
+
+typedef enum {
+  CACHE_PATH = 0,
+  CACHE_METADATA,
+  CACHE_FD,
+  CACHE_MAX
+} cache_kind_t;
+
+static const char *const cache_names[CACHE_MAX] = {
+  "path",
+  "metadata",
+  "fd"
+};
+
+typedef struct lru_t {
+  cache_kind_t kind;
+  int size;
+  int n;
+  apr_hash_t *h;
+  lru_node_t head; /* head.next is the most recently used */
+  apr_uint64_t lookups;
+  apr_uint64_t hits;
+  apr_uint64_t savedNs;
+} lru_t;
+
+static void lru_init(lru_t *c, apr_pool_t *p, cache_kind_t kind, int size) {
+  memset(c, 0, sizeof(*c));
+  c->kind = kind;
+  c->size = size;
+  c->h = apr_hash_make(p);
+  c->head.next = c->head.prev = &c->head;
+}
+
+static void lru_unlink(lru_node_t *n) {
+  n->prev->next = n->next;
+  n->next->prev = n->prev;
+}
+
+static void lru_push(lru_t *c, lru_node_t *n) {
+  n->next = c->head.next;
+  n->prev = &c->head;
+  c->head.next->prev = n;
+  c->head.next = n;
+}
+
+/* @return 1 on a hit; misses get inserted */
+static int lru_lookup(lru_t *c, const char *key, apr_size_t klen) {
+  lru_node_t *n;
+
+  c->lookups++;
+  if ((n = apr_hash_get(c->h, key, klen)) != NULL) {
+    lru_unlink(n);
+    lru_push(c, n);
+    c->hits++;
+    return 1;
+  }
+
+  if (c->n >= c->size) {
+    n = c->head.prev;
+    lru_unlink(n);
+    apr_hash_set(c->h, n->key, n->klen, NULL);
+    free(n->key);
+  }
+  else {
+    n = (lru_node_t*)malloc(sizeof(lru_node_t));
+    c->n++;
+  }
+  n->key = (char*)malloc(klen);
+  memcpy(n->key, key, klen);
+  n->klen = klen;
+  apr_hash_set(c->h, n->key, n->klen, n);
+  lru_push(c, n);
+  return 0;
+}
+
+typedef struct replay_t {
+  apr_pool_t *pool;
+  const char *prefix;
+  apr_hash_t *rootSets; /* "generation/root set" -> xsendfile_conf_t */
+  lru_t *caches;
+  int ncaches;
+
+  apr_uint64_t records;
+  apr_uint64_t replayed;
+  apr_uint64_t unresolved; /* neither in production nor now */
+  apr_uint64_t diverged; /* resolved in production, not against the snapshot */
+  apr_uint64_t skipped; /* unknown root set or version, X-Accel-Redirect */
+  apr_uint64_t resolveNs;
+  apr_uint64_t variantNs;
+  apr_uint64_t openNs;
+  apr_uint64_t outcomes[XSENDFILE_OUTCOME_MAX];
+  apr_uint64_t acceptEncoding[4];
+  apr_uint64_t conditional;
+} replay_t;
+
+static const char *const ae_names[4] = {
+  "unknown",
+  "none",
+  "gzip",
+  "other"
+};
+
+static APR_INLINE const char *get8(const char *s, apr_byte_t *v) {
+  *v = (apr_byte_t)*s;
+  return s + 1;
+}
+
+static APR_INLINE const char *get16(const char *s, apr_uint16_t *v) {
+  memcpy(v, s, sizeof(*v));
+  return s + sizeof(*v);
+}
+
+static APR_INLINE const char *get32(const char *s, apr_uint32_t *v) {
+  memcpy(v, s, sizeof(*v));
+  return s + sizeof(*v);
+}
+
+static APR_INLINE const char *get64(const char *s, apr_uint64_t *v) {
+  memcpy(v, s, sizeof(*v));
+  return s + sizeof(*v);
+}
+
+static const char *replay_path(replay_t *rp, apr_pool_t *p, const char *path, apr_size_t len) {
+  return apr_pstrcat(p, rp->prefix, apr_pstrmemdup(p, path, len), NULL);
+}
+
+static void replay_rootset(replay_t *rp, const char *s, const char *end) {
+  apr_uint32_t generation, rootSet;
+  apr_uint16_t count, i;
+  xsendfile_conf_t *conf;
+
+  s = get32(s, &generation);
+  s = get32(s, &rootSet);
+  s = get16(s, &count);
+
+  conf = xsendfile_config_create(rp->pool);
+  for (i = 0; i < count && s + 3 <= end; ++i) {
+    xsendfile_path_t *root = (xsendfile_path_t*)apr_array_push(conf->paths);
+    apr_byte_t allowFileDelete;
+    apr_uint16_t len;
+
+    s = get8(s, &allowFileDelete);
+    s = get16(s, &len);
+    root->path = replay_path(rp, rp->pool, s, len);
+    root->allowFileDelete = allowFileDelete;
+    root->limitRate = 0;
+    root->profile = &xsendfile_default_profile;
+    root->prefixLen = xsendfile_prefix_len(root->path);
+    root->id = XSENDFILE_ROOT_OTHER;
+    s += len;
+  }
+  apr_hash_set(rp->rootSets, apr_psprintf(rp->pool, "%u/%u", generation, rootSet),
+    APR_HASH_KEY_STRING, conf);
+}
+
+static void replay_decision(replay_t *rp, request_rec *r, const char *s) {
+  apr_uint32_t generation, rootSet, totalUs;
+  apr_uint64_t requestTime, start, resolveNs, variantNs, openNs = 0;
+  apr_byte_t outcome, variant, ae, cond, flags, root;
+  apr_uint16_t syscalls, fileLen, dirLen;
+  const char *file, *dir = NULL;
+  char *path = NULL;
+  xsendfile_conf_t *conf;
+  xsendfile_ctx_t ctx;
+  apr_status_t rv;
+  int i;
+
+  s = get32(s, &generation);
+  s = get32(s, &rootSet);
+  s = get64(s, &requestTime);
+  s = get32(s, &totalUs);
+  s = get8(s, &outcome);
+  s = get8(s, &variant);
+  s = get8(s, &ae);
+  s = get8(s, &cond);
+  s = get8(s, &flags);
+  s = get8(s, &root);
+  s = get16(s, &syscalls);
+  s = get16(s, &fileLen);
+  s = get16(s, &dirLen);
+
+  conf = apr_hash_get(rp->rootSets, apr_psprintf(r->pool, "%u/%u", generation, rootSet),
+    APR_HASH_KEY_STRING);
+  /* X-Accel-Redirect: the XSendFileMaps aren't logged */
+  if (!conf || outcome >= XSENDFILE_OUTCOME_MAX || ae > XSENDFILE_AE_OTHER
+    || (flags & XSENDFILE_DECISION_ACCEL)) {
+    rp->skipped++;
+    return;
+  }
+  rp->replayed++;
+  rp->outcomes[outcome]++;
+  rp->acceptEncoding[ae]++;
+  rp->conditional += cond != 0;
+
+  file = apr_pstrmemdup(r->pool, s, fileLen);
+  if (*file == '/') {
+    file = replay_path(rp, r->pool, s, fileLen);
+  }
+  if (dirLen) {
+    dir = replay_path(rp, r->pool, s + fileLen, dirLen);
+  }
+
+  /* a request for the script itself, so the script directory is taken as is */
+  r->the_request = dir ? (char*)"GET /x HTTP/1.1" : (char*)"";
+  r->uri = (char*)"/x";
+  r->filename = dir ? apr_pstrcat(r->pool, dir, "x", NULL) : NULL;
+  r->finfo.filetype = APR_REG;
+  if (ae == XSENDFILE_AE_GZIP) {
+    apr_table_setn(r->headers_in, "Accept-Encoding", "gzip");
+  }
+  else if (ae == XSENDFILE_AE_OTHER) {
+    apr_table_setn(r->headers_in, "Accept-Encoding", "identity");
+  }
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.root = -1;
+  rv = ap_xsendfile_get_filepath(r, conf, &ctx, file, flags & XSENDFILE_DECISION_TEMPORARY, &path);
+  resolveNs = ctx.phases[XSENDFILE_PHASE_ORIGIN] + ctx.phases[XSENDFILE_PHASE_RESOLVE];
+  variantNs = ctx.phases[XSENDFILE_PHASE_VARIANT];
+
+  if (rv == OK) {
+    apr_file_t *fd;
+    apr_finfo_t finfo;
+
+    start = xsendfile_clock();
+    if (apr_file_open(&fd, path, APR_READ | APR_BINARY, 0, r->pool) == APR_SUCCESS) {
+      apr_file_info_get(&finfo, APR_FINFO_NORM, fd);
+      apr_file_close(fd);
+    }
+    openNs = xsendfile_clock() - start;
+  }
+  else if ((signed char)root >= 0) {
+    rp->diverged++;
+  }
+  else {
+    rp->unresolved++;
+  }
+  rp->resolveNs += resolveNs;
+  rp->variantNs += variantNs;
+  rp->openNs += openNs;
+
+  for (i = 0; i < rp->ncaches; ++i) {
+    lru_t *c = &rp->caches[i];
+
+    switch (c->kind) {
+    case CACHE_PATH: {
+      const char *key = apr_pstrcat(r->pool, apr_ltoa(r->pool, rootSet), "\n",
+        dir ? dir : "", "\n", file, ae == XSENDFILE_AE_GZIP ? "\n+" : "\n", NULL);
+      if (lru_lookup(c, key, strlen(key))) {
+        c->savedNs += resolveNs + variantNs;
+      }
+      break;
+    }
+    case CACHE_METADATA:
+      if (rv == OK && lru_lookup(c, path, strlen(path))) {
+        c->savedNs += variantNs;
+      }
+      break;
+    case CACHE_FD:
+      if (rv == OK && lru_lookup(c, path, strlen(path))) {
+        c->savedNs += openNs;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+static int replay_file(replay_t *rp, const char *fname, apr_uint64_t limit) {
+  char rec[XSENDFILE_DECISIONLOG_MAXREC];
+  apr_pool_t *rpool;
+  request_rec *r;
+  FILE *fp;
+
+  if (!(fp = fopen(fname, "rb"))) {
+    perror(fname);
+    return -1;
+  }
+  apr_pool_create(&rpool, rp->pool);
+  r = shim_request_create(rp->pool);
+
+  while (!limit || rp->records < limit) {
+    apr_uint16_t len;
+
+    if (fread(rec, 1, 2, fp) != 2) {
+      break;
+    }
+    get16(rec, &len);
+    if (len < 4 || fread(rec + 2, 1, len - 2, fp) != (size_t)(len - 2)) {
+      fprintf(stderr, "%s: truncated record at %ld\n", fname, ftell(fp));
+      break;
+    }
+    if (rec[3] != XSENDFILE_DECISIONLOG_VERSION) {
+      rp->skipped++;
+      continue;
+    }
+
+    if (rec[2] == XSENDFILE_DECISIONLOG_ROOTSET) {
+      replay_rootset(rp, rec + 4, rec + len);
+    }
+    else if (rec[2] == XSENDFILE_DECISIONLOG_DECISION) {
+      rp->records++;
+      shim_request_reset(r, rpool);
+      replay_decision(rp, r, rec + 4);
+      apr_pool_clear(rpool);
+    }
+  }
+
+  apr_pool_destroy(rpool);
+  fclose(fp);
+  return 0;
+}
+
+static void replay_report(const replay_t *rp, int json) {
+  double n = rp->replayed ? (double)rp->replayed : 1;
+  double baseNs = (rp->resolveNs + rp->variantNs + rp->openNs) / n;
+  int i;
+
+  if (json) {
+    printf("{\"records\":%" APR_UINT64_T_FMT ",\"replayed\":%" APR_UINT64_T_FMT
+      ",\"skipped\":%" APR_UINT64_T_FMT ",\"unresolved\":%" APR_UINT64_T_FMT
+      ",\"diverged\":%" APR_UINT64_T_FMT ",\"resolve_ns\":%.0f,\"variant_ns\":%.0f"
+      ",\"open_ns\":%.0f,\"total_ns\":%.0f}\n",
+      rp->records, rp->replayed, rp->skipped, rp->unresolved, rp->diverged,
+      rp->resolveNs / n, rp->variantNs / n, rp->openNs / n, baseNs);
+    for (i = 0; i < rp->ncaches; ++i) {
+      const lru_t *c = &rp->caches[i];
+      printf("{\"cache\":\"%s\",\"size\":%d,\"lookups\":%" APR_UINT64_T_FMT
+        ",\"hits\":%" APR_UINT64_T_FMT ",\"ns_per_request\":%.0f}\n",
+        cache_names[c->kind], c->size, c->lookups, c->hits, baseNs - c->savedNs / n);
+    }
+    return;
+  }
+
+  printf("records %" APR_UINT64_T_FMT ", replayed %" APR_UINT64_T_FMT
+    ", skipped %" APR_UINT64_T_FMT ", unresolved %" APR_UINT64_T_FMT
+    ", diverged from production %" APR_UINT64_T_FMT "\n",
+    rp->records, rp->replayed, rp->skipped, rp->unresolved, rp->diverged);
+  printf("logged outcomes:");
+  for (i = 0; i < XSENDFILE_OUTCOME_MAX; ++i) {
+    printf(" %s %" APR_UINT64_T_FMT, xsendfile_outcome_names[i], rp->outcomes[i]);
+  }
+  printf("\naccept-encoding:");
+  for (i = 0; i < 4; ++i) {
+    printf(" %s %" APR_UINT64_T_FMT, ae_names[i], rp->acceptEncoding[i]);
+  }
+  printf("\nconditional: %" APR_UINT64_T_FMT "\n\n", rp->conditional);
+
+  printf("no cache: resolve %.0f ns, variant %.0f ns, open %.0f ns, total %.0f ns per request\n\n",
+    rp->resolveNs / n, rp->variantNs / n, rp->openNs / n, baseNs);
+  printf("%-10s %10s %8s %14s\n", "cache", "size", "hits", "ns/request");
+  for (i = 0; i < rp->ncaches; ++i) {
+    const lru_t *c = &rp->caches[i];
+    printf("%-10s %10d %7.1f%% %14.0f\n",
+      cache_names[c->kind], c->size,
+      c->lookups ? 100.0 * c->hits / c->lookups : 0.0,
+      baseNs - c->savedNs / n);
+  }
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+    "usage: %s [-s snapshot-prefix] [-c size,size,...] [-n max-records] [-j] decision.log...\n",
+    argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *sizes = "64,1024,16384,262144";
+  apr_uint64_t limit = 0;
+  int json = 0;
+  replay_t rp;
+  char *size, *last;
+  int opt, i, k;
+
+  memset(&rp, 0, sizeof(rp));
+  rp.prefix = "";
+  while ((opt = getopt(argc, argv, "s:c:n:jh")) != -1) {
+    switch (opt) {
+    case 's': rp.prefix = optarg; break;
+    case 'c': sizes = optarg; break;
+    case 'n': limit = (apr_uint64_t)apr_atoi64(optarg); break;
+    case 'j': json = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind >= argc) {
+    usage(argv[0]);
+  }
+
+  apr_app_initialize(&argc, (const char * const **)&argv, NULL);
+  atexit(apr_terminate);
+  apr_pool_create(&rp.pool, NULL);
+  rp.rootSets = apr_hash_make(rp.pool);
+
+  rp.caches = (lru_t*)apr_pcalloc(rp.pool, sizeof(lru_t) * CACHE_MAX * 64);
+  for (k = 0; k < CACHE_MAX; ++k) {
+    char *list = apr_pstrdup(rp.pool, sizes);
+    for (size = apr_strtok(list, ",", &last); size && rp.ncaches < CACHE_MAX * 64;
+        size = apr_strtok(NULL, ",", &last)) {
+      if (atoi(size) > 0) {
+        lru_init(&rp.caches[rp.ncaches++], rp.pool, (cache_kind_t)k, atoi(size));
+      }
+    }
+  }
+
+  for (i = optind; i < argc; ++i) {
+    if (replay_file(&rp, argv[i], limit) != 0) {
+      return 1;
+    }
+  }
+  replay_report(&rp, json);
+
+  return 0;
+}
@@ -0,0 +1,231 @@
+#!/bin/bash
+#
+# run-bench.sh - end-to-end benchmark of mod_xsendfile
+#
+# Builds the module with apxs, starts a throwaway httpd on loopback and
+# drives it with wrk over a matrix of
+#   - file sizes           SIZES="1k 64k 1m 64m"
+#   - white-listed paths   ROOTS="1 10 100"
+#   - gzip                 GZIP="0 1"        (Accept-Encoding: gzip, .js files)
+#   - conditional ratio    COND="0 0.5"      (share of requests with a matching If-None-Match)
+#   - MPMs                 MPMS="event worker prefork"
+#   - backend stub         BACKENDS="asis"   (asis: mod_asis, no fork; cgi: shell CGI)
+#   - XSendFileCork        CORK="off"        (e.g. CORK="off on" SIZES="1k 4k 16k")
+#   - XSendFileBucketSize  BUCKETS="off"     (e.g. BUCKETS="off 256k 1m 4m 16m" SIZES=64m)
+# Every run appends one JSON line to $OUT (default: results.jsonl) with
+# requests/s, p50/p99 latency and CPU time per request of all httpd
+# processes, so two versions can be compared with e.g. compare.sh, and
+# the TCP segments per request sent on the host (client included, as
+# counted in /proc/net/snmp).
+#
+# Requirements: apxs, httpd 2.4 with shared MPMs, mod_asis, mod_cgi(d),
+# wrk and curl.
+#
+#     ./run-bench.sh
+#     SIZES=1k ROOTS=1 MPMS=event DURATION=5 ./run-bench.sh
+#     SIZES="1k 2k 4k 8k 16k" ROOTS=1 GZIP=0 COND=0 CORK="off on" ./run-bench.sh
+#     SIZES="64k 64m" ROOTS=1 GZIP=0 COND=0 CONNS=256 BUCKETS="off 256k 1m 4m" ./run-bench.sh
+#
+set -eu
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+SRC=$(cd "$HERE/../.." && pwd)
+
+APXS=${APXS:-$(command -v apxs || command -v apxs2)}
+HTTPD=${HTTPD:-$("$APXS" -q SBINDIR)/$("$APXS" -q TARGET)}
+MODULES=${MODULES:-$("$APXS" -q LIBEXECDIR)}
+PORT=${PORT:-8089}
+DURATION=${DURATION:-10}
+CONNS=${CONNS:-64}
+THREADS=${THREADS:-4}
+SIZES=${SIZES:-"1k 64k 1m 64m"}
+ROOTS=${ROOTS:-"1 10 100"}
+GZIP=${GZIP:-"0 1"}
+COND=${COND:-"0 0.5"}
+MPMS=${MPMS:-"event worker prefork"}
+BACKENDS=${BACKENDS:-"asis"}
+CORK=${CORK:-"off"}
+BUCKETS=${BUCKETS:-"off"}
+OUT=${OUT:-$PWD/results.jsonl}
+WORK=${WORK:-$(mktemp -d /tmp/xsendfile-bench.XXXXXX)}
+
+VERSION=$(cd "$SRC" && git describe --always --dirty 2>/dev/null || echo unknown)
+CLK_TCK=$(getconf CLK_TCK)
+
+log() {
+  echo "run-bench: $*" >&2
+}
+
+size_bytes() {
+  case "$1" in
+    *k) echo $(( ${1%k} * 1024 )) ;;
+    *m) echo $(( ${1%m} * 1024 * 1024 )) ;;
+    *) echo "$1" ;;
+  esac
+}
+
+build() {
+  log "building module ($VERSION) in $WORK"
+  mkdir -p "$WORK/build" "$WORK/logs" "$WORK/htdocs" "$WORK/files"
+  cp "$SRC/mod_xsendfile.c" "$WORK/build/"
+  (cd "$WORK/build" && "$APXS" -c mod_xsendfile.c >/dev/null)
+}
+
+make_files() {
+  local size bytes
+  for size in $SIZES; do
+    bytes=$(size_bytes "$size")
+    # base64 text, so the .js variant actually compresses
+    head -c $(( bytes * 3 / 4 + 3 )) /dev/urandom | base64 -w 0 | head -c "$bytes" > "$WORK/files/file-$size.bin"
+    cp "$WORK/files/file-$size.bin" "$WORK/files/file-$size.js"
+  done
+}
+
+# roots: the first n-1 white-listed paths never match
+write_conf() {
+  local mpm=$1 roots=$2 cork=$3 buckets=$4 i
+  {
+    echo "ServerRoot \"$WORK\""
+    echo "Listen 127.0.0.1:$PORT"
+    echo "PidFile $WORK/logs/httpd.pid"
+    echo "ErrorLog $WORK/logs/error_log"
+    echo "LogLevel warn"
+    echo "DocumentRoot \"$WORK/htdocs\""
+    echo "LoadModule mpm_${mpm}_module $MODULES/mod_mpm_${mpm}.so"
+    for m in authz_core mime asis headers; do
+      echo "LoadModule ${m}_module $MODULES/mod_${m}.so"
+    done
+    if [ "$mpm" = prefork ]; then
+      echo "LoadModule cgi_module $MODULES/mod_cgi.so"
+    else
+      echo "LoadModule cgid_module $MODULES/mod_cgid.so"
+      echo "ScriptSock $WORK/logs/cgisock"
+    fi
+    echo "LoadModule xsendfile_module $WORK/build/.libs/mod_xsendfile.so"
+    echo "ServerLimit 16"
+    echo "MaxRequestWorkers 400"
+    echo "KeepAliveTimeout 30"
+    echo "MaxKeepAliveRequests 0"
+    echo "EnableSendfile On"
+    echo "<Directory \"$WORK/htdocs\">"
+    echo "  Require all granted"
+    echo "  Options +ExecCGI"
+    echo "  AddHandler send-as-is .asis"
+    echo "  AddHandler cgi-script .cgi"
+    echo "  XSendFile On"
+    echo "  XSendFileCork $cork"
+    echo "  XSendFileBucketSize $buckets"
+    echo "</Directory>"
+    for (( i = 1; i < roots; i++ )); do
+      echo "XSendFilePath \"$WORK/unused-$i\""
+    done
+    echo "XSendFilePath \"$WORK/files\""
+    echo "<Location /xsendfile-status>"
+    echo "  SetHandler xsendfile-status"
+    echo "</Location>"
+  } > "$WORK/httpd.conf"
+}
+
+# one stub per file and backend: /<name>.asis and /<name>.cgi
+write_stubs() {
+  local f name
+  for f in "$WORK"/files/*; do
+    name=$(basename "$f")
+    printf 'Status: 200 OK\nContent-Type: application/octet-stream\nX-Sendfile: %s\n\n' "$f" > "$WORK/htdocs/$name.asis"
+    printf '#!/bin/sh\nprintf "Content-Type: application/octet-stream\\r\\nX-Sendfile: %s\\r\\n\\r\\n"\n' "$f" > "$WORK/htdocs/$name.cgi"
+    chmod +x "$WORK/htdocs/$name.cgi"
+  done
+}
+
+start_httpd() {
+  "$HTTPD" -f "$WORK/httpd.conf" -k start
+  for _ in $(seq 50); do
+    curl -fs -o /dev/null "http://127.0.0.1:$PORT/xsendfile-status" && return 0
+    sleep 0.1
+  done
+  log "httpd did not come up, see $WORK/logs/error_log"
+  exit 1
+}
+
+stop_httpd() {
+  local pid
+  pid=$(cat "$WORK/logs/httpd.pid" 2>/dev/null) || return 0
+  "$HTTPD" -f "$WORK/httpd.conf" -k stop
+  while kill -0 "$pid" 2>/dev/null; do
+    sleep 0.1
+  done
+}
+
+# TCP segments sent by the host so far
+tcp_out_segs() {
+  awk '$1 == "Tcp:" && !n { for (i = 2; i <= NF; i++) col[$i] = i; n = 1; next }
+       $1 == "Tcp:" { print $col["OutSegs"] }' /proc/net/snmp
+}
+
+# user+system clock ticks of the parent and all its children
+httpd_ticks() {
+  local ppid total=0 pid t
+  ppid=$(cat "$WORK/logs/httpd.pid")
+  for pid in $ppid $(pgrep -P "$ppid"); do
+    t=$(awk '{ print $14 + $15 }' "/proc/$pid/stat" 2>/dev/null || echo 0)
+    total=$(( total + t ))
+  done
+  echo "$total"
+}
+
+run_one() {
+  local mpm=$1 roots=$2 size=$3 gzip=$4 cond=$5 backend=$6 cork=$7 buckets=$8
+  local ext=bin url etag t0 t1 s0 s1 result requests rps p50 p99 cpu segs
+  local hdr=()
+
+  if [ "$gzip" = 1 ]; then
+    ext=js
+    hdr=(-H "Accept-Encoding: gzip")
+  fi
+  url="http://127.0.0.1:$PORT/file-$size.$ext.$backend"
+
+  # warm up, creates the .gz variant and gets us the ETag
+  etag=$(curl -fs -o /dev/null -D - ${hdr[@]+"${hdr[@]}"} "$url" \
+    | awk 'tolower($1) == "etag:" { sub(/\r$/, "", $2); print $2 }')
+
+  t0=$(httpd_ticks)
+  s0=$(tcp_out_segs)
+  result=$(ETAG="$etag" GZIP="$gzip" COND_RATIO="$cond" \
+    wrk -t "$THREADS" -c "$CONNS" -d "${DURATION}s" -s "$HERE/bench.lua" "$url" | tail -n 1)
+  t1=$(httpd_ticks)
+  s1=$(tcp_out_segs)
+
+  read -r requests rps p50 p99 <<< "$result"
+  cpu=$(awk -v d=$(( t1 - t0 )) -v hz="$CLK_TCK" -v n="$requests" 'BEGIN { printf "%.2f", n ? d / hz * 1e6 / n : 0 }')
+  segs=$(awk -v d=$(( s1 - s0 )) -v n="$requests" 'BEGIN { printf "%.2f", n ? d / n : 0 }')
+
+  printf '{"version":"%s","mpm":"%s","backend":"%s","roots":%d,"size":"%s","gzip":%d,"cond":%s,"cork":"%s","buckets":"%s","conns":%d,"requests":%d,"rps":%s,"p50_us":%d,"p99_us":%d,"cpu_us_per_req":%s,"segs_per_req":%s}\n' \
+    "$VERSION" "$mpm" "$backend" "$roots" "$size" "$gzip" "$cond" "$cork" "$buckets" "$CONNS" "$requests" "$rps" "$p50" "$p99" "$cpu" "$segs" | tee -a "$OUT"
+}
+
+trap stop_httpd EXIT
+
+build
+make_files
+write_stubs
+for mpm in $MPMS; do
+  for roots in $ROOTS; do
+    for cork in $CORK; do
+      for buckets in $BUCKETS; do
+        write_conf "$mpm" "$roots" "$cork" "$buckets"
+        start_httpd
+        for backend in $BACKENDS; do
+          for size in $SIZES; do
+            for gzip in $GZIP; do
+              for cond in $COND; do
+                run_one "$mpm" "$roots" "$size" "$gzip" "$cond" "$backend" "$cork" "$buckets"
+              done
+            done
+          done
+        done
+        stop_httpd
+      done
+    done
+  done
+done
+log "results appended to $OUT"
@@ -0,0 +1,300 @@
+#!/bin/bash
+#
+# run-syscalls.sh - file system calls per X-Sendfile response, checked
+# against the budgets in budgets/*.budget
+#
+# Builds the module with apxs and, for every scenario, starts a throwaway
+# single process httpd (-X, prefork) on loopback, attaches strace -c to it
+# and sends the scenario's request COUNT times, then the same number of
+# requests for a plain .asis response without X-Sendfile. The difference,
+# per request, is what the module costs: its own calls, those of
+# sub-requests it makes and those APR makes on its behalf. Before
+# counting, every request is sent a few times, so .gz variants exist and
+# caches are warm, unless the scenario is a cold one.
+#
+# The calls are grouped like the module's own counters (stat, open,
+# close, getxattr, fadvise, spawn; other being readlink, access,
+# getdents, rename, unlink and setxattr). A group not listed in the
+# budget file has a budget of 0. Any group over budget fails the run
+# (exit status 1); -u writes the counted numbers into the budget files
+# instead, e.g. after a deliberate change, for review along with it.
+# Budgets are only ever written by -u, which marks them with a measured
+# line; a scenario without one is counted and reported, but not checked.
+#
+# A budget file holds the scenario, then the budget:
+#   file <name>           the file sent (app.bin or app.js)
+#   header <Name: value>  request header; $ETAG is the file's ETag
+#   profile <options>     XSendFileProfile options of the file's root
+#   method HEAD           HEAD rather than GET requests
+#   temporary             sent as X-Sendfile-Temporary from an
+#                         AllowFileDelete root, a fresh copy per request
+#   roots <n>             a relative X-Sendfile value, the file being in
+#                         the last of n XSendFilePaths
+#   cold                  no warm-up requests; as root, the dentry and
+#                         inode caches are dropped before every request
+#   measured <version>    written by -u, with the budget lines
+#   <group> <calls>       calls per request
+#
+# Requirements: apxs, httpd 2.4 with mod_mpm_prefork and mod_asis,
+# strace and curl; ptrace permission on httpd (root, or
+# kernel.yama.ptrace_scope=0).
+#
+#     ./run-syscalls.sh
+#     ./run-syscalls.sh identity gzip-fresh
+#     ./run-syscalls.sh -u
+#
+set -eu
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+SRC=$(cd "$HERE/../.." && pwd)
+
+APXS=${APXS:-$(command -v apxs || command -v apxs2)}
+HTTPD=${HTTPD:-$("$APXS" -q SBINDIR)/$("$APXS" -q TARGET)}
+MODULES=${MODULES:-$("$APXS" -q LIBEXECDIR)}
+PORT=${PORT:-8089}
+COUNT=${COUNT:-20}
+BUDGETS=${BUDGETS:-$HERE/budgets}
+WORK=${WORK:-$(mktemp -d /tmp/xsendfile-syscalls.XXXXXX)}
+GROUPS_ALL="stat open close getxattr fadvise spawn other"
+
+UPDATE=0
+if [ "${1:-}" = -u ]; then
+  UPDATE=1
+  shift
+fi
+
+VERSION=$(cd "$SRC" && git describe --always --dirty 2>/dev/null || echo unknown)
+HTTPD_PID=
+
+log() {
+  echo "run-syscalls: $*" >&2
+}
+
+build() {
+  log "building module ($VERSION) in $WORK"
+  mkdir -p "$WORK/build" "$WORK/logs" "$WORK/htdocs" "$WORK/files"
+  cp "$SRC/mod_xsendfile.c" "$WORK/build/"
+  (cd "$WORK/build" && "$APXS" -c mod_xsendfile.c >/dev/null)
+}
+
+make_files() {
+  # base64 text, so the .js variant actually compresses
+  head -c 12288 /dev/urandom | base64 -w 0 > "$WORK/files/app.bin"
+  cp "$WORK/files/app.bin" "$WORK/files/app.js"
+  printf 'Status: 200 OK\nContent-Type: text/plain\n\n' > "$WORK/htdocs/baseline.asis"
+}
+
+write_conf() {
+  local profile=$1 roots=$2 options=$3 i
+  {
+    echo "ServerRoot \"$WORK\""
+    echo "Listen 127.0.0.1:$PORT"
+    echo "PidFile $WORK/logs/httpd.pid"
+    echo "ErrorLog $WORK/logs/error_log"
+    echo "LogLevel warn"
+    echo "DocumentRoot \"$WORK/htdocs\""
+    echo "LoadModule mpm_prefork_module $MODULES/mod_mpm_prefork.so"
+    for m in authz_core mime asis; do
+      echo "LoadModule ${m}_module $MODULES/mod_${m}.so"
+    done
+    echo "LoadModule xsendfile_module $WORK/build/.libs/mod_xsendfile.so"
+    echo "EnableSendfile On"
+    echo "<Directory \"$WORK/htdocs\">"
+    echo "  Require all granted"
+    echo "  AddHandler send-as-is .asis"
+    echo "  XSendFile On"
+    echo "</Directory>"
+    # relative values are tried against these in turn, the script
+    # directory first
+    for (( i = 1; i < roots; i++ )); do
+      mkdir -p "$WORK/decoy$i"
+      echo "XSendFilePath \"$WORK/decoy$i\""
+    done
+    if [ -n "$profile" ]; then
+      echo "XSendFileProfile budget $profile"
+      options="$options Profile=budget"
+    fi
+    echo "XSendFilePath \"$WORK/files\"$options"
+  } > "$WORK/httpd.conf"
+}
+
+start_httpd() {
+  "$HTTPD" -X -f "$WORK/httpd.conf" &
+  HTTPD_PID=$!
+  for _ in $(seq 50); do
+    curl -fs -o /dev/null "http://127.0.0.1:$PORT/baseline.asis" && return 0
+    sleep 0.1
+  done
+  log "httpd did not come up, see $WORK/logs/error_log"
+  exit 1
+}
+
+stop_httpd() {
+  [ -n "$HTTPD_PID" ] || return 0
+  kill "$HTTPD_PID" 2>/dev/null || true
+  wait "$HTTPD_PID" 2>/dev/null || true
+  HTTPD_PID=
+}
+
+# before every counted request: a fresh temporary file, cold caches
+prepare() {
+  if [ -n "$TEMPORARY" ]; then
+    cp "$WORK/files/$TEMPORARY" "$WORK/files/tmp-$TEMPORARY"
+  fi
+  if [ -n "$COLD" ] && [ -w /proc/sys/vm/drop_caches ]; then
+    sync
+    echo 2 > /proc/sys/vm/drop_caches
+  fi
+}
+
+# group <calls> lines of strace -c output, summed up
+count() {
+  local out=$1 url=$2 i spid
+  shift 2
+  strace -c -f -q -e trace=%file,%desc,%process -o "$out" -p "$HTTPD_PID" &
+  spid=$!
+  sleep 0.5
+  for (( i = 0; i < COUNT; i++ )); do
+    prepare
+    curl -fs -o /dev/null "$@" "$url" || true
+  done
+  sleep 0.2
+  kill -INT "$spid"
+  wait "$spid" 2>/dev/null || true
+  awk '
+    BEGIN {
+      split("stat lstat fstat newfstatat fstatat64 statx stat64 lstat64 fstat64", a); for (i in a) g[a[i]] = "stat"
+      split("open openat openat2 creat", a); for (i in a) g[a[i]] = "open"
+      split("getxattr lgetxattr fgetxattr", a); for (i in a) g[a[i]] = "getxattr"
+      split("fadvise64 fadvise64_64", a); for (i in a) g[a[i]] = "fadvise"
+      split("clone clone3 fork vfork", a); for (i in a) g[a[i]] = "spawn"
+      split("readlink readlinkat access faccessat faccessat2 getdents getdents64 rename renameat renameat2 unlink unlinkat setxattr lsetxattr fsetxattr", a); for (i in a) g[a[i]] = "other"
+      g["close"] = "close"
+    }
+    /^-/ { table = 1; next }
+    table && $NF in g { sum[g[$NF]] += $4 }
+    END { for (k in sum) print k, sum[k] }
+  ' "$out"
+}
+
+run_one() {
+  local budget=$1 name file profile roots header value options measured line key etag url over=0 group n b
+  local hdr=() req=()
+  name=$(basename "$budget" .budget)
+  file=
+  profile=
+  roots=1
+  header=X-Sendfile
+  options=
+  measured=
+  TEMPORARY=
+  COLD=
+  while read -r key value; do
+    case "$key" in
+      file) file=$value ;;
+      profile) profile=$value ;;
+      method) [ "$value" = HEAD ] && req+=(-I) ;;
+      temporary) header=X-Sendfile-Temporary; options=" AllowFileDelete" ;;
+      roots) roots=$value ;;
+      cold) COLD=1 ;;
+      measured) measured=$value ;;
+    esac
+  done < <(grep -v '^#' "$budget")
+
+  value="$WORK/files/$file"
+  if [ "$roots" -gt 1 ]; then
+    value=$file
+  fi
+  if [ -n "$options" ]; then
+    TEMPORARY=$file
+    value="$WORK/files/tmp-$file"
+  fi
+  printf 'Status: 200 OK\nContent-Type: application/octet-stream\n%s: %s\n\n' "$header" "$value" > "$WORK/htdocs/$name.asis"
+  rm -f "$WORK/files/"*.gz
+  write_conf "$profile" "$roots" "$options"
+  start_httpd
+
+  url="http://127.0.0.1:$PORT/$name.asis"
+  etag=
+  if grep -q '\$ETAG' "$budget"; then
+    prepare
+    etag=$(curl -fs -o /dev/null -D - "$url" | awk 'tolower($1) == "etag:" { sub(/\r$/, "", $2); print $2 }')
+  fi
+  while read -r key value; do
+    [ "$key" = header ] && req+=(-H "${value//\$ETAG/$etag}")
+  done < <(grep -v '^#' "$budget")
+  if [ -z "$COLD" ]; then
+    for _ in 1 2 3; do
+      prepare
+      curl -fs -o /dev/null ${req[@]+"${req[@]}"} "$url" || true
+      curl -fs -o /dev/null "http://127.0.0.1:$PORT/baseline.asis" || true
+    done
+  fi
+
+  count "$WORK/logs/$name.strace" "$url" ${req[@]+"${req[@]}"} > "$WORK/logs/$name.calls"
+  # the baseline the same way, HEAD or not, cold or not
+  TEMPORARY=
+  count "$WORK/logs/baseline.strace" "http://127.0.0.1:$PORT/baseline.asis" ${req[@]+"${req[@]}"} > "$WORK/logs/baseline.calls"
+  COLD=
+  stop_httpd
+
+  : > "$WORK/logs/$name.result"
+  for group in $GROUPS_ALL; do
+    n=$(awk -v g="$group" -v c="$COUNT" '
+      FILENAME == ARGV[1] && $1 == g { s += $2 }
+      FILENAME == ARGV[2] && $1 == g { s -= $2 }
+      END { n = int(s / c + 0.5); print n > 0 ? n : 0 }
+    ' "$WORK/logs/$name.calls" "$WORK/logs/baseline.calls")
+    b=$(awk -v g="$group" '$1 == g { print $2 }' "$budget")
+    b=${b:-0}
+    if [ -z "$measured" ]; then
+      [ "$n" -gt 0 ] && printf '%-14s %-9s %3d  no budget yet, record with -u\n' "$name" "$group" "$n"
+    elif [ "$n" -gt "$b" ]; then
+      over=1
+      printf '%-14s %-9s %3d  over budget (%d)\n' "$name" "$group" "$n" "$b"
+    elif [ "$n" -lt "$b" ]; then
+      printf '%-14s %-9s %3d  under budget (%d), tighten with -u\n' "$name" "$group" "$n" "$b"
+    elif [ "$n" -gt 0 ]; then
+      printf '%-14s %-9s %3d\n' "$name" "$group" "$n"
+    fi
+    [ "$n" -gt 0 ] && printf '%s\t%d\n' "$group" "$n" >> "$WORK/logs/$name.result"
+  done
+
+  if [ "$UPDATE" = 1 ]; then
+    # the scenario and comments stay, the budget lines are replaced
+    {
+      awk -v groups="$GROUPS_ALL" 'BEGIN { n = split(groups, a); for (i = 1; i <= n; i++) g[a[i]] = 1 } !($1 in g) && $1 != "measured" && !/^# not measured yet/' "$budget"
+      printf 'measured\t%s %s\n' "$VERSION" "$("$HTTPD" -v | awk '/version/ { print $3 }')"
+      cat "$WORK/logs/$name.result"
+    } > "$budget.new"
+    mv "$budget.new" "$budget"
+    return 0
+  fi
+  [ -n "$measured" ] || UNMEASURED=$((UNMEASURED + 1))
+  return $over
+}
+
+trap stop_httpd EXIT
+
+build
+make_files
+failed=0
+UNMEASURED=0
+if [ $# -eq 0 ]; then
+  set -- "$BUDGETS"/*.budget
+fi
+for b in "$@"; do
+  [ -f "$b" ] || b="$BUDGETS/$b.budget"
+  run_one "$b" || failed=1
+done
+if [ "$failed" = 1 ]; then
+  log "over budget, see above; strace output in $WORK/logs"
+  exit 1
+fi
+if [ "$UPDATE" = 1 ]; then
+  log "budgets written, review them with the change"
+elif [ "$UNMEASURED" -gt 0 ]; then
+  log "within budget; $UNMEASURED scenario(s) have no measured budget yet, run with -u"
+else
+  log "all within budget"
+fi
@@ -0,0 +1,272 @@
+/****
+ * scaling.c: path resolution cost against a large tree made by gentree.c
+ *
+ * For each number of white-listed paths (1, 10, 100 and 1000 unless given
+ * with -R), the sampled files of the tree are resolved through the module's
+ * own ap_xsendfile_get_filepath (with Accept-Encoding: gzip, so including
+ * the .gz variant lookup) and opened, fstat()ed and closed like the output
+ * filter would, timing each part.
+ *
+ * The header values are absolute, as most applications send them, so
+ * every white-listed path in front of the matching one is tried in turn.
+ * The tree's roots are placed last in the list (-a first: first), padded
+ * with non-matching paths up to the wanted count.
+ *
+ * With -l, XSendFileLearnedOrder is on, learning from the warm-up pass.
+ *
+ * Every configuration is run cold first, i.e. after dropping the dentry
+ * and inode caches (needs root; skipped otherwise, or with -w), then warm
+ * until -t milliseconds have passed.
+ *
+ * Build with build-microbench.sh, then
+ *     ./gentree -d 12 -f 4 -n 3 -r 1000 /mnt/bench/tree
+ *     sudo ./scaling /mnt/bench/tree
+ *
+ * Licensed under the Apache License, Version 2.0, see mod_xsendfile.c
+ ****/
+
+#include "../../mod_xsendfile.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "apr_general.h"
+
+#include "shim.h"
+
+typedef struct scaling_file_t {
+  int root;
+  const char *rel;
+} scaling_file_t;
+
+typedef struct scaling_result_t {
+  apr_uint64_t ops;
+  apr_uint64_t failed;
+  apr_uint64_t resolveNs;
+  apr_uint64_t variantNs;
+  apr_uint64_t openNs;
+} scaling_result_t;
+
+static int scaling_load(apr_pool_t *p, const char *tree, apr_array_header_t **files, int *roots) {
+  const char *fname = apr_pstrcat(p, tree, "/paths.tsv", NULL);
+  char line[8192];
+  FILE *fp;
+
+  if (!(fp = fopen(fname, "r"))) {
+    perror(fname);
+    return -1;
+  }
+  *files = apr_array_make(p, 100000, sizeof(scaling_file_t));
+  *roots = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    char *tab = strchr(line, '\t');
+    scaling_file_t *f;
+
+    line[strcspn(line, "\r\n")] = '\0';
+    if (!tab) {
+      continue;
+    }
+    f = (scaling_file_t*)apr_array_push(*files);
+    f->root = atoi(line);
+    f->rel = apr_pstrdup(p, tab + 1);
+    if (f->root >= *roots) {
+      *roots = f->root + 1;
+    }
+  }
+  fclose(fp);
+  return (*files)->nelts ? 0 : -1;
+}
+
+/* 1 if the caches got dropped */
+static int scaling_drop_caches(void) {
+  FILE *fp;
+
+  sync();
+  if (!(fp = fopen("/proc/sys/vm/drop_caches", "w"))) {
+    return 0;
+  }
+  /* dentries and inodes */
+  fputs("2\n", fp);
+  return fclose(fp) == 0;
+}
+
+static void scaling_pass(xsendfile_conf_t *conf, const char *tree,
+    const apr_array_header_t *files, int nroots, request_rec *r, apr_pool_t *rp,
+    scaling_result_t *res) {
+  const scaling_file_t *f = (const scaling_file_t*)files->elts;
+  int i;
+
+  for (i = 0; i < files->nelts; ++i) {
+    xsendfile_ctx_t ctx;
+    char *path = NULL;
+    const char *file;
+    apr_uint64_t start;
+    apr_file_t *fd;
+    apr_finfo_t finfo;
+
+    if (f[i].root >= nroots) {
+      continue;
+    }
+
+    shim_request_reset(r, rp);
+    r->the_request = (char*)"";
+    apr_table_setn(r->headers_in, "Accept-Encoding", "gzip");
+    file = apr_psprintf(rp, "%s/root%04d/%s", tree, f[i].root, f[i].rel);
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.root = -1;
+    res->ops++;
+    if (ap_xsendfile_get_filepath(r, conf, &ctx, file, 0, &path) != OK) {
+      res->failed++;
+      apr_pool_clear(rp);
+      continue;
+    }
+    res->resolveNs += ctx.phases[XSENDFILE_PHASE_RESOLVE];
+    res->variantNs += ctx.phases[XSENDFILE_PHASE_VARIANT];
+
+    start = xsendfile_clock();
+    if (apr_file_open(&fd, path, APR_READ | APR_BINARY, 0, rp) == APR_SUCCESS) {
+      apr_file_info_get(&finfo, APR_FINFO_NORM, fd);
+      apr_file_close(fd);
+    }
+    else {
+      res->failed++;
+    }
+    res->openNs += xsendfile_clock() - start;
+
+    apr_pool_clear(rp);
+  }
+}
+
+static void scaling_report(int nroots, int configured, const char *cache,
+    const scaling_result_t *res, int json) {
+  double n = res->ops - res->failed ? (double)(res->ops - res->failed) : 1;
+
+  if (json) {
+    printf("{\"roots\":%d,\"tree_roots\":%d,\"cache\":\"%s\",\"ops\":%" APR_UINT64_T_FMT
+      ",\"failed\":%" APR_UINT64_T_FMT ",\"resolve_ns\":%.0f,\"variant_ns\":%.0f,\"open_ns\":%.0f}\n",
+      configured, nroots, cache, res->ops, res->failed,
+      res->resolveNs / n, res->variantNs / n, res->openNs / n);
+  }
+  else {
+    printf("%8d %10d %6s %10" APR_UINT64_T_FMT " %8" APR_UINT64_T_FMT " %12.0f %12.0f %12.0f\n",
+      configured, nroots, cache, res->ops, res->failed,
+      res->resolveNs / n, res->variantNs / n, res->openNs / n);
+  }
+}
+
+static void usage(const char *argv0) {
+  fprintf(stderr,
+    "usage: %s [-R roots,roots,...] [-a first|last] [-l] [-t ms] [-w] [-j] <tree>\n",
+    argv0);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *counts = "1,10,100,1000";
+  const char *tree;
+  apr_uint64_t minNs = 2000 * 1000000ULL;
+  int first = 0, cold = 1, json = 0, learned = 0;
+  apr_array_header_t *files;
+  apr_pool_t *p, *rp;
+  request_rec *r;
+  char *count, *last;
+  int opt, treeRoots;
+
+  while ((opt = getopt(argc, argv, "R:a:lt:wjh")) != -1) {
+    switch (opt) {
+    case 'R': counts = optarg; break;
+    case 'a': first = strcmp(optarg, "first") == 0; break;
+    case 'l': learned = 1; break;
+    case 't': minNs = (apr_uint64_t)atoi(optarg) * 1000000; break;
+    case 'w': cold = 0; break;
+    case 'j': json = 1; break;
+    default: usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+  }
+  /* the header values and white-listed paths have to be absolute */
+  if (!(tree = realpath(argv[optind], NULL))) {
+    perror(argv[optind]);
+    return 1;
+  }
+
+  apr_app_initialize(&argc, (const char * const **)&argv, NULL);
+  atexit(apr_terminate);
+  apr_pool_create(&p, NULL);
+  apr_pool_create(&rp, p);
+  r = shim_request_create(p);
+
+  if (scaling_load(p, tree, &files, &treeRoots) != 0) {
+    fprintf(stderr, "%s: no sampled files, run gentree first\n", tree);
+    return 1;
+  }
+  if (cold && geteuid() != 0) {
+    fprintf(stderr, "scaling: not root, can't drop caches, warm runs only\n");
+    cold = 0;
+  }
+
+  if (!json) {
+    printf("%8s %10s %6s %10s %8s %12s %12s %12s\n",
+      "roots", "tree roots", "cache", "ops", "failed", "resolve ns", "variant ns", "open ns");
+  }
+
+  for (count = apr_strtok(apr_pstrdup(p, counts), ",", &last); count;
+      count = apr_strtok(NULL, ",", &last)) {
+    int configured = atoi(count);
+    int nroots = configured < treeRoots ? configured : treeRoots;
+    xsendfile_conf_t *conf;
+    scaling_result_t res;
+    apr_uint64_t start;
+    int i;
+
+    if (configured < 1) {
+      continue;
+    }
+
+    conf = xsendfile_config_create(p);
+    if (learned) {
+      /* just the learned order's part of the statistics, fresh for every count */
+      xsendfile_stats = (xsendfile_stats_t*)apr_pcalloc(p, sizeof(xsendfile_stats_t));
+      conf->learnedOrder = XSENDFILE_ENABLED;
+    }
+    for (i = 0; i < configured; ++i) {
+      xsendfile_path_t *root = (xsendfile_path_t*)apr_array_push(conf->paths);
+      int real = first ? i < nroots : i >= configured - nroots;
+
+      root->path = real
+        ? apr_psprintf(p, "%s/root%04d", tree, first ? i : i - (configured - nroots))
+        : apr_psprintf(p, "%s/decoy%04d", tree, i);
+      root->allowFileDelete = 0;
+      root->limitRate = 0;
+      root->profile = &xsendfile_default_profile;
+      root->prefixLen = xsendfile_prefix_len(root->path);
+      /* ids of their own, for the learned order to tell them apart */
+      root->id = i < XSENDFILE_ROOT_OTHER ? i : XSENDFILE_ROOT_OTHER;
+    }
+
+    if (cold && scaling_drop_caches()) {
+      memset(&res, 0, sizeof(res));
+      scaling_pass(conf, tree, files, nroots, r, rp, &res);
+      scaling_report(nroots, configured, "cold", &res, json);
+    }
+
+    memset(&res, 0, sizeof(res));
+    /* one pass to warm up, not counted */
+    {
+      scaling_result_t warmup;
+      memset(&warmup, 0, sizeof(warmup));
+      scaling_pass(conf, tree, files, nroots, r, rp, &warmup);
+    }
+    start = xsendfile_clock();
+    do {
+      scaling_pass(conf, tree, files, nroots, r, rp, &res);
+    } while (xsendfile_clock() - start < minNs);
+    scaling_report(nroots, configured, "warm", &res, json);
+  }
+
+  apr_pool_destroy(p);
+  return 0;
+}
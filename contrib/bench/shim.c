@@ -0,0 +1,197 @@
+/****
+ * shim.c: just enough of httpd to run mod_xsendfile's request-time helpers
+ * outside of the server, see microbench.c
+ *
+ * Only what the benchmarked functions actually call is implemented here;
+ * everything else the module references (hooks, filters, logging) is left
+ * unresolved on purpose, see build-microbench.sh.
+ *
+ * ap_get_token() is a copy of the one in httpd's server/util.c.
+ *
+ * Licensed under the Apache License, Version 2.0, see mod_xsendfile.c
+ ****/
+
+#include <stdarg.h>
+#include <string.h>
+
+#include "apr_lib.h"
+#include "apr_strings.h"
+#include "apr_tables.h"
+
+#include "httpd.h"
+#include "http_request.h"
+
+#include "shim.h"
+
+const char *shim_document_root = "/srv/www/htdocs";
+apr_uint64_t shim_allocs = 0;
+
+request_rec *shim_request_create(apr_pool_t *p) {
+  request_rec *r = (request_rec*)apr_pcalloc(p, sizeof(request_rec));
+  r->server = (server_rec*)apr_pcalloc(p, sizeof(server_rec));
+  shim_request_reset(r, p);
+  return r;
+}
+
+void shim_request_reset(request_rec *r, apr_pool_t *p) {
+  r->pool = p;
+  r->headers_in = apr_table_make(p, 8);
+  r->headers_out = apr_table_make(p, 8);
+  r->err_headers_out = apr_table_make(p, 4);
+  r->notes = apr_table_make(p, 4);
+  r->status = HTTP_OK;
+  r->finfo.filetype = APR_REG;
+}
+
+AP_DECLARE(char *) ap_get_token(apr_pool_t *p, const char **accept_line,
+                                int accept_white) {
+  const char *ptr = *accept_line;
+  const char *tok_start;
+  char *token;
+
+  /* Find first non-white byte */
+  while (apr_isspace(*ptr)) {
+    ++ptr;
+  }
+
+  tok_start = ptr;
+
+  /* find token end, skipping over quoted strings.
+   * (comments are already gone).
+   */
+  while (*ptr && (accept_white || !apr_isspace(*ptr))
+         && *ptr != ';' && *ptr != ',') {
+    if (*ptr++ == '"') {
+      while (*ptr) {
+        if (*ptr++ == '"') {
+          break;
+        }
+      }
+    }
+  }
+
+  token = apr_pstrmemdup(p, tok_start, ptr - tok_start);
+
+  /* Advance accept_line pointer to the next non-white byte */
+  while (apr_isspace(*ptr)) {
+    ++ptr;
+  }
+
+  *accept_line = ptr;
+  return token;
+}
+
+/* a "lookup" that maps straight into the document root */
+AP_DECLARE(request_rec *) ap_sub_req_lookup_uri(const char *new_uri,
+                                                const request_rec *r,
+                                                ap_filter_t *next_filter) {
+  apr_pool_t *p;
+  request_rec *sr;
+  const char *q;
+
+  if (apr_pool_create(&p, r->pool) != APR_SUCCESS) {
+    return NULL;
+  }
+  sr = (request_rec*)apr_pcalloc(p, sizeof(request_rec));
+  sr->pool = p;
+  sr->main = (request_rec*)r;
+  q = strchr(new_uri, '?');
+  sr->uri = q ? apr_pstrmemdup(p, new_uri, q - new_uri) : apr_pstrdup(p, new_uri);
+  sr->filename = apr_pstrcat(p, shim_document_root, sr->uri, NULL);
+  sr->finfo.filetype = APR_REG;
+  return sr;
+}
+
+AP_DECLARE(void) ap_destroy_sub_req(request_rec *r) {
+  apr_pool_destroy(r->pool);
+}
+
+/*
+  allocation counting, see build-microbench.sh for the matching
+  -Wl,--wrap options
+*/
+void *__real_apr_palloc(apr_pool_t *p, apr_size_t size);
+void *__real_apr_pcalloc(apr_pool_t *p, apr_size_t size);
+char *__real_apr_pstrdup(apr_pool_t *p, const char *s);
+char *__real_apr_pstrmemdup(apr_pool_t *p, const char *s, apr_size_t n);
+char *__real_apr_pstrndup(apr_pool_t *p, const char *s, apr_size_t n);
+void *__real_apr_pmemdup(apr_pool_t *p, const void *m, apr_size_t n);
+apr_array_header_t *__real_apr_array_make(apr_pool_t *p, int nelts, int elt_size);
+apr_table_t *__real_apr_table_make(apr_pool_t *p, int nelts);
+
+void *__wrap_apr_palloc(apr_pool_t *p, apr_size_t size) {
+  ++shim_allocs;
+  return __real_apr_palloc(p, size);
+}
+
+void *__wrap_apr_pcalloc(apr_pool_t *p, apr_size_t size) {
+  ++shim_allocs;
+  return __real_apr_pcalloc(p, size);
+}
+
+char *__wrap_apr_pstrdup(apr_pool_t *p, const char *s) {
+  ++shim_allocs;
+  return __real_apr_pstrdup(p, s);
+}
+
+char *__wrap_apr_pstrmemdup(apr_pool_t *p, const char *s, apr_size_t n) {
+  ++shim_allocs;
+  return __real_apr_pstrmemdup(p, s, n);
+}
+
+char *__wrap_apr_pstrndup(apr_pool_t *p, const char *s, apr_size_t n) {
+  ++shim_allocs;
+  return __real_apr_pstrndup(p, s, n);
+}
+
+void *__wrap_apr_pmemdup(apr_pool_t *p, const void *m, apr_size_t n) {
+  ++shim_allocs;
+  return __real_apr_pmemdup(p, m, n);
+}
+
+apr_array_header_t *__wrap_apr_array_make(apr_pool_t *p, int nelts, int elt_size) {
+  ++shim_allocs;
+  return __real_apr_array_make(p, nelts, elt_size);
+}
+
+apr_table_t *__wrap_apr_table_make(apr_pool_t *p, int nelts) {
+  ++shim_allocs;
+  return __real_apr_table_make(p, nelts);
+}
+
+char *__wrap_apr_psprintf(apr_pool_t *p, const char *fmt, ...) {
+  va_list ap;
+  char *res;
+
+  ++shim_allocs;
+  va_start(ap, fmt);
+  res = apr_pvsprintf(p, fmt, ap);
+  va_end(ap);
+  return res;
+}
+
+/* there is no va_list flavour of apr_pstrcat to forward to */
+char *__wrap_apr_pstrcat(apr_pool_t *p, ...) {
+  va_list ap;
+  const char *s;
+  apr_size_t len = 0;
+  char *res, *cp;
+
+  ++shim_allocs;
+  va_start(ap, p);
+  while ((s = va_arg(ap, const char*)) != NULL) {
+    len += strlen(s);
+  }
+  va_end(ap);
+
+  res = cp = (char*)__real_apr_palloc(p, len + 1);
+  va_start(ap, p);
+  while ((s = va_arg(ap, const char*)) != NULL) {
+    apr_size_t n = strlen(s);
+    memcpy(cp, s, n);
+    cp += n;
+  }
+  va_end(ap);
+  *cp = '\0';
+  return res;
+}
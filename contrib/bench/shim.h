@@ -0,0 +1,29 @@
+/****
+ * shim.h: just enough of httpd to run mod_xsendfile's request-time helpers
+ * outside of the server, see microbench.c
+ *
+ * Licensed under the Apache License, Version 2.0, see mod_xsendfile.c
+ ****/
+
+#ifndef XSENDFILE_SHIM_H
+#define XSENDFILE_SHIM_H
+
+#include "apr_pools.h"
+#include "httpd.h"
+
+/* where ap_sub_req_lookup_uri() maps URIs to, default "/srv/www/htdocs" */
+extern const char *shim_document_root;
+
+/*
+  allocating APR calls made from code linked with the --wrap options
+  of build-microbench.sh (the module, not libapr internals)
+*/
+extern apr_uint64_t shim_allocs;
+
+/* a request_rec with pool, tables and a server_rec, but nothing else */
+request_rec *shim_request_create(apr_pool_t *p);
+
+/* point the request at another pool, recreating the tables */
+void shim_request_reset(request_rec *r, apr_pool_t *p);
+
+#endif /* XSENDFILE_SHIM_H */
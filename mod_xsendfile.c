@@ -42,6 +42,13 @@
 #include "apr_file_io.h"
 
 #include "apr_hash.h"
+#include "apr_shm.h"
+#include "apr_atomic.h"
+#include "apr_portable.h"
+#include "apr_thread_proc.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_cond.h"
+#include "apr_sha1.h"
 #define APR_WANT_IOVEC
 #define APR_WANT_STRFUNC
 #include "apr_want.h"
@@ -55,6 +62,70 @@
 #include "http_core.h" /* needed for per-directory core-config */
 #include "util_filter.h"
 #include "http_protocol.h" /* ap_hook_insert_error_filter */
+#include "ap_mpm.h"
+#include "scoreboard.h" /* ap_sb_handle_t, to find our stats slot */
+#include "apr_optional.h"
+#if AP_MODULE_MAGIC_AT_LEAST(20120211, 105)
+#include "http_ssl.h" /* ap_ssl_conn_is_ssl, TLS by any module */
+#else
+/* mod_ssl's, before there was ap_ssl_conn_is_ssl */
+APR_DECLARE_OPTIONAL_FN(int, ssl_is_https, (conn_rec *));
+static APR_OPTIONAL_FN_TYPE(ssl_is_https) *xsendfile_is_https = NULL;
+#endif
+
+#include <time.h> /* clock_gettime for the phase timers */
+#if APR_HAVE_SYS_SOCKET_H
+#include <sys/socket.h> /* SO_MAX_PACING_RATE */
+#endif
+#if APR_HAVE_UNISTD_H
+#include <unistd.h> /* getpid */
+#endif
+#if APR_HAVE_FCNTL_H
+#include <fcntl.h> /* posix_fadvise */
+#endif
+#include <stdlib.h> /* malloc, XSendFileFsGuard's jobs outlive requests */
+#if APR_HAS_MMAP
+#include <sys/mman.h> /* the Immutable file cache's mappings */
+#endif
+#include <errno.h>
+#if defined(__linux__) && !defined(XSENDFILE_NO_XATTR)
+#include <sys/xattr.h> /* XSendFileHashETag */
+#define XSENDFILE_XATTR 1
+#endif
+#if defined(__linux__) && !defined(XSENDFILE_NO_STATX)
+#include <sys/stat.h> /* statx, glibc >= 2.28 */
+#include <sys/sysmacros.h> /* makedev */
+#ifdef STATX_BASIC_STATS
+#define XSENDFILE_STATX 1
+/* all the module looks at, see xsendfile_stat() */
+#define XSENDFILE_STATX_MASK (STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME)
+#endif
+#endif
+
+/*
+  USDT probes (provider "xsendfile") for bpftrace/perf/systemtap;
+  picked up automatically when sys/sdt.h is around, unless built with
+  -DXSENDFILE_NO_USDT. Not enabled probes are a single nop each.
+*/
+#if !defined(XSENDFILE_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define XSENDFILE_USDT 1
+#endif
+#endif
+
+#ifdef XSENDFILE_USDT
+#include <sys/sdt.h>
+#define XSENDFILE_PROBE1(name, a1) \
+  DTRACE_PROBE1(xsendfile, name, a1)
+#define XSENDFILE_PROBE2(name, a1, a2) \
+  DTRACE_PROBE2(xsendfile, name, a1, a2)
+#define XSENDFILE_PROBE3(name, a1, a2, a3) \
+  DTRACE_PROBE3(xsendfile, name, a1, a2, a3)
+#else
+#define XSENDFILE_PROBE1(name, a1)
+#define XSENDFILE_PROBE2(name, a1, a2)
+#define XSENDFILE_PROBE3(name, a1, a2, a3)
+#endif
 
 #define HACKY_GZIP 1
 
@@ -97,6 +168,14 @@ typedef struct zlib_context_t
 
 #define AP_XSENDFILE_HEADER "X-SENDFILE"
 #define AP_XSENDFILETEMPORARY_HEADER "X-SENDFILE-TEMPORARY"
+#define AP_XACCELREDIRECT_HEADER "X-ACCEL-REDIRECT"
+#define AP_XSENDFILELIMITRATE_HEADER "X-SENDFILE-LIMIT-RATE"
+#define AP_XSENDFILEPRELOAD_HEADER "X-SENDFILE-PRELOAD"
+#define AP_XSENDFILEPREFETCH_HEADER "X-SENDFILE-PREFETCH"
+
+#ifndef HTTP_EARLY_HINTS /* httpd < 2.4.24 */
+#define HTTP_EARLY_HINTS 103
+#endif
 
 module AP_MODULE_DECLARE_DATA xsendfile_module;
 
@@ -106,32 +185,837 @@ typedef enum {
   XSENDFILE_DISABLED = 1<<1
 } xsendfile_conf_active_t;
 
+/* XSendFileEarlyHints */
+typedef enum {
+  XSENDFILE_HINTS_UNSET = 0,
+  XSENDFILE_HINTS_OFF,
+  XSENDFILE_HINTS_HEADER, /* X-Sendfile-Preload */
+  XSENDFILE_HINTS_SIDECAR /* that, or else <file>.preload */
+} xsendfile_hints_t;
+
+/*
+  XSendFileH2BucketSize on: 64 KiB, about mod_http2's default stream
+  window (H2WindowSize, 65535), so a bucket is what the stream may send
+  in one go; also the least, smaller ones costing more than they save
+*/
+#define XSENDFILE_H2_BUCKET_SIZE 65536
+#define XSENDFILE_H2_BUCKET_MIN 65536
+
+/* XSendFileBucketSize on: what 32-bit platforms split files into anyway */
+#define XSENDFILE_BUCKET_SIZE AP_MAX_SENDFILE
+#define XSENDFILE_BUCKET_MIN 65536
+
+/* XSendFileDiskLimit defaults */
+#define XSENDFILE_DISK_MIN_SIZE (1024 * 1024)
+#define XSENDFILE_DISK_RETRY_AFTER 5
+
+/* XSendFileCork on: files up to that size get corked with the headers */
+#define XSENDFILE_CORK_SIZE 16384
+
+/* limits for the preloads of a response */
+#define XSENDFILE_PRELOAD_MAX 16
+#define XSENDFILE_PRELOAD_SIDECAR_MAX 8192
+
+/* XSendFilePrefetch on: the files of a response's X-Sendfile-Prefetch looked at */
+#define XSENDFILE_PREFETCH_MAX 8
+
 typedef struct xsendfile_conf_t {
   xsendfile_conf_active_t enabled;
   xsendfile_conf_active_t ignoreETag;
   xsendfile_conf_active_t ignoreLM;
   xsendfile_conf_active_t unescape;
+  xsendfile_conf_active_t timing;
+  xsendfile_conf_active_t learnedOrder;
+  xsendfile_conf_active_t hashETag;
+  xsendfile_hints_t earlyHints;
+  apr_off_t bucketSize; /* 0: unset, -1: off */
+  apr_off_t h2BucketSize; /* 0: unset, -1: off */
+  apr_off_t corkSize; /* 0: unset, -1: off */
+  int diskLimit; /* 0: unset, -1: off */
+  apr_off_t diskMinSize;
+  int diskRetryAfter;
+  int prefetch; /* files per response, 0: unset, -1: off */
+  int rootSet; /* server the paths belong to, for the decision log; 0: unset */
   apr_array_header_t *paths;
   apr_array_header_t *temporaryPaths;
+  apr_array_header_t *maps; /* xsendfile_map_t, longest prefix first */
 } xsendfile_conf_t;
 
+/* how a profile has the body delivered; AUTO goes by EnableSendfile/EnableMMAP */
+typedef enum {
+  XSENDFILE_TRANSFER_AUTO = 0,
+  XSENDFILE_TRANSFER_SENDFILE,
+  XSENDFILE_TRANSFER_MMAP,
+  XSENDFILE_TRANSFER_READ,
+  XSENDFILE_TRANSFER_DIRECT, /* read, and drop the file from the page cache afterwards */
+  XSENDFILE_TRANSFER_MAX
+} xsendfile_transfer_t;
+
+static const char *const xsendfile_transfer_names[XSENDFILE_TRANSFER_MAX] = {
+  "auto",
+  "sendfile",
+  "mmap",
+  "read",
+  "direct"
+};
+
+/* posix_fadvise() advice given on the opened file */
+typedef enum {
+  XSENDFILE_FADVISE_NONE = 0,
+  XSENDFILE_FADVISE_NORMAL,
+  XSENDFILE_FADVISE_SEQUENTIAL,
+  XSENDFILE_FADVISE_RANDOM,
+  XSENDFILE_FADVISE_WILLNEED,
+  XSENDFILE_FADVISE_NOREUSE,
+  XSENDFILE_FADVISE_MAX
+} xsendfile_fadvise_t;
+
+static const char *const xsendfile_fadvise_names[XSENDFILE_FADVISE_MAX] = {
+  "none",
+  "normal",
+  "sequential",
+  "random",
+  "willneed",
+  "noreuse"
+};
+
+typedef enum {
+  XSENDFILE_COMPRESS_ON = 0, /* serve .gz variants, creating them as needed */
+  XSENDFILE_COMPRESS_STATIC, /* serve existing .gz variants only */
+  XSENDFILE_COMPRESS_OFF,
+  XSENDFILE_COMPRESS_MAX
+} xsendfile_compress_t;
+
+static const char *const xsendfile_compress_names[XSENDFILE_COMPRESS_MAX] = {
+  "on",
+  "static",
+  "off"
+};
+
+/*
+  XSendFileProfile: how the files of a root are to be served. Roots get
+  their profile resolved while reading the config, so a request has it
+  at hand as soon as it knows the root.
+*/
+typedef struct xsendfile_profile_t {
+  const char *name;
+  xsendfile_transfer_t transfer;
+  xsendfile_fadvise_t fadvise;
+  xsendfile_compress_t compress;
+  const apr_array_header_t *compressTypes; /* extensions; NULL: the built-in ones */
+  apr_interval_time_t metadataTTL; /* 0: don't cache */
+  int immortal; /* cached metadata never expires */
+  int immutable; /* files never change: cache descriptors, skip revalidation */
+  int fsGuard; /* stat() and open() on the XSendFileFsGuard threads */
+} xsendfile_profile_t;
+
+static const xsendfile_profile_t xsendfile_default_profile = {
+  "default",
+  XSENDFILE_TRANSFER_AUTO,
+  XSENDFILE_FADVISE_NONE,
+  XSENDFILE_COMPRESS_ON,
+  NULL,
+  0,
+  0,
+  0,
+  0
+};
+
+/* by name, for this config generation */
+static apr_hash_t *xsendfile_profiles = NULL;
+
 /* structure to hold the path and permissions */
 typedef struct xsendfile_path_t {
   const char *path;
   int allowFileDelete;
+  int id; /* index into the root registry, see xsendfile_root_id() */
+  apr_int64_t limitRate; /* LimitRate=, bytes per second; 0: unlimited */
+  const xsendfile_profile_t *profile;
+  apr_size_t prefixLen; /* see xsendfile_could_match(); 0: always try */
 } xsendfile_path_t;
 
+/* XSendFileMap: an X-Accel-Redirect URI prefix and the directory it maps to */
+typedef struct xsendfile_map_t {
+  const char *prefix;
+  apr_size_t prefixLen;
+  const char *path;
+  int id; /* see xsendfile_path_t */
+  apr_int64_t limitRate;
+  const xsendfile_profile_t *profile;
+} xsendfile_map_t;
+
+/*
+  statistics are kept per root; roots are registered while reading the
+  config, the script directory always being id 0. Everything beyond
+  XSENDFILE_STATS_ROOTS - 1 is accounted for as "other".
+*/
+#define XSENDFILE_STATS_ROOTS 32
+#define XSENDFILE_ROOT_SCRIPTDIR 0
+#define XSENDFILE_ROOT_OTHER (XSENDFILE_STATS_ROOTS - 1)
+
+static apr_array_header_t *xsendfile_roots = NULL;
+
+/* how the file body is going to be delivered by the core */
+typedef enum {
+  XSENDFILE_STRATEGY_SENDFILE = 0,
+  XSENDFILE_STRATEGY_MMAP,
+  XSENDFILE_STRATEGY_READ,
+  XSENDFILE_STRATEGY_MAX
+} xsendfile_strategy_t;
+
+static const char *const xsendfile_strategy_names[XSENDFILE_STRATEGY_MAX] = {
+  "sendfile",
+  "mmap",
+  "read"
+};
+
+/* what became of a request carrying the header */
+typedef enum {
+  XSENDFILE_OUTCOME_SENT = 0,
+  XSENDFILE_OUTCOME_CONDITIONAL, /* 304/412 by ap_meets_conditions */
+  XSENDFILE_OUTCOME_BAD_ENCODING,
+  XSENDFILE_OUTCOME_NOT_FOUND_RESOLVE,
+  XSENDFILE_OUTCOME_NOT_FOUND_OPEN,
+  XSENDFILE_OUTCOME_NOT_FOUND_NOT_FILE,
+  XSENDFILE_OUTCOME_FORBIDDEN_STAT,
+  XSENDFILE_OUTCOME_DISK_BUSY, /* 503 by XSendFileDiskLimit */
+  XSENDFILE_OUTCOME_FS_BUSY, /* 503, XSendFileFsGuard's queue full, timed out or breaker open */
+  XSENDFILE_OUTCOME_MAX
+} xsendfile_outcome_t;
+
+static const char *const xsendfile_outcome_names[XSENDFILE_OUTCOME_MAX] = {
+  "sent",
+  "conditional",
+  "bad_encoding",
+  "not_found_resolve",
+  "not_found_open",
+  "not_found_not_file",
+  "forbidden_stat",
+  "disk_busy",
+  "fs_busy"
+};
+
+typedef enum {
+  XSENDFILE_VARIANT_IDENTITY = 0,
+  XSENDFILE_VARIANT_GZIP,
+  XSENDFILE_VARIANT_MAX
+} xsendfile_variant_t;
+
+static const char *const xsendfile_variant_names[XSENDFILE_VARIANT_MAX] = {
+  "identity",
+  "gzip"
+};
+
+/*
+  per-child cache of the variant decisions for roots with a MetadataTTL
+  (or Immortal) profile, saving the stat()s of the .gz lookup; the
+  opened file is fstat()ed regardless. Likewise, that there is no
+  <file>.preload (XSendFileEarlyHints sidecar). Keyed by the resolved
+  path, and simply started over once XSENDFILE_METACACHE_MAX entries are
+  reached.
+
+  Immutable roots' files are kept as well, mmap()ed along with what
+  fstat() said, up to XSENDFILE_FILECACHE_MAX of them of no more than
+  XSENDFILE_FILECACHE_SIZE each; the least recently used one makes room
+  for a new one. Responses are sent straight from the mapping, never
+  through a descriptor shared by all threads and its file position.
+  Entries are malloc()ed and counted: dropped ones stay mapped until the
+  last request sending them is done.
+*/
+#define XSENDFILE_METACACHE_MAX 16384
+#define XSENDFILE_FILECACHE_MAX 1024
+#define XSENDFILE_FILECACHE_SIZE AP_MAX_SENDFILE
+
+typedef struct xsendfile_meta_t {
+  apr_time_t expires; /* 0: never */
+  int hasVariant;
+  xsendfile_variant_t gzip; /* the variant to serve to gzip accepting clients */
+  apr_time_t sidecarExpires; /* 0: never */
+  int noSidecar; /* there was no <file>.preload */
+} xsendfile_meta_t;
+
+typedef struct xsendfile_cached_file_t {
+  void *map; /* all of the file, read-only */
+  apr_off_t size;
+  apr_time_t mtime;
+  apr_ino_t inode;
+  apr_dev_t device;
+  apr_time_t used; /* last request for it */
+  int refs; /* the cache's, and one per request using it; under the mutex */
+  char path[1];
+} xsendfile_cached_file_t;
+
+typedef struct xsendfile_metacache_t {
+  apr_pool_t *pool;
+  apr_hash_t *entries;
+  apr_pool_t *filePool;
+  apr_hash_t *files; /* xsendfile_cached_file_t by path, the keys being theirs */
+#if APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+} xsendfile_metacache_t;
+
+static xsendfile_metacache_t *xsendfile_metacache = NULL;
+
+/*
+  XSendFileHashETag: strong ETags from the SHA-1 of the contents, which,
+  unlike inode numbers, are the same on every node behind a load
+  balancer. Hashing is left to a per-child thread, the usual ETag goes
+  out until it's done. Hashes are kept in memory and, where the file
+  system and permissions allow, in the file's user.xsendfile.sha1
+  extended attribute ("<size> <mtime in us> <hex>"), so other children,
+  restarts and nodes sharing the storage needn't hash again. Either is
+  good as long as size and mtime match.
+*/
+#define XSENDFILE_HASH_XATTR "user.xsendfile.sha1"
+/* on compressed variants, see xsendfile_variant_fresh() */
+#define XSENDFILE_SOURCE_XATTR "user.xsendfile.source"
+#define XSENDFILE_HASH_QUEUE 256
+#define XSENDFILE_HASH_CACHE_MAX 16384
+#define XSENDFILE_HASH_BUFSIZE 65536
+
+typedef struct xsendfile_hash_t {
+  apr_off_t size;
+  apr_time_t mtime;
+  char hex[APR_SHA1_DIGESTSIZE * 2 + 1]; /* empty while queued */
+} xsendfile_hash_t;
+
+static int xsendfile_hash_wanted = 0;
+
+#if APR_HAS_THREADS
+typedef struct xsendfile_hasher_t {
+  apr_pool_t *pool;
+  apr_hash_t *entries; /* xsendfile_hash_t by path */
+  const char *queue[XSENDFILE_HASH_QUEUE]; /* keys of queued entries */
+  unsigned int head;
+  unsigned int tail;
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *cond;
+  apr_thread_t *thread;
+  volatile int shutdown;
+} xsendfile_hasher_t;
+
+static xsendfile_hasher_t *xsendfile_hasher = NULL;
+#endif
+
+/*
+  XSendFileFsGuard: a bounded wait plus a circuit breaker. For roots
+  with an FsGuard=on profile the stat()s of the variant lookup and the
+  open() of the file run on a few helper threads per child while the
+  worker waits for them, but no longer than the timeout. The worker is
+  still held for that long; what the guard buys is that a hanging (NFS)
+  mount costs a request at most the timeout, not an unbounded stall,
+  and that once the breaker is open requests fail fast.
+
+  Requests are turned away (503) right away when the queue is full, when
+  every thread is still stuck in a call given up on, and while the
+  root's circuit breaker is open: XSENDFILE_FSGUARD_TRIP timeouts in a
+  row open it for XSENDFILE_FSGUARD_COOLDOWN, after which a single
+  request is let through; its call succeeding closes the breaker again,
+  it timing out opens it for another cooldown. Breakers are per child
+  and per root registry id, the roots beyond it sharing "other".
+
+  The jobs are a fixed set of slots with a condition variable each, so
+  a finished call wakes just its request. A slot whose request gave up
+  is only put back once its call returns.
+*/
+#define XSENDFILE_FSGUARD_QUEUE 16 /* per thread */
+#define XSENDFILE_FSGUARD_TIMEOUT 2000 /* ms */
+#define XSENDFILE_FSGUARD_TRIP 3
+#define XSENDFILE_FSGUARD_COOLDOWN 10 /* s, also the Retry-After of the 503 */
+
+typedef struct xsendfile_job_t {
+  struct xsendfile_job_t *next; /* in the queue, or the free ones */
+  int open; /* open() rather than stat() */
+  int done;
+  int abandoned; /* the request stopped waiting */
+  int err; /* errno, 0 if fine */
+  int fd; /* the open()ed file, -1 if none */
+  struct stat st;
+  apr_uint64_t queued; /* xsendfile_clock() */
+  apr_uint64_t started; /* 0 while queued */
+  char *path; /* malloc()ed, it may outlive the request */
+#if APR_HAS_THREADS
+  apr_thread_cond_t *cond; /* done, or shutting down */
+#endif
+} xsendfile_job_t;
+
+typedef struct xsendfile_breaker_t {
+  int timeouts; /* in a row */
+  int probing; /* the one request let through after the cooldown is on */
+  apr_uint64_t openUntil; /* xsendfile_clock(), 0 if closed */
+} xsendfile_breaker_t;
+
+typedef struct xsendfile_fsguard_t {
+  int threads;
+  int queue;
+  apr_interval_time_t timeout;
+#if APR_HAS_THREADS
+  /* per child, set up in child_init; no workers: not running */
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *work; /* jobs queued */
+  apr_thread_t **workers;
+  xsendfile_job_t *jobs; /* njobs: queue + threads */
+  int njobs;
+  xsendfile_job_t *free;
+  xsendfile_job_t *head;
+  xsendfile_job_t *tail;
+  int queued;
+  int stuck; /* threads busy with a call given up on */
+  xsendfile_breaker_t breakers[XSENDFILE_STATS_ROOTS];
+  volatile int shutdown;
+#endif
+} xsendfile_fsguard_t;
+
+static xsendfile_fsguard_t *xsendfile_fsguard = NULL;
+
+/*
+  X-Sendfile-Prefetch: files the client is going to ask for next,
+  resolved like X-Sendfile's and opened and read ahead
+  (POSIX_FADV_WILLNEED) by a thread per child once the response is on
+  its way; the .gz variant as well for clients taking gzip. Opening them
+  also has the kernel cache the metadata the next request's lookups go
+  by. Files prefetched within XSENDFILE_PREFETCH_TTL are skipped, and no
+  more than XSENDFILE_PREFETCH_RATE are queued per second and child.
+*/
+#define XSENDFILE_PREFETCH_QUEUE 256
+#define XSENDFILE_PREFETCH_RATE 100
+#define XSENDFILE_PREFETCH_TTL apr_time_from_sec(10)
+#define XSENDFILE_PREFETCH_SEEN_MAX 4096
+/* of large files, only the beginning */
+#define XSENDFILE_PREFETCH_BYTES (4 * 1024 * 1024)
+
+static int xsendfile_prefetch_wanted = 0;
+
+#if APR_HAS_THREADS
+typedef struct xsendfile_prefetch_t {
+  int gzip; /* the .gz variant as well */
+  char path[1]; /* room for ".gz" after it */
+} xsendfile_prefetch_t;
+
+typedef struct xsendfile_prefetcher_t {
+  apr_pool_t *pool;
+  apr_hash_t *seen; /* apr_time_t of the last prefetch by path and gzip */
+  xsendfile_prefetch_t *queue[XSENDFILE_PREFETCH_QUEUE]; /* malloc()ed, freed by the thread */
+  unsigned int head;
+  unsigned int tail;
+  int tokens; /* rate limit: a token bucket of XSENDFILE_PREFETCH_RATE */
+  apr_time_t refilled;
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *cond;
+  apr_thread_t *thread;
+  volatile int shutdown;
+} xsendfile_prefetcher_t;
+
+static xsendfile_prefetcher_t *xsendfile_prefetcher = NULL;
+#endif
+
+/*
+  log-linear latency histograms (HDR-style): microsecond values below
+  XSENDFILE_HIST_SUB get a bucket each, above that every power of two
+  is split into XSENDFILE_HIST_SUB linear sub-buckets, i.e. values are
+  off by at most 1/XSENDFILE_HIST_SUB. Anything beyond 2^27us (~134s)
+  ends up in the last bucket.
+*/
+#define XSENDFILE_HIST_SUB_BITS 3
+#define XSENDFILE_HIST_SUB (1 << XSENDFILE_HIST_SUB_BITS)
+#define XSENDFILE_HIST_MAX_BITS 27
+#define XSENDFILE_HIST_BUCKETS (XSENDFILE_HIST_SUB * (XSENDFILE_HIST_MAX_BITS - XSENDFILE_HIST_SUB_BITS + 1))
+
+/* the phases we keep histograms for */
+typedef enum {
+  XSENDFILE_HIST_RESOLVE = 0,
+  XSENDFILE_HIST_VARIANT,
+  XSENDFILE_HIST_COMPRESS,
+  XSENDFILE_HIST_OPEN,
+  XSENDFILE_HIST_TOTAL,
+  XSENDFILE_HIST_FSGUARD, /* waiting for an XSendFileFsGuard thread */
+  XSENDFILE_HIST_MAX
+} xsendfile_hist_t;
+
+static const char *const xsendfile_hist_names[XSENDFILE_HIST_MAX] = {
+  "resolve",
+  "variant",
+  "compress",
+  "open",
+  "total",
+  "fsguard_wait"
+};
+
+typedef struct xsendfile_histogram_t {
+  apr_uint64_t count;
+  apr_uint64_t sumUs;
+  apr_uint64_t buckets[XSENDFILE_HIST_BUCKETS];
+} xsendfile_histogram_t;
+
+/*
+  one set of counters per worker thread (scoreboard child * thread),
+  living in shared memory. A slot only ever has one writer, so the hot
+  path does plain adds; readers just sum up all the slots.
+*/
+typedef struct xsendfile_counters_t {
+  /* nothing but apr_uint64_t in here, see xsendfile_stats_sum() */
+  apr_uint64_t requests;
+  apr_uint64_t bytes[XSENDFILE_STRATEGY_MAX];
+  apr_uint64_t outcomes[XSENDFILE_OUTCOME_MAX];
+  apr_uint64_t variants[XSENDFILE_VARIANT_MAX];
+  apr_uint64_t compressions;
+  apr_uint64_t compressionFailures;
+  apr_uint64_t compressionNs;
+  apr_uint64_t roots[XSENDFILE_STATS_ROOTS];
+  apr_uint64_t slowLogLines;
+  apr_uint64_t slowLogDropped;
+  apr_uint64_t decisionLogRecords;
+  apr_uint64_t decisionLogDropped;
+  apr_uint64_t pacedSocket; /* rate limited through SO_MAX_PACING_RATE */
+  apr_uint64_t pacedFilter; /* rate limited through mod_ratelimit */
+  apr_uint64_t metadataHits;
+  apr_uint64_t metadataMisses;
+  apr_uint64_t fileCacheHits;
+  apr_uint64_t earlyHints; /* 103 responses sent */
+  apr_uint64_t h2Shaped; /* HTTP/2 responses sent in XSendFileH2BucketSize buckets */
+  apr_uint64_t corked; /* XSendFileCork */
+  apr_uint64_t hashETags; /* XSendFileHashETag */
+  apr_uint64_t guardCalls; /* stat()s and open()s done by XSendFileFsGuard threads */
+  apr_uint64_t guardSaturated; /* requests turned away, the queue being full */
+  apr_uint64_t guardTimeouts; /* requests that gave up waiting */
+  apr_uint64_t guardOpen; /* requests turned away, the root's breaker being open */
+  apr_uint64_t prefetches; /* X-Sendfile-Prefetch files queued */
+  apr_uint64_t prefetchSkipped; /* prefetched recently */
+  apr_uint64_t prefetchDropped; /* over the rate, or the queue full */
+  xsendfile_histogram_t histograms[XSENDFILE_HIST_MAX];
+} xsendfile_counters_t;
+
+typedef struct xsendfile_slot_t {
+  /*
+    only used for the shared overflow slots that take the updates of
+    threads without a scoreboard handle (e.g. mod_http2 workers)
+  */
+  volatile apr_uint32_t busy;
+  /* counters belong to a previous epoch (i.e. got reset) unless equal */
+  volatile apr_uint32_t epoch;
+  xsendfile_counters_t counters;
+} xsendfile_slot_t;
+
+#define XSENDFILE_OVERFLOW_SLOTS 16
+
+/*
+  decayed per-root success counts for XSendFileLearnedOrder, shared by
+  all children; halved whenever one of them reaches the limit
+*/
+#define XSENDFILE_ROOTHITS_LIMIT (1 << 16)
+
+/*
+  XSendFileDiskLimit: large responses in flight per block device, shared
+  by all children. The device number folded into 32 bits (which is all of
+  it on Linux) is the key, 0 meaning a free entry; entries are never
+  given up again.
+
+  Each child's share of active is kept per device as well (held, after
+  the stats slots), so that the parent can take back what a child that
+  died mid-response never released (see xsendfile_child_status).
+*/
+#define XSENDFILE_DISKS 64
+
+typedef struct xsendfile_disk_t {
+  volatile apr_uint32_t device;
+  volatile apr_uint32_t active;
+} xsendfile_disk_t;
+
+typedef struct xsendfile_stats_t {
+  volatile apr_uint32_t epoch;
+  volatile apr_uint32_t rootHits[XSENDFILE_STATS_ROOTS];
+  xsendfile_disk_t disks[XSENDFILE_DISKS];
+  int serverLimit;
+  int threadLimit;
+  int nslots; /* scoreboard slots, followed by the overflow slots */
+  apr_size_t heldOffset; /* serverLimit * XSENDFILE_DISKS counts, from the start */
+  xsendfile_slot_t slots[1];
+} xsendfile_stats_t;
+
+static xsendfile_stats_t *xsendfile_stats = NULL;
+
+/*
+  XSendFileSlowLog: requests taking longer than the threshold get a JSON
+  line. Request threads only ever try-lock and append to a memory
+  buffer, dropping the line when contended, full or over the rate
+  limit; a per-child thread swaps buffers and does the actual (possibly
+  blocking) writing.
+*/
+#define XSENDFILE_SLOWLOG_BUFSIZE 65536
+
+typedef struct xsendfile_slowlog_t {
+  apr_uint64_t thresholdNs;
+  const char *fname;
+  int rate; /* lines per second and child */
+  apr_file_t *fd;
+
+  /* per child, set up in child_init */
+  apr_time_t second;
+  int lines;
+  char *buf;
+  char *spare;
+  apr_size_t len;
+#if APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *cond;
+  apr_thread_t *thread;
+  int shutdown;
+#endif
+} xsendfile_slowlog_t;
+
+static xsendfile_slowlog_t *xsendfile_slowlog = NULL;
+
+/*
+  XSendFileDecisionLog: a compact binary record of every X-Sendfile
+  response, for replaying against a file system snapshot offline
+  (contrib/bench/replay.c). All integers are in host byte order.
+
+    record   := u16 length (of the whole record), u8 type, u8 version, body
+    'R' body := u32 generation, u32 root set, u16 count,
+                count * (u8 allowFileDelete, u16 length, path)
+    'D' body := u32 generation, u32 root set, u64 request time (us),
+                u32 total (us), u8 outcome, u8 variant, u8 accept-encoding,
+                u8 conditional, u8 flags, s8 root, u16 syscalls,
+                u16 file length, u16 script directory length, file, directory
+
+  A root set is the XSendFilePath list of one server; 'R' records are
+  written once per generation (i.e. restart), before any 'D' referring
+  to them. 'D' root is the index into the script directory (unless
+  X-Sendfile-Temporary), followed by the root set, -1 if not found.
+
+  Request threads never block: they reserve space in the active buffer
+  with a compare-and-swap and copy their record in. A per-child thread
+  periodically swaps buffers, seals the old one, waits for copies still
+  in flight and writes it out. Records not fitting are dropped.
+*/
+#define XSENDFILE_DECISIONLOG_VERSION 1
+#define XSENDFILE_DECISIONLOG_ROOTSET 'R'
+#define XSENDFILE_DECISIONLOG_DECISION 'D'
+#define XSENDFILE_DECISIONLOG_MAXREC 8192
+#define XSENDFILE_DECISIONLOG_BUFSIZE (256 * 1024)
+#define XSENDFILE_DECISIONLOG_SEALED 0x80000000
+
+/* 'D' flags */
+#define XSENDFILE_DECISION_TEMPORARY (1<<0)
+#define XSENDFILE_DECISION_ACCEL (1<<1) /* X-Accel-Redirect, file being the URI */
+
+/* 'D' conditional bits */
+#define XSENDFILE_COND_IF_NONE_MATCH (1<<0)
+#define XSENDFILE_COND_IF_MODIFIED_SINCE (1<<1)
+#define XSENDFILE_COND_RANGE (1<<2)
+#define XSENDFILE_COND_IF_RANGE (1<<3)
+
+/* 'D' accept-encoding class */
+typedef enum {
+  XSENDFILE_AE_UNKNOWN = 0, /* never got to look, e.g. not found */
+  XSENDFILE_AE_NONE, /* no Accept-Encoding */
+  XSENDFILE_AE_GZIP,
+  XSENDFILE_AE_OTHER /* Accept-Encoding without gzip */
+} xsendfile_ae_t;
+
+typedef struct xsendfile_declog_buf_t {
+  volatile apr_uint32_t reserved; /* | XSENDFILE_DECISIONLOG_SEALED while written */
+  volatile apr_uint32_t committed;
+  char *data;
+} xsendfile_declog_buf_t;
+
+typedef struct xsendfile_declog_t {
+  const char *fname;
+  apr_uint32_t bufsize;
+  apr_file_t *fd;
+  apr_uint32_t generation;
+
+  /* per child, set up in child_init */
+  xsendfile_declog_buf_t bufs[2];
+  xsendfile_declog_buf_t *volatile active;
+#if APR_HAS_THREADS
+  apr_thread_t *thread;
+  volatile apr_uint32_t shutdown;
+#endif
+} xsendfile_declog_t;
+
+static xsendfile_declog_t *xsendfile_declog = NULL;
+
+/* phases of the output filter we keep timings for */
+typedef enum {
+  XSENDFILE_PHASE_SCAN = 0,
+  XSENDFILE_PHASE_ORIGIN,
+  XSENDFILE_PHASE_RESOLVE,
+  XSENDFILE_PHASE_VARIANT,
+  XSENDFILE_PHASE_COMPRESS,
+  XSENDFILE_PHASE_OPEN,
+  XSENDFILE_PHASE_CONDITIONS,
+  XSENDFILE_PHASE_TOTAL,
+  XSENDFILE_PHASE_MAX
+} xsendfile_phase_t;
+
+/* r->notes keys the timings get published as (%{...}n in mod_log_config) */
+static const char *const xsendfile_phase_notes[XSENDFILE_PHASE_MAX] = {
+  "xsendfile-scan-us",
+  "xsendfile-origin-us",
+  "xsendfile-resolve-us",
+  "xsendfile-variant-us",
+  "xsendfile-compress-us",
+  "xsendfile-open-us",
+  "xsendfile-conditions-us",
+  "xsendfile-total-us"
+};
+
+/* same, for the slow log */
+static const char *const xsendfile_phase_names[XSENDFILE_PHASE_MAX] = {
+  "scan",
+  "origin",
+  "resolve",
+  "variant",
+  "compress",
+  "open",
+  "conditions",
+  "total"
+};
+
+/*
+  file system calls made on behalf of a request, as the module counts
+  them for the slow and decision logs: a debugging aid, missing what
+  sub-requests and APR do underneath. contrib/bench/run-syscalls.sh
+  counts the real ones.
+*/
+typedef enum {
+  XSENDFILE_SYS_STAT = 0,
+  XSENDFILE_SYS_OPEN,
+  XSENDFILE_SYS_FSTAT,
+  XSENDFILE_SYS_CLOSE,
+  XSENDFILE_SYS_SUBREQ, /* sub-request to find the script directory */
+  XSENDFILE_SYS_SPAWN, /* fork/exec/wait of the compressor */
+  XSENDFILE_SYS_FADVISE,
+  XSENDFILE_SYS_XATTR,
+  XSENDFILE_SYS_MAX
+} xsendfile_syscall_t;
+
+static const char *const xsendfile_syscall_names[XSENDFILE_SYS_MAX] = {
+  "stat",
+  "open",
+  "fstat",
+  "close",
+  "subreq",
+  "spawn",
+  "fadvise",
+  "getxattr"
+};
+
+#define XSENDFILE_SYSCALL(ctx, kind) ((ctx)->syscalls[kind]++)
+
+/* per-request state, kept in r->request_config once a header was found */
+typedef struct xsendfile_ctx_t {
+  int notes; /* publish the timings, i.e. XSendFileTiming on */
+  apr_uint64_t started;
+  apr_uint64_t phases[XSENDFILE_PHASE_MAX]; /* nanoseconds */
+  int root; /* index of the root the file was found in, -1 if none */
+  int rootId; /* registry id of said root */
+  const char *rootPath;
+  const xsendfile_profile_t *profile; /* the root's */
+  int metadata; /* 1: variant decision from the metadata cache, -1: not cached yet */
+  int fileCached; /* served from an immutable root's cached descriptor */
+  int preloads; /* Link: rel=preload added, -1 if sent as 103 Early Hints as well */
+  xsendfile_variant_t variant;
+  xsendfile_strategy_t strategy;
+  xsendfile_outcome_t outcome;
+  int compressions;
+  int compressionFailures;
+  int syscalls[XSENDFILE_SYS_MAX];
+  const char *file; /* header value */
+  const char *path; /* what it resolved to */
+  apr_off_t size;
+  int slowLog; /* 1 if written to the slow log, -1 if dropped */
+  int rootSet;
+  int temporary; /* X-Sendfile-Temporary */
+  const char *scriptDir; /* the script directory root, if any */
+  xsendfile_ae_t acceptEncoding;
+  int decisionLog; /* 1 if written to the decision log, -1 if dropped */
+  int accel; /* X-Accel-Redirect */
+  apr_int64_t limitRate; /* X-Sendfile-Limit-Rate/X-Accel-Limit-Rate, bytes per second; -1: not given */
+  apr_int64_t rootLimitRate; /* the root's LimitRate= */
+  int paced; /* 1: socket pacing, 2: mod_ratelimit */
+  int noBuffering; /* X-Accel-Buffering: no */
+  apr_off_t bucketSize; /* the body's, 0: as large as they get */
+  int h2Shaped; /* bucketSize is XSendFileH2BucketSize's */
+  int corked; /* TCP_CORK set until the response is out */
+  int hashETag; /* ETag from the content hash */
+  int guarded; /* jobs run on XSendFileFsGuard threads */
+  apr_uint64_t guardWait; /* their time in the queue, ns */
+  apr_status_t guardBusy; /* APR_EAGAIN (queue full), APR_TIMEUP or APR_EBUSY (breaker open), once any happened */
+  int prefetches; /* X-Sendfile-Prefetch files queued */
+  int prefetchSkipped;
+  int prefetchDropped;
+} xsendfile_ctx_t;
+
+/*
+  monotonic nanosecond clock; falls back to apr_time_now() where
+  clock_gettime isn't around (e.g. win32)
+*/
+static APR_INLINE apr_uint64_t xsendfile_clock(void) {
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+    return (apr_uint64_t)ts.tv_sec * 1000000000 + (apr_uint64_t)ts.tv_nsec;
+  }
+#endif
+  return (apr_uint64_t)apr_time_now() * 1000;
+}
+
+/*
+  the phases are always timed, the statistics' histograms want them; a
+  clock read is a vDSO call, cheap next to the stat()s of a phase.
+  start is the xsendfile_clock() at the beginning of the phase.
+*/
+static APR_INLINE void xsendfile_phase_end(xsendfile_ctx_t *ctx,
+    xsendfile_phase_t phase, apr_uint64_t start) {
+  ctx->phases[phase] += xsendfile_clock() - start;
+}
+
+/* map a white-listed path to its statistics id, registering it if new */
+static int xsendfile_root_id(apr_pool_t *p, const char *path) {
+  const char **names;
+  int i;
+
+  if (!xsendfile_roots) {
+    return XSENDFILE_ROOT_OTHER;
+  }
+  names = (const char**)xsendfile_roots->elts;
+  for (i = 0; i < xsendfile_roots->nelts; ++i) {
+    if (strcmp(names[i], path) == 0) {
+      return i;
+    }
+  }
+  if (xsendfile_roots->nelts >= XSENDFILE_ROOT_OTHER) {
+    return XSENDFILE_ROOT_OTHER;
+  }
+  *(const char**)apr_array_push(xsendfile_roots) = apr_pstrdup(p, path);
+  return xsendfile_roots->nelts - 1;
+}
+
+static const char *xsendfile_root_name(int id) {
+  if (id < XSENDFILE_ROOT_OTHER && xsendfile_roots && id < xsendfile_roots->nelts) {
+    return ((const char**)xsendfile_roots->elts)[id];
+  }
+  return "(other)";
+}
+
 static xsendfile_conf_t *xsendfile_config_create(apr_pool_t *p) {
   xsendfile_conf_t *conf;
 
   conf = (xsendfile_conf_t *) apr_pcalloc(p, sizeof(xsendfile_conf_t));
   conf->unescape =
+    conf->timing =
+    conf->learnedOrder =
+    conf->hashETag =
     conf->ignoreETag =
     conf->ignoreLM =
     conf->enabled =
     XSENDFILE_UNSET;
 
   conf->paths = apr_array_make(p, 1, sizeof(xsendfile_path_t));
+  conf->maps = apr_array_make(p, 0, sizeof(xsendfile_map_t));
 
   return conf;
 }
@@ -142,6 +1026,28 @@ static void *xsendfile_config_server_create(apr_pool_t *p, server_rec *s) {
 
 #define XSENDFILE_CFLAG(x) conf->x = overrides->x != XSENDFILE_UNSET ? overrides->x : base->x
 
+/*
+  both are ordered by prefix length already (see xsendfile_cmd_map), and
+  so is the result; of equally long prefixes, the overriding one comes first
+*/
+static apr_array_header_t *xsendfile_maps_merge(apr_pool_t *p,
+    const apr_array_header_t *overrides, const apr_array_header_t *base) {
+  const xsendfile_map_t *o = (const xsendfile_map_t*)overrides->elts;
+  const xsendfile_map_t *b = (const xsendfile_map_t*)base->elts;
+  apr_array_header_t *maps = apr_array_make(p, overrides->nelts + base->nelts + 1, sizeof(xsendfile_map_t));
+  int i = 0, j = 0;
+
+  while (i < overrides->nelts || j < base->nelts) {
+    if (j == base->nelts || (i < overrides->nelts && o[i].prefixLen >= b[j].prefixLen)) {
+      *(xsendfile_map_t*)apr_array_push(maps) = o[i++];
+    }
+    else {
+      *(xsendfile_map_t*)apr_array_push(maps) = b[j++];
+    }
+  }
+  return maps;
+}
+
 static void *xsendfile_config_merge(apr_pool_t *p, void *basev, void *overridesv) {
   xsendfile_conf_t *base = (xsendfile_conf_t *)basev;
   xsendfile_conf_t *overrides = (xsendfile_conf_t *)overridesv;
@@ -153,8 +1059,28 @@ static void *xsendfile_config_merge(apr_pool_t *p, void *basev, void *overridesv
   XSENDFILE_CFLAG(ignoreETag);
   XSENDFILE_CFLAG(ignoreLM);
   XSENDFILE_CFLAG(unescape);
+  XSENDFILE_CFLAG(timing);
+  XSENDFILE_CFLAG(learnedOrder);
+  XSENDFILE_CFLAG(hashETag);
+  conf->earlyHints = overrides->earlyHints ? overrides->earlyHints : base->earlyHints;
+  conf->bucketSize = overrides->bucketSize ? overrides->bucketSize : base->bucketSize;
+  conf->h2BucketSize = overrides->h2BucketSize ? overrides->h2BucketSize : base->h2BucketSize;
+  conf->corkSize = overrides->corkSize ? overrides->corkSize : base->corkSize;
+  if (overrides->diskLimit) {
+    conf->diskLimit = overrides->diskLimit;
+    conf->diskMinSize = overrides->diskMinSize;
+    conf->diskRetryAfter = overrides->diskRetryAfter;
+  }
+  else {
+    conf->diskLimit = base->diskLimit;
+    conf->diskMinSize = base->diskMinSize;
+    conf->diskRetryAfter = base->diskRetryAfter;
+  }
+  conf->prefetch = overrides->prefetch ? overrides->prefetch : base->prefetch;
+  conf->rootSet = overrides->rootSet ? overrides->rootSet : base->rootSet;
 
   conf->paths = apr_array_append(p, overrides->paths, base->paths);
+  conf->maps = xsendfile_maps_merge(p, overrides->maps, base->maps);
 
   return (void*)conf;
 }
@@ -188,6 +1114,17 @@ static const char *xsendfile_cmd_flag(cmd_parms *cmd, void *perdir_confv,
   else if (!strcasecmp(cmd->cmd->name, "xsendfileunescape")) {
     conf->unescape = flag ? XSENDFILE_ENABLED: XSENDFILE_DISABLED;
   }
+  else if (!strcasecmp(cmd->cmd->name, "xsendfiletiming")) {
+    conf->timing = flag ? XSENDFILE_ENABLED: XSENDFILE_DISABLED;
+  }
+  else if (!strcasecmp(cmd->cmd->name, "xsendfilelearnedorder")) {
+    conf->learnedOrder = flag ? XSENDFILE_ENABLED: XSENDFILE_DISABLED;
+  }
+  else if (!strcasecmp(cmd->cmd->name, "xsendfilehashetag")) {
+    conf->hashETag = flag ? XSENDFILE_ENABLED: XSENDFILE_DISABLED;
+    /* the children start the hashing thread only if used at all; not in .htaccess, read too late for that */
+    xsendfile_hash_wanted |= flag;
+  }
   else {
     return apr_psprintf(
       cmd->pool,
@@ -200,549 +1137,3104 @@ static const char *xsendfile_cmd_flag(cmd_parms *cmd, void *perdir_confv,
   return NULL;
 }
 
-static const char *xsendfile_cmd_path(cmd_parms *cmd, void *pdc,
-    const char *path, const char *allowFileDelete) {
-  xsendfile_conf_t *conf = (xsendfile_conf_t*)ap_get_module_config(
-    cmd->server->module_config,
-    &xsendfile_module
-    );
-
-  xsendfile_path_t *newpath = (xsendfile_path_t*)apr_array_push(conf->paths);
-  newpath->path = apr_pstrdup(cmd->pool, path);
-  newpath->allowFileDelete = (allowFileDelete && strcmp(allowFileDelete, "AllowFileDelete") == 0) ? 1: 0;
+/* bytes per second, optionally with a k, m or g suffix (powers of 1024) */
+static int xsendfile_parse_rate(const char *arg, apr_int64_t *rate) {
+  char *end;
+  apr_int64_t v = apr_strtoi64(arg, &end, 10);
 
-  return NULL;
+  if (end == arg || v < 0) {
+    return 0;
+  }
+  switch (apr_tolower(*end)) {
+  case 'g':
+    v *= 1024;
+    /* fall through */
+  case 'm':
+    v *= 1024;
+    /* fall through */
+  case 'k':
+    v *= 1024;
+    ++end;
+    break;
+  default:
+    break;
+  }
+  if (*end) {
+    return 0;
+  }
+  *rate = v;
+  return 1;
 }
 
-/*
-  little helper function to get the original request path
-  code borrowed from request.c and util_script.c
-*/
-static const char *ap_xsendfile_get_orginal_path(request_rec *rec) {
-  const char
-    *rv = rec->the_request,
-    *last;
+/* index of value in names, -1 if not found */
+static int xsendfile_parse_name(const char *value, const char *const *names, int n) {
+  int i;
 
-  int dir = 0;
-  size_t uri_len;
+  for (i = 0; i < n; ++i) {
+    if (strcasecmp(value, names[i]) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
 
-  /* skip method && spaces */
-  while (*rv && !apr_isspace(*rv)) {
-    ++rv;
+static const char *xsendfile_cmd_profile(cmd_parms *cmd, void *pdc,
+    const char *args) {
+  xsendfile_profile_t *profile;
+  const char *name, *option;
+  int v;
+
+  name = ap_getword_conf(cmd->pool, &args);
+  if (!*name) {
+    return "XSendFileProfile takes a name and key=value options";
   }
-  while (apr_isspace(*rv)) {
-    ++rv;
+  if (!xsendfile_profiles) {
+    return "XSendFileProfile: no profile registry";
   }
-  /* first space is the request end */
-  last = rv;
-  while (*last && !apr_isspace(*last)) {
-    ++last;
+  if (apr_hash_get(xsendfile_profiles, name, APR_HASH_KEY_STRING)) {
+    return apr_pstrcat(cmd->pool, "XSendFileProfile: ", name, " defined twice", NULL);
   }
-  uri_len = last - rv;
-  if (!uri_len) {
-    return NULL;
+
+  profile = (xsendfile_profile_t*)apr_palloc(cmd->pool, sizeof(xsendfile_profile_t));
+  *profile = xsendfile_default_profile;
+  profile->name = name;
+
+  while (*(option = ap_getword_conf(cmd->pool, &args))) {
+    const char *value = strchr(option, '=');
+    apr_size_t len;
+
+    if (!value) {
+      return apr_pstrcat(cmd->pool, "XSendFileProfile: option without value ", option, NULL);
+    }
+    len = (apr_size_t)(value++ - option);
+    if (len == 8 && strncasecmp(option, "Transfer", len) == 0) {
+      if ((v = xsendfile_parse_name(value, xsendfile_transfer_names, XSENDFILE_TRANSFER_MAX)) < 0) {
+        return "XSendFileProfile: Transfer must be one of auto, sendfile, mmap, read, direct";
+      }
+      profile->transfer = (xsendfile_transfer_t)v;
+    }
+    else if (len == 7 && strncasecmp(option, "Fadvise", len) == 0) {
+      if ((v = xsendfile_parse_name(value, xsendfile_fadvise_names, XSENDFILE_FADVISE_MAX)) < 0) {
+        return "XSendFileProfile: Fadvise must be one of none, normal, sequential, random, willneed, noreuse";
+      }
+      profile->fadvise = (xsendfile_fadvise_t)v;
+    }
+    else if (len == 8 && strncasecmp(option, "Compress", len) == 0) {
+      if ((v = xsendfile_parse_name(value, xsendfile_compress_names, XSENDFILE_COMPRESS_MAX)) < 0) {
+        return "XSendFileProfile: Compress must be one of on, static, off";
+      }
+      profile->compress = (xsendfile_compress_t)v;
+    }
+    else if (len == 13 && strncasecmp(option, "CompressTypes", len) == 0) {
+      apr_array_header_t *types = apr_array_make(cmd->pool, 4, sizeof(const char*));
+      char *type, *last;
+
+      for (type = apr_strtok(apr_pstrdup(cmd->pool, value), ",", &last); type;
+          type = apr_strtok(NULL, ",", &last)) {
+        *(const char**)apr_array_push(types) = *type == '.' ? type : apr_pstrcat(cmd->pool, ".", type, NULL);
+      }
+      profile->compressTypes = types;
+    }
+    else if (len == 11 && strncasecmp(option, "MetadataTTL", len) == 0) {
+      char *end;
+      apr_int64_t ttl = apr_strtoi64(value, &end, 10);
+
+      if (end == value || *end || ttl < 0) {
+        return "XSendFileProfile: MetadataTTL must be a number of seconds";
+      }
+      profile->metadataTTL = apr_time_from_sec(ttl);
+    }
+    else if (len == 8 && strncasecmp(option, "Immortal", len) == 0) {
+      if (strcasecmp(value, "on") == 0) {
+        profile->immortal = 1;
+      }
+      else if (strcasecmp(value, "off") == 0) {
+        profile->immortal = 0;
+      }
+      else {
+        return "XSendFileProfile: Immortal must be on or off";
+      }
+    }
+    else if (len == 9 && strncasecmp(option, "Immutable", len) == 0) {
+      if (strcasecmp(value, "on") == 0) {
+        profile->immutable = 1;
+      }
+      else if (strcasecmp(value, "off") == 0) {
+        profile->immutable = 0;
+      }
+      else {
+        return "XSendFileProfile: Immutable must be on or off";
+      }
+    }
+    else if (len == 7 && strncasecmp(option, "FsGuard", len) == 0) {
+      if (strcasecmp(value, "on") == 0) {
+        profile->fsGuard = 1;
+      }
+      else if (strcasecmp(value, "off") == 0) {
+        profile->fsGuard = 0;
+      }
+      else {
+        return "XSendFileProfile: FsGuard must be on or off";
+      }
+    }
+    else {
+      return apr_pstrcat(cmd->pool, "XSendFileProfile: unknown option ", option, NULL);
+    }
+  }
+  /* immutable files are trusted for the child's lifetime, unless told otherwise */
+  if (profile->immutable && !profile->metadataTTL) {
+    profile->immortal = 1;
   }
 
-  /* alright, lets see if the request_uri changed! */
-  if (strncmp(rv, rec->uri, uri_len) == 0) {
-    rv = apr_pstrdup(rec->pool, rec->filename);
-    dir = rec->finfo.filetype == APR_DIR;
+  apr_hash_set(xsendfile_profiles, name, APR_HASH_KEY_STRING, profile);
+  return NULL;
+}
+
+/* key=value options following the path of XSendFilePath and XSendFileMap */
+static const char *xsendfile_root_option(cmd_parms *cmd, const char *option,
+    int *allowFileDelete, apr_int64_t *limitRate, const xsendfile_profile_t **profile) {
+  if (allowFileDelete && strcasecmp(option, "AllowFileDelete") == 0) {
+    *allowFileDelete = 1;
   }
-  else {
-    /* need to lookup the url again as it changed */
-    request_rec *sr = ap_sub_req_lookup_uri(
-      apr_pstrmemdup(rec->pool, rv, uri_len),
-      rec,
-      NULL
-      );
-    if (!sr) {
-      return NULL;
+  else if (strncasecmp(option, "LimitRate=", 10) == 0) {
+    if (!xsendfile_parse_rate(option + 10, limitRate)) {
+      return apr_pstrcat(cmd->pool, cmd->cmd->name, ": invalid rate ", option + 10, NULL);
     }
-    rv = apr_pstrdup(rec->pool, sr->filename);
-    dir = rec->finfo.filetype == APR_DIR;
-    ap_destroy_sub_req(sr);
   }
+  else if (strncasecmp(option, "Profile=", 8) == 0) {
+    /* profiles have to be defined first, so there's nothing left to do at request time */
+    if (!xsendfile_profiles
+      || !(*profile = (const xsendfile_profile_t*)apr_hash_get(xsendfile_profiles, option + 8, APR_HASH_KEY_STRING))) {
+      return apr_pstrcat(cmd->pool, cmd->cmd->name, ": no XSendFileProfile ", option + 8, " (yet)", NULL);
+    }
+  }
+  else {
+    /* ignored before options were introduced, so don't refuse to start over it */
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, cmd->server,
+      "%s: ignoring unknown option %s (%s:%d)", cmd->cmd->name, option,
+      cmd->directive->filename, cmd->directive->line_num);
+  }
+  return NULL;
+}
 
-  /* now we need to truncate so we only have the directory */
-  if (!dir && (last = ap_strrchr(rv, '/')) != NULL) {
-    *((char*)last + 1) = '\0';
+/*
+  the length of path to compare file names against in
+  xsendfile_could_match(): without trailing slashes, and 0 (i.e. don't
+  compare, just try) unless the path is in canonical form
+*/
+static apr_size_t xsendfile_prefix_len(const char *path) {
+#if defined(WIN32) || defined(NETWARE) || defined(OS2)
+  /* drive letters, case insensitivity and backslashes: leave it to apr_filepath_merge */
+  return 0;
+#else
+  apr_size_t len = strlen(path);
+
+  if (path[0] != '/' || strstr(path, "/.") || strstr(path, "//")) {
+    return 0;
   }
-  return rv;
+  while (len > 1 && path[len - 1] == '/') {
+    --len;
+  }
+  return len > 1 ? len : 0;
+#endif
 }
 
-/**
- * caches the compressed response for path @ compressed_path
- * @return 1 if compressed successfully, 0 otherwise
- */
-static int ap_xsendfile_deflate(request_rec *r, const char *path, const char *compressed_path, int mode) {
-#ifdef MOD_XSENDFILE_AUTO_GZIP
-  const char *tmp_compress_path;
-
-#ifndef HACKY_GZIP
-  // zlib scratch variables
-  int compression = -1;
-
-  // cache compressed version of file into gzip format using zlib
-  int ret, flush;
-  unsigned have;
-  zlib_context_t ctx;
+static const char *xsendfile_cmd_path(cmd_parms *cmd, void *pdc,
+    const char *args) {
+  xsendfile_conf_t *conf = (xsendfile_conf_t*)ap_get_module_config(
+    cmd->server->module_config,
+    &xsendfile_module
+    );
+  xsendfile_path_t *newpath;
+  const char *path, *option, *err;
 
-  if (compression == -1) {
-    compression = MOD_XSENDFILE_DEFLATE_DEFAULT_COMPRESSION_LEVEL;
+  path = ap_getword_conf(cmd->pool, &args);
+  if (!*path) {
+    return "XSendFilePath takes a path and optionally AllowFileDelete, LimitRate=<bytes/s> and Profile=<name>";
   }
 
-  /* allocate deflate state */
-  ctx.strm.zalloc = Z_NULL;
-  ctx.strm.zfree = Z_NULL;
-  ctx.strm.opaque = Z_NULL;
-  ret = deflateInit2(&strm, compression, Z_DEFLATED, MOD_XSENDFILE_ZLIB_WINDOWSIZE, MOD_XSENDFILE_ZLIB_CFACTOR, Z_DEFAULT_STRATEGY);
-
-  if (ret != Z_OK) {
-    return 0;
+  newpath = (xsendfile_path_t*)apr_array_push(conf->paths);
+  newpath->path = path;
+  newpath->allowFileDelete = 0;
+  newpath->limitRate = 0;
+  newpath->profile = &xsendfile_default_profile;
+  newpath->prefixLen = xsendfile_prefix_len(path);
+  while (*(option = ap_getword_conf(cmd->pool, &args))) {
+    if ((err = xsendfile_root_option(cmd, option, &newpath->allowFileDelete, &newpath->limitRate, &newpath->profile)) != NULL) {
+      return err;
+    }
   }
+  newpath->id = xsendfile_root_id(cmd->pool, newpath->path);
 
-  do {
-    ctx.strm.avail_in = ;
-  } while (flush != Z_FINISH);
-
-  return 1;
-#else /* HACKY_GZIP */
-  const char *compress_cmd;
-  pid_t child;
-  pid_t wait_child;
-  int wait_status;
-  int outf;
+  return NULL;
+}
 
-  tmp_compress_path = apr_pstrcat(r->pool, compressed_path, ".tmp", NULL);
+static const char *xsendfile_cmd_map(cmd_parms *cmd, void *pdc,
+    const char *args) {
+  xsendfile_conf_t *conf = (xsendfile_conf_t*)ap_get_module_config(
+    cmd->server->module_config,
+    &xsendfile_module
+    );
+  xsendfile_map_t *maps, map;
+  const char *prefix, *path, *option, *err;
+  int i;
 
-  outf = creat(tmp_compress_path, mode);
-  if (outf == -1) {
-    char *errmsg = strerror(errno);
-    exit(1);
+  prefix = ap_getword_conf(cmd->pool, &args);
+  path = ap_getword_conf(cmd->pool, &args);
+  if (!*prefix || !*path) {
+    return "XSendFileMap takes a URI prefix, a directory and optionally LimitRate=<bytes/s> and Profile=<name>";
   }
-
-  child = fork();
-  if (child == -1) {
-    return 0;
+  if (prefix[0] != '/') {
+    return "XSendFileMap: the URI prefix must start with a slash";
+  }
+  if (!ap_os_is_path_absolute(cmd->pool, path)) {
+    return "XSendFileMap: the directory must be absolute";
   }
 
-  if (child == 0) {
-    // child - exec the gzip command
-    char *const argv[] = { "/bin/gzip", "--stdout", "-9", (char * const)path };
-
-    if (-1 == dup2(outf, STDOUT_FILENO)) {
-      exit(1);
+  map.prefix = prefix;
+  map.prefixLen = strlen(prefix);
+  map.path = path;
+  map.id = xsendfile_root_id(cmd->pool, map.path);
+  map.limitRate = 0;
+  map.profile = &xsendfile_default_profile;
+  while (*(option = ap_getword_conf(cmd->pool, &args))) {
+    if ((err = xsendfile_root_option(cmd, option, NULL, &map.limitRate, &map.profile)) != NULL) {
+      return err;
     }
-
-    execv("/bin/gzip", argv);
-    // some error occured
-    exit(1);
   }
 
-  if (-1 == waitpid(child, &wait_status, 0)) {
-    return 0;
+  /* keep the table ordered by prefix length, so the first match is the longest */
+  apr_array_push(conf->maps);
+  maps = (xsendfile_map_t*)conf->maps->elts;
+  for (i = conf->maps->nelts - 1; i > 0 && maps[i - 1].prefixLen < map.prefixLen; --i) {
+    maps[i] = maps[i - 1];
   }
+  maps[i] = map;
 
-  if (!WIFEXITED(wait_status)) {
-    return 0;
-  } else {
-    int exit_status = WEXITSTATUS(wait_status);
-    // WTF: why does gzip exit with 1 when no error occured???
-    if (exit_status != 0 && exit_status != 1) {
-      return 0;
-    }
-  }
+  return NULL;
+}
 
-  if (0 != rename(tmp_compress_path, compressed_path)) {
-    unlink(tmp_compress_path);
-    return 0;
+static const char *xsendfile_cmd_hints(cmd_parms *cmd, void *perdir_confv,
+    const char *arg) {
+  xsendfile_conf_t *conf = (xsendfile_conf_t *)perdir_confv;
+  if (!cmd->path) {
+    conf = (xsendfile_conf_t*)ap_get_module_config(
+      cmd->server->module_config,
+      &xsendfile_module
+      );
+  }
+  if (!strcasecmp(arg, "off")) {
+    conf->earlyHints = XSENDFILE_HINTS_OFF;
+  }
+  else if (!strcasecmp(arg, "on")) {
+    conf->earlyHints = XSENDFILE_HINTS_HEADER;
+  }
+  else if (!strcasecmp(arg, "sidecar")) {
+    conf->earlyHints = XSENDFILE_HINTS_SIDECAR;
+  }
+  else {
+    return "XSendFileEarlyHints must be one of off, on, sidecar";
   }
+  return NULL;
+}
 
-  return 1;
-#endif /* HACKY_GZIP */
+static const char *xsendfile_cmd_prefetch(cmd_parms *cmd, void *perdir_confv,
+    const char *arg) {
+  xsendfile_conf_t *conf = (xsendfile_conf_t *)perdir_confv;
+  char *end;
+  apr_int64_t n;
 
-#endif /* MOD_XSENDFILE_AUTO_GZIP */
+  if (!cmd->path) {
+    conf = (xsendfile_conf_t*)ap_get_module_config(
+      cmd->server->module_config,
+      &xsendfile_module
+      );
+  }
+  if (!strcasecmp(arg, "off")) {
+    conf->prefetch = -1;
+    return NULL;
+  }
+  if (!strcasecmp(arg, "on")) {
+    n = XSENDFILE_PREFETCH_MAX;
+  }
+  else {
+    n = apr_strtoi64(arg, &end, 10);
+    if (*end || n < 1 || n > APR_INT32_MAX) {
+      return "XSendFilePrefetch must be off, on or a positive number of files";
+    }
+  }
+  conf->prefetch = (int)n;
+  /* the children start the prefetching thread only if used at all; not in .htaccess, read too late for that */
+  xsendfile_prefetch_wanted = 1;
+  return NULL;
 }
 
-static int ap_xsendfile_accepts_gzip(request_rec *r) {
-  char *token;
-  const char *accepts;
-
-  /* Accept-Encoding logic copied from mod_deflate.c: */
-  /* Even if we don't accept this request based on it not having
-   * the Accept-Encoding, we need to note that we were looking
-   * for this header and downstream proxies should be aware of that.
-   */
-  apr_table_mergen(r->headers_out, "Vary", "Accept-Encoding");
+/* off|on|<bytes> settings, on being the directive's default size, min the least */
+static const char *xsendfile_cmd_size(cmd_parms *cmd, void *perdir_confv,
+    const char *arg) {
+  xsendfile_conf_t *conf = (xsendfile_conf_t *)perdir_confv;
+  apr_off_t *field, on, min = 1024;
+  apr_int64_t size;
 
-  accepts = apr_table_get(r->headers_in, "Accept-Encoding");
-  if (accepts == NULL) {
-    /* just pass-through the sendfile untouched */
-    return 0;
+  if (!cmd->path) {
+    conf = (xsendfile_conf_t*)ap_get_module_config(
+      cmd->server->module_config,
+      &xsendfile_module
+      );
   }
- 
-  token = ap_get_token(r->pool, &accepts, 0);
-  while (token && token[0] && strcasecmp(token, "gzip")) {
-    /* skip parameters, XXX: ;q=foo evaluation? */
-    while (*accepts == ';') { 
-      ++accepts;
-      token = ap_get_token(r->pool, &accepts, 1);
-    }
- 
-    /* retrieve next token */
-    if (*accepts == ',') {
-      ++accepts;
-    }
-    token = (*accepts) ? ap_get_token(r->pool, &accepts, 0) : NULL;
+  if (!strcasecmp(cmd->cmd->name, "xsendfilebucketsize")) {
+    field = &conf->bucketSize;
+    on = XSENDFILE_BUCKET_SIZE;
+    min = XSENDFILE_BUCKET_MIN;
   }
-  
-  /* No acceptable token found. */
-  if (token == NULL || token[0] == '\0') {
-    return 0;
+  else if (!strcasecmp(cmd->cmd->name, "xsendfileh2bucketsize")) {
+    field = &conf->h2BucketSize;
+    on = XSENDFILE_H2_BUCKET_SIZE;
+    min = XSENDFILE_H2_BUCKET_MIN;
+  }
+  else if (!strcasecmp(cmd->cmd->name, "xsendfilecork")) {
+    field = &conf->corkSize;
+    on = XSENDFILE_CORK_SIZE;
+  }
+  else {
+    return apr_psprintf(cmd->pool, "Not a valid command in this context: %s", cmd->cmd->name);
   }
 
-  /* found gzip token */
-  return 1;
+  if (!strcasecmp(arg, "off")) {
+    *field = -1;
+  }
+  else if (!strcasecmp(arg, "on")) {
+    *field = on;
+  }
+  else if (xsendfile_parse_rate(arg, &size) && size >= min && size <= AP_MAX_SENDFILE) {
+    *field = (apr_off_t)size;
+  }
+  else {
+    return apr_psprintf(cmd->pool, "%s must be off, on or a size between %" APR_OFF_T_FMT "k and 16m",
+      cmd->cmd->name, min / 1024);
+  }
+  return NULL;
 }
 
-static void ap_xsendfile_get_compressed_filepath(request_rec *r, /* out */ char **adjusted_path) {
-  size_t pathlen;
-  const char *path;
-  char *deflate_path;
-  struct stat original_stat;
-  struct stat compressed_stat;
-
-  path = *adjusted_path;
+static const char *xsendfile_cmd_disklimit(cmd_parms *cmd, void *perdir_confv,
+    const char *limit, const char *minSize, const char *retryAfter) {
+  xsendfile_conf_t *conf = (xsendfile_conf_t *)perdir_confv;
+  apr_int64_t size = XSENDFILE_DISK_MIN_SIZE, v;
+  char *end;
 
-  if (!ap_xsendfile_accepts_gzip(r)) {
-    return;
+  if (!cmd->path) {
+    conf = (xsendfile_conf_t*)ap_get_module_config(
+      cmd->server->module_config,
+      &xsendfile_module
+      );
   }
-
-  if (0 != stat(path, &original_stat)) {
-#ifdef _DEBUG
-    char errmsg[128];
-    apr_strerror(apr_get_os_error(), errmsg, sizeof(errmsg) - 1);
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: can't stat %s: %s", path, errmsg);
-#endif
-    return;
+  if (!strcasecmp(limit, "off")) {
+    conf->diskLimit = -1;
+    return NULL;
+  }
+  v = apr_strtoi64(limit, &end, 10);
+  if (*end || v < 1 || v > APR_INT32_MAX) {
+    return "XSendFileDiskLimit must be off or a positive number";
   }
+  conf->diskLimit = (int)v;
+  if (minSize && !xsendfile_parse_rate(minSize, &size)) {
+    return "XSendFileDiskLimit: invalid minimum size";
+  }
+  conf->diskMinSize = (apr_off_t)size;
+  v = retryAfter ? apr_strtoi64(retryAfter, &end, 10) : XSENDFILE_DISK_RETRY_AFTER;
+  if ((retryAfter && *end) || v < 1 || v > APR_INT32_MAX) {
+    return "XSendFileDiskLimit: Retry-After must be a positive number of seconds";
+  }
+  conf->diskRetryAfter = (int)v;
+  return NULL;
+}
 
-  deflate_path = apr_pstrcat(r->pool, path, ".gz", NULL);
+static const char *xsendfile_cmd_slowlog(cmd_parms *cmd, void *pdc,
+    const char *threshold, const char *fname, const char *rate) {
+  xsendfile_slowlog_t *log;
+  const char *err;
+  char *end;
+  apr_int64_t ms;
 
-  if (0 != stat(deflate_path, &compressed_stat) || compressed_stat.st_mtime < original_stat.st_mtime) {
-#ifndef MOD_XSENDFILE_AUTO_GZIP
-    // no zlib support so can't compress the file
-#ifdef _DEBUG
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: zlib not available - can't compress %s", path);
-#endif
-    return;
-#endif
-    int compressible_path;
-    int i;
-    int mode = original_stat.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO);
+  if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) != NULL) {
+    return err;
+  }
 
-    // TODO: make this configurable pattern-matching
-    const char *compressible_extensions [] = {
-      ".css",
-      ".js",
-      ".html",
-      ".json",
-    };
+  ms = apr_strtoi64(threshold, &end, 10);
+  if (*end || ms < 0) {
+    return "XSendFileSlowLog: threshold must be a number of milliseconds";
+  }
 
-    size_t n_compressible_extensions = sizeof(compressible_extensions) / sizeof(compressible_extensions[0]);
+  log = (xsendfile_slowlog_t*)apr_pcalloc(cmd->pool, sizeof(xsendfile_slowlog_t));
+  log->thresholdNs = (apr_uint64_t)ms * 1000000;
+  log->fname = fname[0] == '|' ? apr_pstrdup(cmd->pool, fname) : ap_server_root_relative(cmd->pool, fname);
+  if (!log->fname) {
+    return apr_pstrcat(cmd->pool, "XSendFileSlowLog: invalid file name ", fname, NULL);
+  }
+  log->rate = 10;
+  if (rate) {
+    log->rate = atoi(rate);
+    if (log->rate < 1) {
+      return "XSendFileSlowLog: rate must be at least one line per second";
+    }
+  }
+  xsendfile_slowlog = log;
 
-    // compressed file doesn't exist or is older than the source file
-    // check to make sure that it's compressible
+  return NULL;
+}
 
-    pathlen = strlen(path);
+static const char *xsendfile_cmd_fsguard(cmd_parms *cmd, void *pdc,
+    const char *threads, const char *queue, const char *timeout) {
+  xsendfile_fsguard_t *o;
+  const char *err;
+  char *end;
+  apr_int64_t v;
 
-    compressible_path = 0;
-    for (i = 0; i < n_compressible_extensions; i++) {
-      const char *compressible_extension = compressible_extensions[i];
-      size_t extension_length = strlen(compressible_extension);
-      if (pathlen < extension_length) {
-	continue;
-      }
+  if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) != NULL) {
+    return err;
+  }
 
-      if (strcmp(path + pathlen - extension_length, compressible_extension) == 0) {
-	compressible_path = 1;
-	break;
-      }
+  o = (xsendfile_fsguard_t*)apr_pcalloc(cmd->pool, sizeof(xsendfile_fsguard_t));
+  v = apr_strtoi64(threads, &end, 10);
+  if (*end || v < 1 || v > APR_INT32_MAX / XSENDFILE_FSGUARD_QUEUE) {
+    return "XSendFileFsGuard: number of threads must be positive";
+  }
+  o->threads = (int)v;
+  if (queue) {
+    v = apr_strtoi64(queue, &end, 10);
+    if (*end || v < 1 || v > APR_INT32_MAX) {
+      return "XSendFileFsGuard: queue length must be positive";
     }
-
-    if (!compressible_path) {
-#ifdef _DEBUG
-      ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: path %s doesn't have a compressible extension", path);
-#endif
-      return;
+    o->queue = (int)v;
+  }
+  else {
+    o->queue = o->threads * XSENDFILE_FSGUARD_QUEUE;
+  }
+  v = XSENDFILE_FSGUARD_TIMEOUT;
+  if (timeout) {
+    v = apr_strtoi64(timeout, &end, 10);
+    if (*end || v < 1 || v > APR_INT32_MAX) {
+      return "XSendFileFsGuard: timeout must be a positive number of milliseconds";
     }
+  }
+  o->timeout = apr_time_from_msec(v);
+  xsendfile_fsguard = o;
 
-    // do compression since file to serve is allowed to be compressible
-    if (!ap_xsendfile_deflate(r, path, deflate_path, mode)) {
-#ifdef _DEBUG
-      ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: failed to compress %s to %s", path, deflate_path);
-#endif
-      return;
-    }
+  return NULL;
+}
 
-    if (0 != stat(deflate_path, &compressed_stat)) {
-#ifdef _DEBUG
-      ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: failed to stat %s after compression succeeded?", deflate_path);
-#endif
-      return;
-    }
+static const char *xsendfile_cmd_declog(cmd_parms *cmd, void *pdc,
+    const char *fname, const char *bufsize) {
+  xsendfile_declog_t *log;
+  const char *err;
+
+  if ((err = ap_check_cmd_context(cmd, GLOBAL_ONLY)) != NULL) {
+    return err;
   }
 
-  {
-    *adjusted_path = deflate_path;
-    apr_table_set(r->headers_out, "Content-Length", apr_psprintf(r->pool, "%lu", (unsigned long)compressed_stat.st_size));
-    apr_table_set(r->headers_out, "Content-Encoding", "gzip");
-#ifdef _DEBUG
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: serving up encoded file %s", deflate_path);
-#endif
+  log = (xsendfile_declog_t*)apr_pcalloc(cmd->pool, sizeof(xsendfile_declog_t));
+  log->fname = fname[0] == '|' ? apr_pstrdup(cmd->pool, fname) : ap_server_root_relative(cmd->pool, fname);
+  if (!log->fname) {
+    return apr_pstrcat(cmd->pool, "XSendFileDecisionLog: invalid file name ", fname, NULL);
   }
+  log->bufsize = XSENDFILE_DECISIONLOG_BUFSIZE;
+  if (bufsize) {
+    int kb = atoi(bufsize);
+    if (kb < XSENDFILE_DECISIONLOG_MAXREC / 1024 || kb > 64 * 1024) {
+      return "XSendFileDecisionLog: buffer size must be between 8 and 65536 KiB";
+    }
+    log->bufsize = (apr_uint32_t)kb * 1024;
+  }
+  xsendfile_declog = log;
 
-  return;
+  return NULL;
 }
 
 /*
-  little helper function to build the file path if available
+  little helper function to get the original request path
+  code borrowed from request.c and util_script.c
 */
-static apr_status_t ap_xsendfile_get_filepath(request_rec *r,
-    xsendfile_conf_t *conf, const char *file, int shouldDeleteFile,
-    /* out */ char **path) {
-
-  apr_status_t rv;
+static const char *ap_xsendfile_get_orginal_path(request_rec *rec, xsendfile_ctx_t *ctx) {
+  const char
+    *rv = rec->the_request,
+    *last;
 
-  apr_array_header_t *patharr;
-  const xsendfile_path_t *paths;
-  int i;
+  int dir = 0;
+  size_t uri_len;
 
-  patharr = conf->paths;
-  if (!shouldDeleteFile) {
-    const char *root = ap_xsendfile_get_orginal_path(r);
-    if (root) {
-      xsendfile_path_t *newpath;
+  /* skip method && spaces */
+  while (*rv && !apr_isspace(*rv)) {
+    ++rv;
+  }
+  while (apr_isspace(*rv)) {
+    ++rv;
+  }
+  /* first space is the request end */
+  last = rv;
+  while (*last && !apr_isspace(*last)) {
+    ++last;
+  }
+  uri_len = last - rv;
+  if (!uri_len) {
+    return NULL;
+  }
 
-#ifdef _DEBUG
-      ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: path is %s", root);
-#endif
+  /* alright, lets see if the request_uri changed! */
+  if (strncmp(rv, rec->uri, uri_len) == 0) {
+    rv = apr_pstrdup(rec->pool, rec->filename);
+    dir = rec->finfo.filetype == APR_DIR;
+  }
+  else {
+    /* need to lookup the url again as it changed */
+    request_rec *sr;
 
-      patharr = apr_array_make(
-        r->pool,
-        conf->paths->nelts + 1,
-        sizeof(xsendfile_path_t)
-        );
-      newpath = apr_array_push(patharr);
-      newpath->path = root;
-      newpath->allowFileDelete = 0;
-      apr_array_cat(patharr, conf->paths);
+    XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_SUBREQ);
+    sr = ap_sub_req_lookup_uri(
+      apr_pstrmemdup(rec->pool, rv, uri_len),
+      rec,
+      NULL
+      );
+    if (!sr) {
+      return NULL;
     }
+    rv = apr_pstrdup(rec->pool, sr->filename);
+    dir = rec->finfo.filetype == APR_DIR;
+    ap_destroy_sub_req(sr);
   }
 
-  if (patharr->nelts == 0) {
-    return APR_EBADPATH;
+  /* now we need to truncate so we only have the directory */
+  if (!dir && (last = ap_strrchr(rv, '/')) != NULL) {
+    *((char*)last + 1) = '\0';
   }
+  return rv;
+}
 
-  paths = (const xsendfile_path_t*)patharr->elts;
-  for (i = 0; i < patharr->nelts; ++i) {
-    if (shouldDeleteFile && !paths[i].allowFileDelete){
-      continue;
-    }
+/* a user.* extended attribute, NULL if not there (or no xattrs here) */
+static char *xsendfile_xattr_get(apr_pool_t *p, const char *path, const char *name) {
+#ifdef XSENDFILE_XATTR
+  char buf[256];
+  ssize_t len = getxattr(path, name, buf, sizeof(buf));
 
-    if ((rv = apr_filepath_merge(
-      path,
-      paths[i].path,
-      file,
-      APR_FILEPATH_TRUENAME | APR_FILEPATH_NOTABOVEROOT,
-      r->pool
-    )) == OK) {
-#ifdef _DEBUG
-      ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: finished merging at %d/%d elements", i, patharr->nelts);
+  if (len > 0) {
+    return apr_pstrmemdup(p, buf, (apr_size_t)len);
+  }
 #endif
+  return NULL;
+}
 
-      break;
-    } else {
-#ifdef _DEBUG
-      ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: merged %d/%d elements (component = %s).  path is now %s", i, patharr->nelts, paths[i].path, *path);
+static int xsendfile_xattr_set(const char *path, const char *name, const char *value) {
+#ifdef XSENDFILE_XATTR
+  return setxattr(path, name, value, strlen(value), 0) == 0;
+#else
+  return 0;
+#endif
+}
+
+/* mtime in nanoseconds, as far as the platform tells */
+static apr_int64_t xsendfile_mtime_ns(const struct stat *st) {
+#if defined(__linux__)
+  return (apr_int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#else
+  return (apr_int64_t)st->st_mtime * 1000000000;
 #endif
+}
+
+/*
+  stat() asking for no more than the module uses: type, mode, inode,
+  size and mtime (and the device, which comes for free). With statx(),
+  owner, link count, times other than the mtime and the like aren't
+  copied out, or fetched at all by file systems that can tell. Where
+  statx() is missing (ENOSYS: old kernels, seccomp filters) or a file
+  system leaves out any of those, plain stat() it is.
+*/
+static int xsendfile_stat(const char *path, struct stat *st) {
+#ifdef XSENDFILE_STATX
+  struct statx stx;
+
+  if (statx(AT_FDCWD, path, 0, XSENDFILE_STATX_MASK, &stx) != 0) {
+    if (errno != ENOSYS) {
+      return -1;
     }
+    return stat(path, st);
   }
-  if (rv != OK) {
-    *path = NULL;
-  } else {
-    ap_xsendfile_get_compressed_filepath(r, path);
+  if ((stx.stx_mask & XSENDFILE_STATX_MASK) != XSENDFILE_STATX_MASK) {
+    return stat(path, st);
   }
-  return rv;
+  memset(st, 0, sizeof(*st));
+  st->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  st->st_ino = stx.stx_ino;
+  st->st_mode = stx.stx_mode;
+  st->st_size = stx.stx_size;
+  st->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+  return 0;
+#else
+  return stat(path, st);
+#endif
 }
 
-static apr_status_t ap_xsendfile_output_filter(ap_filter_t *f, apr_bucket_brigade *in) {
-  request_rec *r = f->r, *sr = NULL;
-
-  xsendfile_conf_t
-    *dconf = ap_get_module_config(r->per_dir_config, &xsendfile_module),
-    *sconf = ap_get_module_config(r->server->module_config, &xsendfile_module),
-    *conf = xsendfile_config_merge(r->pool, sconf, dconf);
+/* the same for an opened file, filling what the filter goes by */
+static apr_status_t xsendfile_fd_info(apr_finfo_t *finfo, apr_file_t *fd) {
+#ifdef XSENDFILE_STATX
+  struct statx stx;
+  apr_os_file_t osfd;
 
-  core_dir_config *coreconf = ap_get_module_config(r->per_dir_config, &core_module);
+  apr_os_file_get(&osfd, fd);
+  if (statx(osfd, "", AT_EMPTY_PATH, XSENDFILE_STATX_MASK, &stx) != 0) {
+    if (errno != ENOSYS) {
+      return apr_get_os_error();
+    }
+  }
+  else if ((stx.stx_mask & XSENDFILE_STATX_MASK) == XSENDFILE_STATX_MASK) {
+    memset(finfo, 0, sizeof(*finfo));
+    finfo->valid = APR_FINFO_TYPE | APR_FINFO_INODE | APR_FINFO_DEV | APR_FINFO_SIZE | APR_FINFO_MTIME;
+    finfo->filetype = S_ISREG(stx.stx_mode) ? APR_REG : S_ISDIR(stx.stx_mode) ? APR_DIR : APR_UNKFILE;
+    finfo->inode = stx.stx_ino;
+    finfo->device = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    finfo->size = stx.stx_size;
+    finfo->mtime = apr_time_make(stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec / 1000);
+    finfo->filehand = fd;
+    return APR_SUCCESS;
+  }
+#endif
+  return apr_file_info_get(finfo,
+    APR_FINFO_TYPE | APR_FINFO_INODE | APR_FINFO_DEV | APR_FINFO_SIZE | APR_FINFO_MTIME, fd);
+}
 
-  apr_status_t rv;
-  apr_bucket *e;
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC xsendfile_fsguard_thread(apr_thread_t *thd, void *data) {
+  xsendfile_fsguard_t *o = (xsendfile_fsguard_t*)data;
+  xsendfile_job_t *job;
 
-  apr_file_t *fd = NULL;
-  apr_finfo_t finfo;
+  apr_thread_mutex_lock(o->mutex);
+  while (!o->shutdown) {
+    if (!(job = o->head)) {
+      apr_thread_cond_wait(o->work, o->mutex);
+      continue;
+    }
+    if (!(o->head = job->next)) {
+      o->tail = NULL;
+    }
+    o->queued--;
+    job->started = xsendfile_clock();
+    apr_thread_mutex_unlock(o->mutex);
+
+    if (job->open) {
+#ifdef O_CLOEXEC
+      job->fd = open(job->path, O_RDONLY | O_CLOEXEC);
+#else
+      job->fd = open(job->path, O_RDONLY);
+#endif
+      job->err = job->fd < 0 ? errno : 0;
+    }
+    else {
+      job->err = xsendfile_stat(job->path, &job->st) != 0 ? errno : 0;
+    }
 
-  char *file = NULL;
-  char *translated = NULL;
-  char *translatedEncoding = NULL;
+    apr_thread_mutex_lock(o->mutex);
+    if (job->abandoned) {
+      if (job->fd >= 0) {
+        close(job->fd);
+      }
+      free(job->path);
+      job->path = NULL;
+      job->next = o->free;
+      o->free = job;
+      o->stuck--;
+    }
+    else {
+      job->done = 1;
+      apr_thread_cond_signal(job->cond);
+    }
+  }
+  apr_thread_mutex_unlock(o->mutex);
 
-  int errcode;
-  int shouldDeleteFile = 0;
+  apr_thread_exit(thd, APR_SUCCESS);
+  return NULL;
+}
 
-#ifdef _DEBUG
-  ap_log_error(
-    APLOG_MARK,
-    APLOG_DEBUG,
-    0,
-    r->server,
-    "xsendfile: output_filter for %s",
-    r->the_request
-    );
-#endif
-  /*
-    should we proceed with this request?
+static apr_status_t xsendfile_fsguard_shutdown(void *data) {
+  xsendfile_fsguard_t *o = (xsendfile_fsguard_t*)data;
+  apr_status_t rv;
+  int i;
 
-    * sub-requests suck
-    * furthermore default-handled requests suck, as they actually shouldn't be able to set headers
-  */
-  if (
-    r->status != HTTP_OK
-    || r->main
-    || (r->handler && strcmp(r->handler, "default-handler") == 0)
-  ) {
-#ifdef _DEBUG
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: not met [%d]", r->status);
-#endif
-    ap_remove_output_filter(f);
-    return ap_pass_brigade(f->next, in);
+  apr_thread_mutex_lock(o->mutex);
+  o->shutdown = 1;
+  apr_thread_cond_broadcast(o->work);
+  apr_thread_mutex_unlock(o->mutex);
+  for (i = 0; i < o->threads; ++i) {
+    apr_thread_join(&rv, o->workers[i]);
+  }
+  /* whatever is left was given up on */
+  for (i = 0; i < o->njobs; ++i) {
+    free(o->jobs[i].path);
   }
 
-  /*
-    alright, look for x-sendfile
-  */
-  file = (char*)apr_table_get(r->headers_out, AP_XSENDFILE_HEADER);
+  return APR_SUCCESS;
+}
 
-  /* cgi/fastcgi will put the stuff into err_headers_out */
-  if (!file || !*file) {
-    file = (char*)apr_table_get(r->err_headers_out, AP_XSENDFILE_HEADER);
+/* with the mutex held: a timeout or success of a call for the breaker */
+static void xsendfile_breaker_update(xsendfile_breaker_t *b, int probe, int timedOut) {
+  if (!timedOut) {
+    b->timeouts = 0;
+    if (probe) {
+      b->openUntil = 0;
+      b->probing = 0;
+    }
+    return;
   }
+  if (++b->timeouts >= XSENDFILE_FSGUARD_TRIP || probe) {
+    b->openUntil = xsendfile_clock() + (apr_uint64_t)XSENDFILE_FSGUARD_COOLDOWN * 1000000000;
+    b->probing = 0;
+  }
+}
 
-  /*
-    so...there is no X-SendFile header, check if there is an X-Sendfile-Temporary header
-  */
-  if (!file || !*file) {
-    shouldDeleteFile = 1;
-    file = (char*)apr_table_get(r->headers_out, AP_XSENDFILETEMPORARY_HEADER);
+/*
+  have a thread do the call and wait for it, up to the timeout; *job is
+  the finished job then, to be handed back with xsendfile_fsguard_done().
+  APR_EBUSY if the root's breaker is open, APR_EAGAIN if no thread or
+  slot is to be had, APR_TIMEUP if it took too long, the job then being
+  taken care of by the threads.
+*/
+static apr_status_t xsendfile_fsguard_run(xsendfile_ctx_t *ctx, const char *path, int open,
+    xsendfile_job_t **job) {
+  xsendfile_fsguard_t *o = xsendfile_fsguard;
+  xsendfile_breaker_t *b = &o->breakers[ctx->rootId];
+  apr_uint64_t deadline, now = xsendfile_clock();
+  xsendfile_job_t *j;
+  char *copy;
+  int probe = 0;
+
+  if (!(copy = strdup(path))) {
+    return APR_ENOMEM;
   }
-  /*
-    Maybe X-Sendfile-Temporary is set via cgi in error_headers_out?
-  */
-  if (!file || !*file) {
-    file = (char*)apr_table_get(r->err_headers_out, AP_XSENDFILETEMPORARY_HEADER);
+  apr_thread_mutex_lock(o->mutex);
+  if (b->openUntil) {
+    if (now < b->openUntil || b->probing) {
+      apr_thread_mutex_unlock(o->mutex);
+      free(copy);
+      return ctx->guardBusy = APR_EBUSY;
+    }
+    b->probing = probe = 1;
+  }
+  if (o->queued >= o->queue || o->stuck >= o->threads || !(j = o->free)) {
+    if (probe) {
+      /* not a verdict on the root, the next one gets to try */
+      b->probing = 0;
+    }
+    apr_thread_mutex_unlock(o->mutex);
+    free(copy);
+    return ctx->guardBusy = APR_EAGAIN;
+  }
+  o->free = j->next;
+  j->next = NULL;
+  j->open = open;
+  j->done = 0;
+  j->abandoned = 0;
+  j->err = 0;
+  j->fd = -1;
+  j->path = copy;
+  j->queued = now;
+  j->started = 0;
+  if (o->tail) {
+    o->tail->next = j;
+  }
+  else {
+    o->head = j;
   }
+  o->tail = j;
+  o->queued++;
+  apr_thread_cond_signal(o->work);
 
-  /* Remove any X-Sendfile headers */
-  apr_table_unset(r->headers_out, AP_XSENDFILE_HEADER);
-  apr_table_unset(r->err_headers_out, AP_XSENDFILE_HEADER);
-  apr_table_unset(r->headers_out, AP_XSENDFILETEMPORARY_HEADER);
-  apr_table_unset(r->err_headers_out, AP_XSENDFILETEMPORARY_HEADER);
+  deadline = j->queued + (apr_uint64_t)o->timeout * 1000;
+  while (!j->done && !o->shutdown && (now = xsendfile_clock()) < deadline) {
+    apr_thread_cond_timedwait(j->cond, o->mutex, (apr_interval_time_t)((deadline - now) / 1000) + 1);
+  }
 
-  /* nothing there :p */
-  if (!file || !*file) {
-#ifdef _DEBUG
-    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: nothing found");
-#endif
-    ap_remove_output_filter(f);
-    return ap_pass_brigade(f->next, in);
+  ctx->guarded++;
+  ctx->guardWait += (j->started ? j->started : xsendfile_clock()) - j->queued;
+  xsendfile_breaker_update(b, probe, !j->done);
+  if (j->done) {
+    apr_thread_mutex_unlock(o->mutex);
+    *job = j;
+    return APR_SUCCESS;
+  }
+  if (j->started) {
+    j->abandoned = 1;
+    o->stuck++;
   }
+  else {
+    /* never got to it, out of the queue again */
+    xsendfile_job_t **prev = &o->head, *last = NULL;
 
-  /*
-    drop *everything*
-    might be pretty expensive to generate content first that goes straight to the bitbucket,
-    but actually the scripts that might set this flag won't output too much anyway
-  */
-  while (!APR_BRIGADE_EMPTY(in)) {
-    e = APR_BRIGADE_FIRST(in);
-    apr_bucket_delete(e);
+    while (*prev != j) {
+      last = *prev;
+      prev = &(*prev)->next;
+    }
+    *prev = j->next;
+    if (o->tail == j) {
+      o->tail = last;
+    }
+    o->queued--;
+    free(j->path);
+    j->path = NULL;
+    j->next = o->free;
+    o->free = j;
   }
-  r->eos_sent = 0;
+  apr_thread_mutex_unlock(o->mutex);
+  return ctx->guardBusy = APR_TIMEUP;
+}
 
-  /* as we dropped all the content this field is not valid anymore! */
-  apr_table_unset(r->headers_out, "Content-Length");
-  apr_table_unset(r->err_headers_out, "Content-Length");
-  apr_table_unset(r->headers_out, "Content-Encoding");
-  apr_table_unset(r->err_headers_out, "Content-Encoding");
+/* a job xsendfile_fsguard_run() succeeded with, its results taken */
+static void xsendfile_fsguard_done(xsendfile_job_t *job) {
+  xsendfile_fsguard_t *o = xsendfile_fsguard;
 
-  /* Decode header
-     lighttpd does the same for X-Sendfile2, so we're compatible here
-     */
-  if (conf->unescape != XSENDFILE_DISABLED) {
-    rv = ap_unescape_url(file);
-    if (rv != OK) {
-      /* Unescaping failed, probably due to bad encoding.
-         Note that NOT_FOUND refers to escape sequences containing slashes,
-         what we do not allow (use real slashes only)
-         */
-      ap_log_rerror(
-        APLOG_MARK,
-        APLOG_ERR,
-        rv,
-        r,
-        "xsendfile: bad file name encoding"
-        );
-      ap_remove_output_filter(f);
-      ap_die(HTTP_INTERNAL_SERVER_ERROR, r);
-      return HTTP_INTERNAL_SERVER_ERROR;
+  apr_thread_mutex_lock(o->mutex);
+  free(job->path);
+  job->path = NULL;
+  job->next = o->free;
+  o->free = job;
+  apr_thread_mutex_unlock(o->mutex);
+}
+#endif
+
+/* xsendfile_stat(), on the XSendFileFsGuard threads if the root's profile says so */
+static int xsendfile_fsguard_stat(xsendfile_ctx_t *ctx, const char *path, struct stat *st) {
+#if APR_HAS_THREADS
+  xsendfile_job_t *job;
+  int err;
+
+  if (ctx->profile->fsGuard && xsendfile_fsguard && xsendfile_fsguard->workers) {
+    if (ctx->guardBusy || xsendfile_fsguard_run(ctx, path, 0, &job) != APR_SUCCESS) {
+      return -1;
+    }
+    *st = job->st;
+    err = job->err;
+    xsendfile_fsguard_done(job);
+    if (err) {
+      errno = err;
+      return -1;
     }
+    return 0;
   }
+#endif
+  return xsendfile_stat(path, st);
+}
 
-  /* lookup/verification of the given path */
-  rv = ap_xsendfile_get_filepath(
-    r,
-    conf,
-    file,
-    shouldDeleteFile,
-    &translated
-    );
-  if (rv != OK) {
-    ap_log_rerror(
-      APLOG_MARK,
-      APLOG_ERR,
-      rv,
-      r,
-      "xsendfile: unable to find file: %s",
-      file
-      );
-    ap_remove_output_filter(f);
-    ap_die(HTTP_NOT_FOUND, r);
-    return HTTP_NOT_FOUND;
-  }
+#if APR_HAS_THREADS
+/* closes a descriptor opened by a helper thread, unless closed already */
+static apr_status_t xsendfile_fsguard_fd_cleanup(void *data) {
+  apr_file_t *fd = data;
+  apr_os_file_t osfd;
 
-  /*
-    try open the file
-  */
-  if ((rv = apr_file_open(
-    &fd,
-    translated,
-    APR_READ | APR_BINARY
-    | (shouldDeleteFile ? APR_DELONCLOSE : 0)  /* if this is a temporary file, delete on close */
-#if APR_HAS_SENDFILE
-    | (coreconf->enable_sendfile != ENABLE_SENDFILE_OFF ? APR_SENDFILE_ENABLED : 0)
+  if (apr_os_file_get(&osfd, fd) == APR_SUCCESS && osfd >= 0) {
+    return apr_file_close(fd);
+  }
+  return APR_SUCCESS;
+}
 #endif
-    ,
-    0,
-    r->pool
-  )) != APR_SUCCESS) {
+
+/*
+  apr_file_open(), likewise; not for X-Sendfile-Temporary files, whose
+  deletion on close needs APR to have opened them
+*/
+static apr_status_t xsendfile_fsguard_open(request_rec *r, xsendfile_ctx_t *ctx,
+    apr_file_t **fd, const char *path, apr_int32_t flags) {
+#if APR_HAS_THREADS
+  xsendfile_job_t *job;
+  apr_os_file_t osfd;
+  apr_status_t rv;
+
+  if (ctx->profile->fsGuard && xsendfile_fsguard && xsendfile_fsguard->workers
+    && !(flags & APR_DELONCLOSE)) {
+    if (ctx->guardBusy) {
+      return ctx->guardBusy;
+    }
+    if ((rv = xsendfile_fsguard_run(ctx, path, 1, &job)) != APR_SUCCESS) {
+      return rv;
+    }
+    rv = job->err;
+    osfd = job->fd;
+    xsendfile_fsguard_done(job);
+    if (rv != APR_SUCCESS) {
+      return rv;
+    }
+    /* apr_os_file_put() doesn't register a cleanup, so register one */
+    apr_os_file_put(fd, &osfd, flags, r->pool);
+    apr_pool_cleanup_register(r->pool, *fd, xsendfile_fsguard_fd_cleanup,
+      apr_pool_cleanup_null);
+    return APR_SUCCESS;
+  }
+#endif
+  return apr_file_open(fd, path, flags, 0, r->pool);
+}
+
+/* what a variant gets stamped with: "<device> <inode> <size> <mtime in ns>" of its original */
+static const char *xsendfile_source_stamp(apr_pool_t *p, const struct stat *st) {
+  return apr_psprintf(p, "%" APR_UINT64_T_FMT " %" APR_UINT64_T_FMT " %" APR_INT64_T_FMT " %" APR_INT64_T_FMT,
+    (apr_uint64_t)st->st_dev, (apr_uint64_t)st->st_ino, (apr_int64_t)st->st_size, xsendfile_mtime_ns(st));
+}
+
+/**
+ * caches the compressed response for path @ compressed_path, stamped with its source
+ * @return 1 if compressed successfully, 0 otherwise
+ */
+static int ap_xsendfile_deflate(request_rec *r, const char *path, const char *compressed_path, int mode,
+    const char *stamp) {
+#ifdef MOD_XSENDFILE_AUTO_GZIP
+  const char *tmp_compress_path;
+
+#ifndef HACKY_GZIP
+  // zlib scratch variables
+  int compression = -1;
+
+  // cache compressed version of file into gzip format using zlib
+  int ret, flush;
+  unsigned have;
+  zlib_context_t ctx;
+
+  if (compression == -1) {
+    compression = MOD_XSENDFILE_DEFLATE_DEFAULT_COMPRESSION_LEVEL;
+  }
+
+  /* allocate deflate state */
+  ctx.strm.zalloc = Z_NULL;
+  ctx.strm.zfree = Z_NULL;
+  ctx.strm.opaque = Z_NULL;
+  ret = deflateInit2(&strm, compression, Z_DEFLATED, MOD_XSENDFILE_ZLIB_WINDOWSIZE, MOD_XSENDFILE_ZLIB_CFACTOR, Z_DEFAULT_STRATEGY);
+
+  if (ret != Z_OK) {
+    return 0;
+  }
+
+  do {
+    ctx.strm.avail_in = ;
+  } while (flush != Z_FINISH);
+
+  return 1;
+#else /* HACKY_GZIP */
+  const char *compress_cmd;
+  pid_t child;
+  pid_t wait_child;
+  int wait_status;
+  int outf;
+
+  tmp_compress_path = apr_pstrcat(r->pool, compressed_path, ".tmp", NULL);
+
+  outf = creat(tmp_compress_path, mode);
+  if (outf == -1) {
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, errno, r, "xsendfile: cannot create %s", tmp_compress_path);
+    return 0;
+  }
+
+  child = fork();
+  if (child == -1) {
+    close(outf);
+    unlink(tmp_compress_path);
+    return 0;
+  }
+
+  if (child == 0) {
+    // child - exec the gzip command
+    char *const argv[] = { "/bin/gzip", "--stdout", "-9", (char * const)path, NULL };
+
+    if (-1 == dup2(outf, STDOUT_FILENO)) {
+      _exit(1);
+    }
+
+    execv("/bin/gzip", argv);
+    // some error occured
+    _exit(1);
+  }
+
+  close(outf);
+
+  /* from here on, a half-written variant must not be left behind */
+  while (-1 == (wait_child = waitpid(child, &wait_status, 0)) && errno == EINTR) {
+  }
+  if (-1 == wait_child) {
+    unlink(tmp_compress_path);
+    return 0;
+  }
+
+  if (!WIFEXITED(wait_status)) {
+    unlink(tmp_compress_path);
+    return 0;
+  } else {
+    int exit_status = WEXITSTATUS(wait_status);
+    // WTF: why does gzip exit with 1 when no error occured???
+    if (exit_status != 0 && exit_status != 1) {
+      unlink(tmp_compress_path);
+      return 0;
+    }
+  }
+
+  /* on the temporary file, so the variant never shows without it */
+  xsendfile_xattr_set(tmp_compress_path, XSENDFILE_SOURCE_XATTR, stamp);
+
+  if (0 != rename(tmp_compress_path, compressed_path)) {
+    unlink(tmp_compress_path);
+    return 0;
+  }
+
+  return 1;
+#endif /* HACKY_GZIP */
+
+#endif /* MOD_XSENDFILE_AUTO_GZIP */
+}
+
+static int ap_xsendfile_accepts_gzip(request_rec *r) {
+  char *token;
+  const char *accepts;
+
+  /* Accept-Encoding logic copied from mod_deflate.c: */
+  /* Even if we don't accept this request based on it not having
+   * the Accept-Encoding, we need to note that we were looking
+   * for this header and downstream proxies should be aware of that.
+   */
+  apr_table_mergen(r->headers_out, "Vary", "Accept-Encoding");
+
+  accepts = apr_table_get(r->headers_in, "Accept-Encoding");
+  if (accepts == NULL) {
+    /* just pass-through the sendfile untouched */
+    return 0;
+  }
+ 
+  token = ap_get_token(r->pool, &accepts, 0);
+  while (token && token[0] && strcasecmp(token, "gzip")) {
+    /* skip parameters, XXX: ;q=foo evaluation? */
+    while (*accepts == ';') { 
+      ++accepts;
+      token = ap_get_token(r->pool, &accepts, 1);
+    }
+ 
+    /* retrieve next token */
+    if (*accepts == ',') {
+      ++accepts;
+    }
+    token = (*accepts) ? ap_get_token(r->pool, &accepts, 0) : NULL;
+  }
+  
+  /* No acceptable token found. */
+  if (token == NULL || token[0] == '\0') {
+    return 0;
+  }
+
+  /* found gzip token */
+  return 1;
+}
+
+/*
+  whether we may create a .gz variant of path, going by the profile's
+  CompressTypes or the built-in list
+*/
+static int ap_xsendfile_is_compressible(const xsendfile_profile_t *profile, const char *path) {
+  static const char *const default_extensions[] = {
+    ".css",
+    ".js",
+    ".html",
+    ".json",
+  };
+  const char *const *compressible_extensions = default_extensions;
+  size_t n_compressible_extensions = sizeof(default_extensions) / sizeof(default_extensions[0]);
+  size_t pathlen = strlen(path);
+  size_t i;
+
+  if (profile->compressTypes) {
+    compressible_extensions = (const char *const *)profile->compressTypes->elts;
+    n_compressible_extensions = (size_t)profile->compressTypes->nelts;
+  }
+
+  for (i = 0; i < n_compressible_extensions; i++) {
+    const char *compressible_extension = compressible_extensions[i];
+    size_t extension_length = strlen(compressible_extension);
+    if (pathlen < extension_length) {
+      continue;
+    }
+
+    if (strcmp(path + pathlen - extension_length, compressible_extension) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* the cached variant decision for path, if any and still fresh */
+static int ap_xsendfile_meta_lookup(request_rec *r, const char *path, xsendfile_variant_t *variant) {
+  const xsendfile_meta_t *meta;
+  int found = 0;
+
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(xsendfile_metacache->mutex);
+#endif
+  meta = (const xsendfile_meta_t*)apr_hash_get(xsendfile_metacache->entries, path, APR_HASH_KEY_STRING);
+  if (meta && meta->hasVariant && (!meta->expires || meta->expires > r->request_time)) {
+    *variant = meta->gzip;
+    found = 1;
+  }
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(xsendfile_metacache->mutex);
+#endif
+  return found;
+}
+
+/* path's entry, a blank one if there was none; under the mutex */
+static xsendfile_meta_t *xsendfile_meta_entry(const char *path) {
+  xsendfile_meta_t *meta;
+
+  meta = (xsendfile_meta_t*)apr_hash_get(xsendfile_metacache->entries, path, APR_HASH_KEY_STRING);
+  if (!meta) {
+    if (apr_hash_count(xsendfile_metacache->entries) >= XSENDFILE_METACACHE_MAX) {
+      apr_pool_clear(xsendfile_metacache->pool);
+      xsendfile_metacache->entries = apr_hash_make(xsendfile_metacache->pool);
+    }
+    meta = (xsendfile_meta_t*)apr_pcalloc(xsendfile_metacache->pool, sizeof(xsendfile_meta_t));
+    apr_hash_set(xsendfile_metacache->entries, apr_pstrdup(xsendfile_metacache->pool, path),
+      APR_HASH_KEY_STRING, meta);
+  }
+  return meta;
+}
+
+static void ap_xsendfile_meta_store(request_rec *r, const xsendfile_ctx_t *ctx,
+    const char *path, xsendfile_variant_t variant) {
+  xsendfile_meta_t *meta;
+
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(xsendfile_metacache->mutex);
+#endif
+  meta = xsendfile_meta_entry(path);
+  meta->expires = ctx->profile->immortal ? 0 : r->request_time + ctx->profile->metadataTTL;
+  meta->hasVariant = 1;
+  meta->gzip = variant;
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(xsendfile_metacache->mutex);
+#endif
+}
+
+/* 1 if path is known, and still fresh, to have no <file>.preload */
+static int ap_xsendfile_meta_no_sidecar(request_rec *r, const char *path) {
+  const xsendfile_meta_t *meta;
+  int none = 0;
+
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(xsendfile_metacache->mutex);
+#endif
+  meta = (const xsendfile_meta_t*)apr_hash_get(xsendfile_metacache->entries, path, APR_HASH_KEY_STRING);
+  if (meta && meta->noSidecar && (!meta->sidecarExpires || meta->sidecarExpires > r->request_time)) {
+    none = 1;
+  }
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(xsendfile_metacache->mutex);
+#endif
+  return none;
+}
+
+static void ap_xsendfile_meta_store_no_sidecar(request_rec *r, const xsendfile_ctx_t *ctx,
+    const char *path) {
+  xsendfile_meta_t *meta;
+
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(xsendfile_metacache->mutex);
+#endif
+  meta = xsendfile_meta_entry(path);
+  meta->sidecarExpires = ctx->profile->immortal ? 0 : r->request_time + ctx->profile->metadataTTL;
+  meta->noSidecar = 1;
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(xsendfile_metacache->mutex);
+#endif
+}
+
+/*
+  Whether the variant still is the original's. Variants compressed here
+  carry the original's identity (XSENDFILE_SOURCE_XATTR), which, unlike
+  comparing mtimes, holds up to deploys keeping older mtimes and to
+  rewrites within the same second. Unstamped ones (no xattrs, or made
+  elsewhere) mustn't be older than the original.
+*/
+static int xsendfile_variant_fresh(request_rec *r, xsendfile_ctx_t *ctx, const char *variant,
+    const struct stat *variantStat, const struct stat *originalStat) {
+  const char *stamp;
+
+  XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_XATTR);
+  if ((stamp = xsendfile_xattr_get(r->pool, variant, XSENDFILE_SOURCE_XATTR)) != NULL) {
+    return strcmp(stamp, xsendfile_source_stamp(r->pool, originalStat)) == 0;
+  }
+  return xsendfile_mtime_ns(variantStat) >= xsendfile_mtime_ns(originalStat);
+}
+
+static void ap_xsendfile_get_compressed_filepath(request_rec *r, xsendfile_ctx_t *ctx, /* out */ char **adjusted_path) {
+  const char *path;
+  char *deflate_path;
+  struct stat original_stat;
+  struct stat compressed_stat;
+  int have_compressed;
+
+  path = *adjusted_path;
+
+  if (!ap_xsendfile_accepts_gzip(r)) {
+    ctx->acceptEncoding = apr_table_get(r->headers_in, "Accept-Encoding") ? XSENDFILE_AE_OTHER : XSENDFILE_AE_NONE;
+    return;
+  }
+  ctx->acceptEncoding = XSENDFILE_AE_GZIP;
+
+  deflate_path = apr_pstrcat(r->pool, path, ".gz", NULL);
+
+  if (xsendfile_metacache && !ctx->temporary
+    && (ctx->profile->metadataTTL || ctx->profile->immortal)) {
+    xsendfile_variant_t cached;
+
+    if (ap_xsendfile_meta_lookup(r, path, &cached)) {
+      ctx->metadata = 1;
+      if (cached == XSENDFILE_VARIANT_GZIP) {
+        /* Content-Length follows from the fstat() of the opened file */
+        *adjusted_path = deflate_path;
+        ctx->variant = XSENDFILE_VARIANT_GZIP;
+        apr_table_set(r->headers_out, "Content-Encoding", "gzip");
+      }
+      return;
+    }
+    ctx->metadata = -1;
+  }
+
+  /*
+    look for the variant first: when there is none and we wouldn't create
+    one either, there is no need to stat the original
+  */
+  XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_STAT);
+  have_compressed = 0 == xsendfile_fsguard_stat(ctx, deflate_path, &compressed_stat);
+  if (ctx->guardBusy) {
+    /* we don't know, and the open() won't be tried either */
+    return;
+  }
+  if (!have_compressed
+    && (ctx->profile->compress == XSENDFILE_COMPRESS_STATIC || !ap_xsendfile_is_compressible(ctx->profile, path))) {
+#ifdef _DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: path %s doesn't have a compressible extension", path);
+#endif
+    if (ctx->metadata < 0) {
+      ap_xsendfile_meta_store(r, ctx, path, XSENDFILE_VARIANT_IDENTITY);
+    }
+    return;
+  }
+
+  /* an immutable root's variant can't be older than its original */
+  if (have_compressed && ctx->profile->immutable) {
+    goto serve_compressed;
+  }
+
+  XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_STAT);
+  if (0 != xsendfile_fsguard_stat(ctx, path, &original_stat)) {
+#ifdef _DEBUG
+    char errmsg[128];
+    apr_strerror(apr_get_os_error(), errmsg, sizeof(errmsg) - 1);
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: can't stat %s: %s", path, errmsg);
+#endif
+    return;
+  }
+
+  if (!have_compressed || !xsendfile_variant_fresh(r, ctx, deflate_path, &compressed_stat, &original_stat)) {
+    /* a stale variant isn't served, but not recreated either */
+    if (ctx->profile->compress == XSENDFILE_COMPRESS_STATIC) {
+      if (ctx->metadata < 0) {
+        ap_xsendfile_meta_store(r, ctx, path, XSENDFILE_VARIANT_IDENTITY);
+      }
+      return;
+    }
+#ifndef MOD_XSENDFILE_AUTO_GZIP
+    // no zlib support so can't compress the file
+#ifdef _DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: zlib not available - can't compress %s", path);
+#endif
+    return;
+#endif
+    int compressed;
+    apr_uint64_t compress_start;
+    int mode = original_stat.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO);
+
+    // compressed file doesn't exist or is older than the source file
+    // check to make sure that it's compressible
+    if (have_compressed && !ap_xsendfile_is_compressible(ctx->profile, path)) {
+#ifdef _DEBUG
+      ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: path %s doesn't have a compressible extension", path);
+#endif
+      if (ctx->metadata < 0) {
+        ap_xsendfile_meta_store(r, ctx, path, XSENDFILE_VARIANT_IDENTITY);
+      }
+      return;
+    }
+
+    // do compression since file to serve is allowed to be compressible
+    /* always timed, the statistics want to know; it's a fork anyway */
+    XSENDFILE_PROBE1(compress_start, path);
+    compress_start = xsendfile_clock();
+    XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_SPAWN);
+    compressed = ap_xsendfile_deflate(r, path, deflate_path, mode, xsendfile_source_stamp(r->pool, &original_stat));
+    ctx->phases[XSENDFILE_PHASE_COMPRESS] += xsendfile_clock() - compress_start;
+    XSENDFILE_PROBE3(compress_end, deflate_path, compressed, xsendfile_clock() - compress_start);
+    ctx->compressions++;
+    if (!compressed) {
+      ctx->compressionFailures++;
+#ifdef _DEBUG
+      ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: failed to compress %s to %s", path, deflate_path);
+#endif
+      return;
+    }
+
+    XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_STAT);
+    if (0 != xsendfile_fsguard_stat(ctx, deflate_path, &compressed_stat)) {
+#ifdef _DEBUG
+      ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: failed to stat %s after compression succeeded?", deflate_path);
+#endif
+      return;
+    }
+  }
+
+serve_compressed:
+  {
+    if (ctx->metadata < 0) {
+      ap_xsendfile_meta_store(r, ctx, path, XSENDFILE_VARIANT_GZIP);
+    }
+    *adjusted_path = deflate_path;
+    ctx->variant = XSENDFILE_VARIANT_GZIP;
+    apr_table_set(r->headers_out, "Content-Length", apr_psprintf(r->pool, "%lu", (unsigned long)compressed_stat.st_size));
+    apr_table_set(r->headers_out, "Content-Encoding", "gzip");
+#ifdef _DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: serving up encoded file %s", deflate_path);
+#endif
+  }
+
+  return;
+}
+
+static void ap_xsendfile_choose_variant(request_rec *r, xsendfile_ctx_t *ctx, char **path) {
+  apr_uint64_t start;
+
+  start = xsendfile_clock();
+  if (ctx->profile->compress != XSENDFILE_COMPRESS_OFF) {
+    ap_xsendfile_get_compressed_filepath(r, ctx, path);
+  }
+  /* compression is accounted for separately */
+  xsendfile_phase_end(ctx, XSENDFILE_PHASE_VARIANT, start);
+  ctx->phases[XSENDFILE_PHASE_VARIANT] -= ctx->phases[XSENDFILE_PHASE_COMPRESS];
+  XSENDFILE_PROBE2(variant_chosen, *path, (int)ctx->variant);
+}
+
+/*
+  Whether an absolute file name in canonical form can be below root at
+  all. Only ever rules out roots apr_filepath_merge() would turn down as
+  well; relative names could be anywhere.
+*/
+static APR_INLINE int xsendfile_could_match(const xsendfile_path_t *root,
+    const char *file, int canonical) {
+  return !canonical || !root->prefixLen
+    || (strncmp(file, root->path, root->prefixLen) == 0
+      && (file[root->prefixLen] == '/' || file[root->prefixLen] == '\0'));
+}
+
+static int xsendfile_order_cmp(const void *a, const void *b) {
+  apr_uint64_t x = *(const apr_uint64_t*)a, y = *(const apr_uint64_t*)b;
+  return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+  XSendFileLearnedOrder: the roots by recent success, most successful
+  first, config order among equals
+*/
+static int *ap_xsendfile_root_order(request_rec *r, const xsendfile_path_t *paths, int n) {
+  apr_uint64_t *keys = (apr_uint64_t*)apr_palloc(r->pool, n * sizeof(apr_uint64_t));
+  int *order = (int*)apr_palloc(r->pool, n * sizeof(int));
+  int i;
+
+  for (i = 0; i < n; ++i) {
+    apr_uint32_t hits = apr_atomic_read32(&xsendfile_stats->rootHits[paths[i].id]);
+    keys[i] = ((apr_uint64_t)hits << 32) | (apr_uint32_t)(0xFFFFFFFF - i);
+  }
+  qsort(keys, n, sizeof(apr_uint64_t), xsendfile_order_cmp);
+  for (i = 0; i < n; ++i) {
+    order[i] = (int)(0xFFFFFFFF - (apr_uint32_t)keys[i]);
+  }
+  return order;
+}
+
+static void ap_xsendfile_root_hit(int id) {
+  int i;
+
+  if (apr_atomic_inc32(&xsendfile_stats->rootHits[id]) + 1 < XSENDFILE_ROOTHITS_LIMIT) {
+    return;
+  }
+  /* racy, but so is the notion of recent */
+  for (i = 0; i < XSENDFILE_STATS_ROOTS; ++i) {
+    apr_atomic_set32(&xsendfile_stats->rootHits[i], apr_atomic_read32(&xsendfile_stats->rootHits[i]) / 2);
+  }
+}
+
+/* the white-listed paths, the script directory (if any) first */
+static apr_array_header_t *xsendfile_search_paths(request_rec *r,
+    const xsendfile_conf_t *conf, const char *scriptDir) {
+  apr_array_header_t *patharr;
+  xsendfile_path_t *newpath;
+
+  if (!scriptDir) {
+    return conf->paths;
+  }
+  patharr = apr_array_make(
+    r->pool,
+    conf->paths->nelts + 1,
+    sizeof(xsendfile_path_t)
+    );
+  newpath = apr_array_push(patharr);
+  newpath->path = scriptDir;
+  newpath->allowFileDelete = 0;
+  newpath->id = XSENDFILE_ROOT_SCRIPTDIR;
+  newpath->limitRate = 0;
+  newpath->profile = &xsendfile_default_profile;
+  newpath->prefixLen = 0;
+  apr_array_cat(patharr, conf->paths);
+  return patharr;
+}
+
+/*
+  the root file is below, the first in config order to take it: its
+  index, with the merged path in *path, or -1 and why not in *rv. With
+  XSendFileLearnedOrder, the roots are tried by recent success instead.
+*/
+static int ap_xsendfile_find_root(request_rec *r, const xsendfile_conf_t *conf,
+    const apr_array_header_t *patharr, const char *file, int shouldDeleteFile,
+    apr_status_t *rv, /* out */ char **path) {
+  const xsendfile_path_t *paths;
+  int *order = NULL;
+  apr_byte_t *tried = NULL;
+  int canonical;
+  int i, k, found = -1;
+
+  *rv = APR_EBADPATH;
+  paths = (const xsendfile_path_t*)patharr->elts;
+  canonical = file[0] == '/' && !strstr(file, "/.") && !strstr(file, "//");
+  if (conf->learnedOrder == XSENDFILE_ENABLED && xsendfile_stats && patharr->nelts > 1) {
+    order = ap_xsendfile_root_order(r, paths, patharr->nelts);
+    tried = (apr_byte_t*)apr_pcalloc(r->pool, patharr->nelts);
+  }
+  for (k = 0; k < patharr->nelts; ++k) {
+    i = order ? order[k] : k;
+    if (shouldDeleteFile && !paths[i].allowFileDelete){
+      continue;
+    }
+    if (!xsendfile_could_match(&paths[i], file, canonical)) {
+      continue;
+    }
+
+    if (tried) {
+      tried[i] = 1;
+    }
+
+    if ((*rv = apr_filepath_merge(
+      path,
+      paths[i].path,
+      file,
+      APR_FILEPATH_TRUENAME | APR_FILEPATH_NOTABOVEROOT,
+      r->pool
+    )) == OK) {
+#ifdef _DEBUG
+      ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: finished merging at %d/%d elements", i, patharr->nelts);
+#endif
+      found = i;
+      break;
+    } else {
+#ifdef _DEBUG
+      ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: merged %d/%d elements (component = %s).  path is now %s", i, patharr->nelts, paths[i].path, *path);
+#endif
+    }
+  }
+
+  /*
+    out of order, the first root in config order that takes the file
+    still has to win. Only roots before it that could match at all are
+    tried: none for an absolute file name unless roots are nested, every
+    one of them for a relative one.
+  */
+  if (order && found > 0) {
+    char *earlier;
+
+    for (i = 0; i < found; ++i) {
+      if (tried[i]
+        || (shouldDeleteFile && !paths[i].allowFileDelete)
+        || !xsendfile_could_match(&paths[i], file, canonical)) {
+        continue;
+      }
+      if (apr_filepath_merge(
+        &earlier,
+        paths[i].path,
+        file,
+        APR_FILEPATH_TRUENAME | APR_FILEPATH_NOTABOVEROOT,
+        r->pool
+      ) == OK) {
+        *path = earlier;
+        found = i;
+        break;
+      }
+    }
+  }
+  if (order && found >= 0) {
+    ap_xsendfile_root_hit(paths[found].id);
+  }
+
+  return found;
+}
+
+/*
+  little helper function to build the file path if available
+*/
+static apr_status_t ap_xsendfile_get_filepath(request_rec *r,
+    xsendfile_conf_t *conf, xsendfile_ctx_t *ctx, const char *file,
+    int shouldDeleteFile, /* out */ char **path) {
+
+  apr_status_t rv = APR_EBADPATH;
+  apr_uint64_t start;
+
+  apr_array_header_t *patharr;
+  const xsendfile_path_t *paths;
+  int found;
+
+  patharr = conf->paths;
+  if (!shouldDeleteFile) {
+    const char *root;
+
+    start = xsendfile_clock();
+    root = ap_xsendfile_get_orginal_path(r, ctx);
+    xsendfile_phase_end(ctx, XSENDFILE_PHASE_ORIGIN, start);
+    if (root) {
+#ifdef _DEBUG
+      ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: path is %s", root);
+#endif
+      ctx->scriptDir = root;
+      patharr = xsendfile_search_paths(r, conf, root);
+    }
+  }
+
+  if (patharr->nelts == 0) {
+    return APR_EBADPATH;
+  }
+
+  start = xsendfile_clock();
+  paths = (const xsendfile_path_t*)patharr->elts;
+  found = ap_xsendfile_find_root(r, conf, patharr, file, shouldDeleteFile, &rv, path);
+  if (found >= 0) {
+    rv = OK;
+    ctx->root = found;
+    ctx->rootId = paths[found].id;
+    ctx->rootPath = paths[found].path;
+    ctx->rootLimitRate = paths[found].limitRate;
+    ctx->profile = paths[found].profile;
+  }
+  xsendfile_phase_end(ctx, XSENDFILE_PHASE_RESOLVE, start);
+  XSENDFILE_PROBE3(root_resolved, rv == OK ? *path : file, ctx->root, rv);
+  if (rv != OK) {
+    *path = NULL;
+  } else {
+    ap_xsendfile_choose_variant(r, ctx, path);
+  }
+  return rv;
+}
+
+/*
+  X-Accel-Redirect: map the URI onto a directory by the longest matching
+  XSendFileMap prefix, instead of looking it up through a sub-request
+*/
+static apr_status_t ap_xsendfile_get_mapped_filepath(request_rec *r,
+    xsendfile_conf_t *conf, xsendfile_ctx_t *ctx, const char *uri,
+    /* out */ char **path) {
+
+  apr_status_t rv = APR_EBADPATH;
+  apr_uint64_t start;
+
+  const xsendfile_map_t *maps = (const xsendfile_map_t*)conf->maps->elts;
+  int i;
+
+  start = xsendfile_clock();
+  for (i = 0; i < conf->maps->nelts; ++i) {
+    const char *rest;
+
+    if (strncmp(uri, maps[i].prefix, maps[i].prefixLen) != 0) {
+      continue;
+    }
+    rest = uri + maps[i].prefixLen;
+    while (*rest == '/') {
+      ++rest;
+    }
+    if ((rv = apr_filepath_merge(
+      path,
+      maps[i].path,
+      rest,
+      APR_FILEPATH_TRUENAME | APR_FILEPATH_NOTABOVEROOT,
+      r->pool
+    )) == OK) {
+      ctx->root = i;
+      ctx->rootId = maps[i].id;
+      ctx->rootPath = maps[i].path;
+      ctx->rootLimitRate = maps[i].limitRate;
+      ctx->profile = maps[i].profile;
+    }
+    /* like nginx, only the longest prefix counts */
+    break;
+  }
+  xsendfile_phase_end(ctx, XSENDFILE_PHASE_RESOLVE, start);
+  XSENDFILE_PROBE3(root_resolved, rv == OK ? *path : uri, ctx->root, rv);
+  if (rv != OK) {
+    *path = NULL;
+  } else {
+    ap_xsendfile_choose_variant(r, ctx, path);
+  }
+  return rv;
+}
+
+/*
+  Find the X-Sendfile (or X-Sendfile-Temporary, or with XSendFileMaps
+  configured X-Accel-Redirect) header, wherever the handler put it, and
+  strip all of them from the response.
+*/
+static char *ap_xsendfile_scan_headers(request_rec *r, const xsendfile_conf_t *conf,
+    /* out */ int *shouldDeleteFile, /* out */ int *accel) {
+  char *file;
+
+  file = (char*)apr_table_get(r->headers_out, AP_XSENDFILE_HEADER);
+
+  /* cgi/fastcgi will put the stuff into err_headers_out */
+  if (!file || !*file) {
+    file = (char*)apr_table_get(r->err_headers_out, AP_XSENDFILE_HEADER);
+  }
+
+  /*
+    so...there is no X-SendFile header, check if there is an X-Sendfile-Temporary header
+  */
+  if (!file || !*file) {
+    *shouldDeleteFile = 1;
+    file = (char*)apr_table_get(r->headers_out, AP_XSENDFILETEMPORARY_HEADER);
+  }
+  /*
+    Maybe X-Sendfile-Temporary is set via cgi in error_headers_out?
+  */
+  if (!file || !*file) {
+    file = (char*)apr_table_get(r->err_headers_out, AP_XSENDFILETEMPORARY_HEADER);
+  }
+
+  /* nginx style, for applications migrating from there */
+  if (conf->maps->nelts) {
+    if (!file || !*file) {
+      file = (char*)apr_table_get(r->headers_out, AP_XACCELREDIRECT_HEADER);
+      if (!file || !*file) {
+        file = (char*)apr_table_get(r->err_headers_out, AP_XACCELREDIRECT_HEADER);
+      }
+      if (file && *file) {
+        *shouldDeleteFile = 0;
+        *accel = 1;
+      }
+    }
+    apr_table_unset(r->headers_out, AP_XACCELREDIRECT_HEADER);
+    apr_table_unset(r->err_headers_out, AP_XACCELREDIRECT_HEADER);
+  }
+
+  /* Remove any X-Sendfile headers */
+  apr_table_unset(r->headers_out, AP_XSENDFILE_HEADER);
+  apr_table_unset(r->err_headers_out, AP_XSENDFILE_HEADER);
+  apr_table_unset(r->headers_out, AP_XSENDFILETEMPORARY_HEADER);
+  apr_table_unset(r->err_headers_out, AP_XSENDFILETEMPORARY_HEADER);
+
+  return file;
+}
+
+/* get and remove a response header, wherever the handler put it */
+static const char *xsendfile_take_header(request_rec *r, const char *name) {
+  const char *value = apr_table_get(r->headers_out, name);
+
+  if (!value) {
+    value = apr_table_get(r->err_headers_out, name);
+  }
+  if (value) {
+    /* unset doesn't free, the value stays valid */
+    apr_table_unset(r->headers_out, name);
+    apr_table_unset(r->err_headers_out, name);
+  }
+  return value;
+}
+
+/*
+  the X-Accel-* companions of X-Accel-Redirect, as far as they apply:
+  - X-Accel-Limit-Rate (bytes per second), like X-Sendfile-Limit-Rate
+  - X-Accel-Expires (seconds, or @ and a unix time) is for nginx's own
+    cache; the equivalent here is s-maxage, which mod_cache and other
+    shared caches go by; 0 keeps them from caching at all
+  - X-Accel-Buffering: no gets the body flushed right away
+  - X-Accel-Charset amends the Content-Type
+*/
+static void ap_xsendfile_accel_headers(request_rec *r, xsendfile_ctx_t *ctx) {
+  const char *value;
+
+  if ((value = xsendfile_take_header(r, "X-Accel-Limit-Rate")) != NULL
+    && !xsendfile_parse_rate(value, &ctx->limitRate)) {
+    ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "xsendfile: ignoring invalid X-Accel-Limit-Rate %s", value);
+  }
+
+  if ((value = xsendfile_take_header(r, "X-Accel-Expires")) != NULL
+    && strcasecmp(value, "off") != 0) {
+    apr_int64_t expires;
+
+    if (*value == '@') {
+      expires = apr_atoi64(value + 1) - apr_time_sec(r->request_time);
+    }
+    else {
+      expires = apr_atoi64(value);
+    }
+    if (expires > 0) {
+      apr_table_mergen(r->headers_out, "Cache-Control",
+        apr_psprintf(r->pool, "s-maxage=%" APR_INT64_T_FMT, expires));
+    }
+    else {
+      apr_table_mergen(r->headers_out, "Cache-Control", "private");
+    }
+  }
+
+  if ((value = xsendfile_take_header(r, "X-Accel-Buffering")) != NULL) {
+    ctx->noBuffering = strcasecmp(value, "no") == 0;
+  }
+
+  if ((value = xsendfile_take_header(r, "X-Accel-Charset")) != NULL
+    && r->content_type && !ap_strcasestr(r->content_type, "charset=")) {
+    ap_set_content_type(r, apr_pstrcat(r->pool, r->content_type, "; charset=", value, NULL));
+  }
+}
+
+#ifdef SO_MAX_PACING_RATE
+static apr_status_t xsendfile_unpace(void *data) {
+  int sd = (int)(apr_intptr_t)data;
+  unsigned int unlimited = ~0U;
+
+  /* for whatever comes next on this connection */
+  setsockopt(sd, SOL_SOCKET, SO_MAX_PACING_RATE, &unlimited, sizeof(unlimited));
+  return APR_SUCCESS;
+}
+#endif
+
+/*
+  Limit the bandwidth of the response. Where the kernel can pace the
+  socket (SO_MAX_PACING_RATE; TCP paces by itself since Linux 4.13, the
+  fq qdisc does it more precisely), that is by far the cheapest: sendfile
+  stays zero-copy, and the event MPM's write completion doesn't tie up a
+  worker while the socket is being drained. Not for HTTP/2 though, where
+  the connection is shared by the streams. Otherwise mod_ratelimit's
+  RATE_LIMIT filter does the pacing, going by the rate-limit variable
+  (KiB/s).
+*/
+static void ap_xsendfile_limit_rate(request_rec *r, xsendfile_ctx_t *ctx, apr_int64_t bytesPerSecond) {
+  apr_int64_t kib;
+
+#ifdef SO_MAX_PACING_RATE
+  if (r->proto_num < 2000 && !r->connection->aborted) {
+    apr_socket_t *sock = ap_get_conn_socket(r->connection);
+    apr_os_sock_t sd;
+    unsigned int rate = bytesPerSecond >= (apr_int64_t)~0U ? ~0U - 1 : (unsigned int)bytesPerSecond;
+
+    if (sock && apr_os_sock_get(&sd, sock) == APR_SUCCESS
+      && setsockopt(sd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) == 0) {
+      apr_pool_cleanup_register(r->pool, (void*)(apr_intptr_t)sd, xsendfile_unpace, apr_pool_cleanup_null);
+      ctx->paced = 1;
+      return;
+    }
+  }
+#endif
+
+  kib = bytesPerSecond / 1024;
+  apr_table_setn(r->subprocess_env, "rate-limit",
+    apr_psprintf(r->pool, "%" APR_INT64_T_FMT, kib > 0 ? kib : 1));
+  if (!ap_add_output_filter("RATE_LIMIT", NULL, r, r->connection)) {
+    ap_log_rerror(
+      APLOG_MARK,
+      APLOG_WARNING,
+      0,
+      r,
+      "xsendfile: cannot limit the rate, mod_ratelimit not loaded"
+      );
+    return;
+  }
+  ctx->paced = 2;
+}
+
+/* the device's entry, NULL if there's no room left for it */
+static xsendfile_disk_t *xsendfile_disk_find(apr_dev_t device) {
+  apr_uint64_t d = (apr_uint64_t)device;
+  apr_uint32_t key = (apr_uint32_t)(d ^ (d >> 32));
+  int i;
+
+  if (!key) {
+    key = 1;
+  }
+  for (i = 0; i < XSENDFILE_DISKS; ++i) {
+    xsendfile_disk_t *disk = &xsendfile_stats->disks[(key + i) % XSENDFILE_DISKS];
+    apr_uint32_t prev = apr_atomic_read32(&disk->device);
+
+    if (!prev) {
+      prev = apr_atomic_cas32(&disk->device, key, 0);
+    }
+    if (!prev || prev == key) {
+      return disk;
+    }
+  }
+  return NULL;
+}
+
+/* child's counts of the responses in flight, by disk */
+static APR_INLINE apr_uint32_t *xsendfile_disk_held(int child) {
+  return (apr_uint32_t*)((char*)xsendfile_stats + xsendfile_stats->heldOffset) + (apr_size_t)child * XSENDFILE_DISKS;
+}
+
+typedef struct xsendfile_disk_hold_t {
+  xsendfile_disk_t *disk;
+  volatile apr_uint32_t *held; /* NULL if the request has no child slot */
+} xsendfile_disk_hold_t;
+
+/*
+  the child's count goes last when acquiring and first when releasing: a
+  child dying in between leaves one too many active, never one too few
+*/
+static apr_status_t xsendfile_disk_release(void *data) {
+  xsendfile_disk_hold_t *hold = (xsendfile_disk_hold_t*)data;
+
+  if (hold->held) {
+    apr_atomic_dec32(hold->held);
+  }
+  apr_atomic_dec32(&hold->disk->active);
+  return APR_SUCCESS;
+}
+
+/*
+  XSendFileDiskLimit: cold large files being read off the same (spinning)
+  disk all at once have it seek back and forth, and all of them crawl.
+  0 if the device has got enough of those going already; otherwise the
+  response counts until the request pool goes, i.e. it has been written.
+*/
+static int ap_xsendfile_disk_acquire(request_rec *r, apr_dev_t device, int limit) {
+  ap_sb_handle_t *sbh = (ap_sb_handle_t*)r->connection->sbh;
+  xsendfile_disk_hold_t *hold;
+  xsendfile_disk_t *disk;
+
+  if (!xsendfile_stats || !(disk = xsendfile_disk_find(device))) {
+    return 1;
+  }
+  if (apr_atomic_inc32(&disk->active) >= (apr_uint32_t)limit) {
+    apr_atomic_dec32(&disk->active);
+    return 0;
+  }
+  hold = (xsendfile_disk_hold_t*)apr_palloc(r->pool, sizeof(xsendfile_disk_hold_t));
+  hold->disk = disk;
+  hold->held = NULL;
+  if (sbh && sbh->child_num >= 0 && sbh->child_num < xsendfile_stats->serverLimit) {
+    hold->held = xsendfile_disk_held(sbh->child_num) + (disk - xsendfile_stats->disks);
+    apr_atomic_inc32(hold->held);
+  }
+  apr_pool_cleanup_register(r->pool, hold, xsendfile_disk_release, apr_pool_cleanup_null);
+  return 1;
+}
+
+/*
+  parent: a child gone. Whatever it still held, it held when it crashed
+  or was killed; its responses are gone with it, so the devices get
+  those back. Children of an earlier generation counted in a segment of
+  their own, gone with the restart.
+*/
+static void xsendfile_child_status(server_rec *s, pid_t pid, ap_generation_t gen,
+    int slot, mpm_child_status status) {
+  apr_uint32_t *held;
+  int generation = 0, i;
+  apr_uint32_t lost = 0;
+
+  if (status != MPM_CHILD_EXITED || !xsendfile_stats
+    || slot < 0 || slot >= xsendfile_stats->serverLimit) {
+    return;
+  }
+  ap_mpm_query(AP_MPMQ_GENERATION, &generation);
+  if (gen != (ap_generation_t)generation) {
+    return;
+  }
+  held = xsendfile_disk_held(slot);
+  for (i = 0; i < XSENDFILE_DISKS; ++i) {
+    apr_uint32_t n = apr_atomic_read32(&held[i]), active;
+
+    if (!n) {
+      continue;
+    }
+    /* not below 0, should the child have died halfway through releasing */
+    do {
+      active = apr_atomic_read32(&xsendfile_stats->disks[i].active);
+    } while (apr_atomic_cas32(&xsendfile_stats->disks[i].active, active > n ? active - n : 0, active) != active);
+    apr_atomic_set32(&held[i], 0);
+    lost += n;
+  }
+  if (lost) {
+    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+      "xsendfile: child %" APR_PID_T_FMT " exited with %u XSendFileDiskLimit responses in flight, released",
+      pid, lost);
+  }
+}
+
+static int xsendfile_conn_is_tls(conn_rec *c) {
+#if AP_MODULE_MAGIC_AT_LEAST(20120211, 105)
+  return ap_ssl_conn_is_ssl(c);
+#else
+  return xsendfile_is_https && xsendfile_is_https(c);
+#endif
+}
+
+static apr_status_t xsendfile_uncork(void *data) {
+  /* pushes out whatever is pending, and restores TCP_NODELAY */
+  apr_socket_opt_set((apr_socket_t*)data, APR_TCP_NOPUSH, 0);
+  return APR_SUCCESS;
+}
+
+/*
+  The core writes the headers with writev() and a file with sendfile(),
+  and, TCP_NODELAY being on, those leave as separate segments. Corked
+  (TCP_CORK, TCP_NOPUSH on the BSDs) until the request pool goes, which
+  the EOR bucket has happen once the response was written, headers and
+  body of a small file share a segment.
+*/
+static void ap_xsendfile_cork(request_rec *r, xsendfile_ctx_t *ctx) {
+  apr_socket_t *sock;
+
+  /* no sendfile() with TLS, the core writes the record headers and file together anyway */
+  if (xsendfile_conn_is_tls(r->connection)) {
+    return;
+  }
+  sock = ap_get_conn_socket(r->connection);
+  if (sock && !r->connection->aborted
+    && apr_socket_opt_set(sock, APR_TCP_NOPUSH, 1) == APR_SUCCESS) {
+    apr_pool_cleanup_register(r->pool, sock, xsendfile_uncork, apr_pool_cleanup_null);
+    ctx->corked = 1;
+  }
+}
+
+/* what a preload is for, going by the extension; NULL if we can't tell */
+static const char *xsendfile_preload_as(const char *url, apr_size_t len) {
+  static const struct {
+    const char *ext;
+    const char *as;
+  } types[] = {
+    { ".css", "style" },
+    { ".js", "script" },
+    { ".mjs", "script" },
+    { ".woff2", "font" },
+    { ".woff", "font" },
+    { ".ttf", "font" },
+    { ".png", "image" },
+    { ".jpg", "image" },
+    { ".jpeg", "image" },
+    { ".gif", "image" },
+    { ".svg", "image" },
+    { ".webp", "image" },
+    { ".avif", "image" },
+    { ".json", "fetch" }
+  };
+  apr_size_t i, end = strcspn(url, "?#");
+
+  if (end > len) {
+    end = len;
+  }
+  for (i = 0; i < sizeof(types) / sizeof(types[0]); ++i) {
+    apr_size_t n = strlen(types[i].ext);
+    if (end >= n && strncasecmp(url + end - n, types[i].ext, n) == 0) {
+      return types[i].as;
+    }
+  }
+  return NULL;
+}
+
+/* RFC 7230 tchar */
+static APR_INLINE int xsendfile_is_tchar(char c) {
+  return apr_isalnum(c) || (c && strchr("!#$%&'*+-.^_`|~", c));
+}
+
+/*
+  one ";name" or ";name=value" link parameter of the len bytes at param
+  (leading semicolon excluded) into "; name=value", value a token or a
+  quoted string without escapes; NULL if it is neither
+*/
+static const char *xsendfile_preload_param(apr_pool_t *p, const char *param, apr_size_t len,
+    /* out */ const char **name, apr_size_t *nameLen) {
+  apr_size_t i = 0, n;
+
+  while (i < len && (param[i] == ' ' || param[i] == '\t')) {
+    ++i;
+  }
+  while (len > i && (param[len - 1] == ' ' || param[len - 1] == '\t')) {
+    --len;
+  }
+  for (n = i; n < len && xsendfile_is_tchar(param[n]); ++n);
+  if (n == i) {
+    return NULL;
+  }
+  *name = param + i;
+  *nameLen = n - i;
+  if (n == len) {
+    return apr_pstrcat(p, "; ", apr_pstrmemdup(p, param + i, n - i), NULL);
+  }
+  if (param[n] != '=' || n + 1 == len) {
+    return NULL;
+  }
+  if (param[n + 1] == '"') {
+    if (len - n < 3 || param[len - 1] != '"'
+      || memchr(param + n + 2, '"', len - n - 3) || memchr(param + n + 2, '\\', len - n - 3)) {
+      return NULL;
+    }
+  }
+  else {
+    apr_size_t v;
+    for (v = n + 1; v < len; ++v) {
+      if (!xsendfile_is_tchar(param[v])) {
+        return NULL;
+      }
+    }
+  }
+  return apr_pstrcat(p, "; ", apr_pstrmemdup(p, param + i, len - i), NULL);
+}
+
+/*
+  one entry of X-Sendfile-Preload or the sidecar file into a Link value:
+  either one already (<url>; as=style), or a bare URL. Either way the URL
+  and parameters are checked and the value put together anew, rel=preload
+  added unless there is a rel, and "as" guessed from the extension unless
+  given.
+*/
+static const char *xsendfile_preload_link(apr_pool_t *p, const char *entry, apr_size_t len) {
+  const char *url, *params, *as = NULL, *link;
+  apr_size_t urlLen, paramsLen, i;
+  int rel = 0, crossorigin = 0;
+
+  while (len && apr_isspace(*entry)) {
+    ++entry;
+    --len;
+  }
+  while (len && apr_isspace(entry[len - 1])) {
+    --len;
+  }
+  if (!len || *entry == '#') {
+    return NULL;
+  }
+  for (i = 0; i < len; ++i) {
+    if (apr_iscntrl(entry[i])) {
+      return NULL;
+    }
+  }
+  if (*entry == '<') {
+    const char *close = memchr(entry, '>', len);
+    if (!close) {
+      return NULL;
+    }
+    url = entry + 1;
+    urlLen = close - url;
+    params = close + 1;
+    paramsLen = len - (params - entry);
+  }
+  else {
+    url = entry;
+    urlLen = len;
+    params = NULL;
+    paramsLen = 0;
+  }
+  /* no header injection through the URL */
+  for (i = 0; i < urlLen; ++i) {
+    if (apr_isspace(url[i]) || strchr("<>;,\"", url[i])) {
+      return NULL;
+    }
+  }
+  if (!urlLen) {
+    return NULL;
+  }
+
+  link = apr_pstrcat(p, "<", apr_pstrmemdup(p, url, urlLen), ">", NULL);
+  while (paramsLen) {
+    const char *end, *param, *name;
+    apr_size_t n, nameLen;
+
+    while (paramsLen && (*params == ' ' || *params == '\t')) {
+      ++params;
+      --paramsLen;
+    }
+    if (!paramsLen) {
+      break;
+    }
+    if (*params != ';') {
+      return NULL;
+    }
+    ++params;
+    --paramsLen;
+    end = memchr(params, ';', paramsLen);
+    n = end ? (apr_size_t)(end - params) : paramsLen;
+    if (!(param = xsendfile_preload_param(p, params, n, &name, &nameLen))) {
+      return NULL;
+    }
+    link = apr_pstrcat(p, link, param, NULL);
+    if (nameLen == 3 && strncasecmp(name, "rel", 3) == 0) {
+      rel = 1;
+    }
+    else if (nameLen == 2 && strncasecmp(name, "as", 2) == 0) {
+      as = "";
+    }
+    else if (nameLen == 11 && strncasecmp(name, "crossorigin", 11) == 0) {
+      crossorigin = 1;
+    }
+    params += n;
+    paramsLen -= n;
+  }
+
+  if (!rel) {
+    link = apr_pstrcat(p, link, "; rel=preload", NULL);
+  }
+  if (!as && (as = xsendfile_preload_as(url, urlLen)) != NULL) {
+    link = apr_pstrcat(p, link, "; as=", as,
+      !strcmp(as, "font") && !crossorigin ? "; crossorigin" : "", NULL);
+  }
+  return link;
+}
+
+/* add the Link values of list (separated by sep) to links */
+static void xsendfile_preload_parse(apr_pool_t *p, const char *list, char sep, apr_array_header_t *links) {
+  while (*list && links->nelts < XSENDFILE_PRELOAD_MAX) {
+    const char *end = strchr(list, sep);
+    apr_size_t len = end ? (apr_size_t)(end - list) : strlen(list);
+    const char *link = xsendfile_preload_link(p, list, len);
+
+    if (link) {
+      *(const char**)apr_array_push(links) = link;
+    }
+    if (!end) {
+      break;
+    }
+    list = end + 1;
+  }
+}
+
+/*
+  <file>.preload, one entry per line; that there is none is remembered
+  like the variant decision, most files not having one
+*/
+static void ap_xsendfile_preload_sidecar(request_rec *r, xsendfile_ctx_t *ctx,
+    const char *path, apr_array_header_t *links) {
+  apr_file_t *fd;
+  char *buf;
+  apr_size_t len = XSENDFILE_PRELOAD_SIDECAR_MAX;
+  apr_status_t rv;
+  int cacheable = xsendfile_metacache && (ctx->profile->metadataTTL || ctx->profile->immortal);
+
+  if (cacheable && ap_xsendfile_meta_no_sidecar(r, path)) {
+    return;
+  }
+  XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_OPEN);
+  if ((rv = apr_file_open(&fd, apr_pstrcat(r->pool, path, ".preload", NULL),
+      APR_READ | APR_BINARY, 0, r->pool)) != APR_SUCCESS) {
+    if (cacheable && APR_STATUS_IS_ENOENT(rv)) {
+      ap_xsendfile_meta_store_no_sidecar(r, ctx, path);
+    }
+    return;
+  }
+  buf = apr_palloc(r->pool, len + 1);
+  /* len becomes what was read, APR_EOF being the rule rather than the exception */
+  apr_file_read_full(fd, buf, len, &len);
+  XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_CLOSE);
+  apr_file_close(fd);
+  buf[len] = '\0';
+  xsendfile_preload_parse(r->pool, buf, '\n', links);
+}
+
+/*
+  XSendFileEarlyHints: send the preloads as 103 Early Hints ahead of the
+  file (HTTP/1.1 and, with H2EarlyHints on, HTTP/2), and as Link headers
+  of the response for everybody else. Only the Link headers go into the
+  103, which is why headers_out gets swapped for the time being.
+*/
+static void ap_xsendfile_early_hints(request_rec *r, xsendfile_ctx_t *ctx,
+    const xsendfile_conf_t *conf, const char *preload, const char *path) {
+  apr_array_header_t *links = apr_array_make(r->pool, 4, sizeof(const char*));
+  const char **link;
+  apr_table_t *headers;
+  const char *statusLine;
+  int i, status;
+
+  if (preload) {
+    xsendfile_preload_parse(r->pool, preload, ',', links);
+  }
+  else if (conf->earlyHints == XSENDFILE_HINTS_SIDECAR && !ctx->temporary) {
+    ap_xsendfile_preload_sidecar(r, ctx, path, links);
+  }
+  if (!links->nelts) {
+    return;
+  }
+
+  link = (const char**)links->elts;
+  for (i = 0; i < links->nelts; ++i) {
+    apr_table_addn(r->headers_out, "Link", link[i]);
+  }
+  ctx->preloads = links->nelts;
+
+  if (r->proto_num < 1001) {
+    return;
+  }
+  headers = r->headers_out;
+  status = r->status;
+  statusLine = r->status_line;
+  r->headers_out = apr_table_make(r->pool, links->nelts);
+  for (i = 0; i < links->nelts; ++i) {
+    apr_table_addn(r->headers_out, "Link", link[i]);
+  }
+  r->status = HTTP_EARLY_HINTS;
+  r->status_line = "103 Early Hints";
+  ap_send_interim_response(r, 1);
+  r->headers_out = headers;
+  r->status = status;
+  r->status_line = statusLine;
+  ctx->preloads = -links->nelts;
+}
+
+#if APR_HAS_THREADS
+static void xsendfile_prefetch_file(const char *path) {
+  int fd;
+
+#ifdef O_CLOEXEC
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+#else
+  fd = open(path, O_RDONLY);
+#endif
+  if (fd < 0) {
+    return;
+  }
+#if defined(POSIX_FADV_WILLNEED)
+  posix_fadvise(fd, 0, XSENDFILE_PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+#endif
+  close(fd);
+}
+
+static void * APR_THREAD_FUNC xsendfile_prefetcher_thread(apr_thread_t *thd, void *data) {
+  xsendfile_prefetcher_t *pf = (xsendfile_prefetcher_t*)data;
+  xsendfile_prefetch_t *job;
+
+  apr_thread_mutex_lock(pf->mutex);
+  while (!pf->shutdown) {
+    if (pf->head == pf->tail) {
+      apr_thread_cond_wait(pf->cond, pf->mutex);
+      continue;
+    }
+    job = pf->queue[pf->head++ % XSENDFILE_PREFETCH_QUEUE];
+    apr_thread_mutex_unlock(pf->mutex);
+
+    xsendfile_prefetch_file(job->path);
+    if (job->gzip) {
+      strcat(job->path, ".gz");
+      xsendfile_prefetch_file(job->path);
+    }
+    free(job);
+
+    apr_thread_mutex_lock(pf->mutex);
+  }
+  while (pf->head != pf->tail) {
+    free(pf->queue[pf->head++ % XSENDFILE_PREFETCH_QUEUE]);
+  }
+  apr_thread_mutex_unlock(pf->mutex);
+
+  apr_thread_exit(thd, APR_SUCCESS);
+  return NULL;
+}
+
+static apr_status_t xsendfile_prefetcher_shutdown(void *data) {
+  xsendfile_prefetcher_t *pf = (xsendfile_prefetcher_t*)data;
+  apr_status_t rv;
+
+  apr_thread_mutex_lock(pf->mutex);
+  pf->shutdown = 1;
+  apr_thread_cond_signal(pf->cond);
+  apr_thread_mutex_unlock(pf->mutex);
+  apr_thread_join(&rv, pf->thread);
+
+  return APR_SUCCESS;
+}
+
+/*
+  hand path to the thread, unless prefetched recently or over the rate.
+  An identity prefetch doesn't cover the .gz variant, so the key is the
+  path, its NUL and gzip.
+*/
+static void xsendfile_prefetch_queue(apr_pool_t *p, xsendfile_ctx_t *ctx, const char *path,
+    int gzip, apr_time_t now) {
+  xsendfile_prefetcher_t *pf = xsendfile_prefetcher;
+  xsendfile_prefetch_t *job;
+  apr_time_t *seen;
+  apr_size_t len = strlen(path);
+  char *key = (char*)apr_palloc(p, len + 2);
+  int add;
+
+  memcpy(key, path, len + 1);
+  key[len + 1] = (char)(gzip != 0);
+
+  apr_thread_mutex_lock(pf->mutex);
+  seen = (apr_time_t*)apr_hash_get(pf->seen, key, len + 2);
+  if (seen && now - *seen < XSENDFILE_PREFETCH_TTL) {
+    apr_thread_mutex_unlock(pf->mutex);
+    ctx->prefetchSkipped++;
+    return;
+  }
+
+  add = (int)((now - pf->refilled) * XSENDFILE_PREFETCH_RATE / APR_USEC_PER_SEC);
+  if (add > 0) {
+    pf->tokens = pf->tokens + add > XSENDFILE_PREFETCH_RATE ? XSENDFILE_PREFETCH_RATE : pf->tokens + add;
+    pf->refilled = now;
+  }
+  if (pf->tokens < 1 || pf->tail - pf->head >= XSENDFILE_PREFETCH_QUEUE
+    || !(job = (xsendfile_prefetch_t*)malloc(sizeof(xsendfile_prefetch_t) + len + 3))) {
+    apr_thread_mutex_unlock(pf->mutex);
+    ctx->prefetchDropped++;
+    return;
+  }
+  pf->tokens--;
+  job->gzip = gzip;
+  memcpy(job->path, path, len + 1);
+  pf->queue[pf->tail++ % XSENDFILE_PREFETCH_QUEUE] = job;
+  apr_thread_cond_signal(pf->cond);
+
+  if (!seen) {
+    if (apr_hash_count(pf->seen) >= XSENDFILE_PREFETCH_SEEN_MAX) {
+      apr_pool_clear(pf->pool);
+      pf->seen = apr_hash_make(pf->pool);
+    }
+    seen = (apr_time_t*)apr_palloc(pf->pool, sizeof(apr_time_t));
+    apr_hash_set(pf->seen, apr_pmemdup(pf->pool, key, len + 2), len + 2, seen);
+  }
+  *seen = now;
+  apr_thread_mutex_unlock(pf->mutex);
+  ctx->prefetches++;
+}
+#endif
+
+/*
+  XSendFilePrefetch: the comma separated files of X-Sendfile-Prefetch,
+  resolved against the same roots (the script directory included) as
+  the response's own, handed to the prefetching thread
+*/
+static void ap_xsendfile_prefetch(request_rec *r, xsendfile_conf_t *conf,
+    xsendfile_ctx_t *ctx, const char *list) {
+#if APR_HAS_THREADS
+  const apr_array_header_t *patharr;
+  const xsendfile_path_t *paths;
+  apr_time_t now = apr_time_now();
+  int n = 0;
+
+  if (!xsendfile_prefetcher) {
+    return;
+  }
+  patharr = xsendfile_search_paths(r, conf, ctx->scriptDir);
+  paths = (const xsendfile_path_t*)patharr->elts;
+  while (*list && n < conf->prefetch) {
+    const char *end = strchr(list, ',');
+    apr_size_t len = end ? (apr_size_t)(end - list) : strlen(list);
+    char *file, *path;
+    apr_status_t rv;
+    int found;
+
+    while (len && apr_isspace(*list)) {
+      ++list;
+      --len;
+    }
+    while (len && apr_isspace(list[len - 1])) {
+      --len;
+    }
+    file = apr_pstrmemdup(r->pool, list, len);
+    list = end ? end + 1 : list + len;
+    if (!*file
+      || (conf->unescape != XSENDFILE_DISABLED && ap_unescape_url(file) != OK)) {
+      continue;
+    }
+    ++n;
+    found = ap_xsendfile_find_root(r, conf, patharr, file, 0, &rv, &path);
+    if (found < 0) {
+      ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r, "xsendfile: not prefetching %s, not below any XSendFilePath", file);
+      continue;
+    }
+    xsendfile_prefetch_queue(r->pool, ctx, path,
+      ctx->acceptEncoding == XSENDFILE_AE_GZIP && paths[found].profile->compress != XSENDFILE_COMPRESS_OFF, now);
+  }
+#endif
+}
+
+#if APR_HAS_MMAP
+static void xsendfile_file_unref(xsendfile_cached_file_t *file) {
+  if (--file->refs == 0) {
+    munmap(file->map, (size_t)file->size);
+    free(file);
+  }
+}
+
+static apr_status_t xsendfile_file_release(void *data) {
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(xsendfile_metacache->mutex);
+#endif
+  xsendfile_file_unref((xsendfile_cached_file_t*)data);
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(xsendfile_metacache->mutex);
+#endif
+  return APR_SUCCESS;
+}
+
+/* with the child, whatever is still cached; no requests are left by then */
+static apr_status_t xsendfile_file_cache_cleanup(void *data) {
+  xsendfile_metacache_t *cache = (xsendfile_metacache_t*)data;
+  apr_hash_index_t *hi;
+  void *file;
+
+  for (hi = apr_hash_first(NULL, cache->files); hi; hi = apr_hash_next(hi)) {
+    apr_hash_this(hi, NULL, NULL, &file);
+    munmap(((xsendfile_cached_file_t*)file)->map, (size_t)((xsendfile_cached_file_t*)file)->size);
+    free(file);
+  }
+  cache->files = NULL;
+  return APR_SUCCESS;
+}
+#endif
+
+/*
+  an immutable root's file, as mapped and fstat()ed before; it stays
+  mapped as long as r->pool, i.e. until the response is through
+*/
+static const xsendfile_cached_file_t *ap_xsendfile_file_lookup(request_rec *r,
+    const char *path, apr_finfo_t *finfo) {
+  xsendfile_cached_file_t *file = NULL;
+
+#if APR_HAS_MMAP
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(xsendfile_metacache->mutex);
+#endif
+  file = (xsendfile_cached_file_t*)apr_hash_get(xsendfile_metacache->files, path, APR_HASH_KEY_STRING);
+  if (file) {
+    file->refs++;
+    file->used = r->request_time;
+  }
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(xsendfile_metacache->mutex);
+#endif
+  if (file) {
+    apr_pool_cleanup_register(r->pool, file, xsendfile_file_release, apr_pool_cleanup_null);
+    /* what xsendfile_fd_info() would have said */
+    memset(finfo, 0, sizeof(*finfo));
+    finfo->valid = APR_FINFO_TYPE | APR_FINFO_INODE | APR_FINFO_DEV | APR_FINFO_SIZE | APR_FINFO_MTIME;
+    finfo->filetype = APR_REG;
+    finfo->size = file->size;
+    finfo->mtime = file->mtime;
+    finfo->inode = file->inode;
+    finfo->device = file->device;
+    finfo->fname = file->path;
+  }
+#endif
+  return file;
+}
+
+/*
+  map the just opened file for the cache; mmap() doesn't go to the file
+  system, and the request's descriptor is closed along with r->pool
+*/
+static void ap_xsendfile_file_store(request_rec *r, const char *path, apr_file_t *fd,
+    const apr_finfo_t *finfo) {
+#if APR_HAS_MMAP
+  xsendfile_cached_file_t *file, *oldest = NULL;
+  apr_hash_index_t *hi;
+  apr_os_file_t osfd;
+  apr_size_t len = strlen(path);
+  void *map, *v;
+
+  if (finfo->size <= 0 || finfo->size > XSENDFILE_FILECACHE_SIZE
+    || apr_os_file_get(&osfd, fd) != APR_SUCCESS
+    || (map = mmap(NULL, (size_t)finfo->size, PROT_READ, MAP_SHARED, osfd, 0)) == MAP_FAILED) {
+    return;
+  }
+  if (!(file = (xsendfile_cached_file_t*)malloc(sizeof(xsendfile_cached_file_t) + len))) {
+    munmap(map, (size_t)finfo->size);
+    return;
+  }
+  file->map = map;
+  file->size = finfo->size;
+  file->mtime = finfo->mtime;
+  file->inode = finfo->inode;
+  file->device = finfo->device;
+  file->used = r->request_time;
+  file->refs = 1;
+  memcpy(file->path, path, len + 1);
+
+#if APR_HAS_THREADS
+  apr_thread_mutex_lock(xsendfile_metacache->mutex);
+#endif
+  if (apr_hash_get(xsendfile_metacache->files, path, APR_HASH_KEY_STRING)) {
+    /* another thread was quicker */
+    xsendfile_file_unref(file);
+    file = NULL;
+  }
+  else if (apr_hash_count(xsendfile_metacache->files) >= XSENDFILE_FILECACHE_MAX) {
+    /* only ever on a miss, and no more than XSENDFILE_FILECACHE_MAX to look at */
+    for (hi = apr_hash_first(NULL, xsendfile_metacache->files); hi; hi = apr_hash_next(hi)) {
+      apr_hash_this(hi, NULL, NULL, &v);
+      if (!oldest || ((xsendfile_cached_file_t*)v)->used < oldest->used) {
+        oldest = (xsendfile_cached_file_t*)v;
+      }
+    }
+    apr_hash_set(xsendfile_metacache->files, oldest->path, APR_HASH_KEY_STRING, NULL);
+    xsendfile_file_unref(oldest);
+  }
+  if (file) {
+    apr_hash_set(xsendfile_metacache->files, file->path, APR_HASH_KEY_STRING, file);
+  }
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(xsendfile_metacache->mutex);
+#endif
+#endif
+}
+
+/* the hex digest in a user.xsendfile.sha1 value, if it's still fresh */
+static const char *xsendfile_hash_parse(char *value, const apr_finfo_t *finfo) {
+  char *end;
+  apr_int64_t size, mtime;
+
+  size = apr_strtoi64(value, &end, 10);
+  if (*end != ' ' || size != (apr_int64_t)finfo->size) {
+    return NULL;
+  }
+  mtime = apr_strtoi64(end + 1, &end, 10);
+  if (*end != ' ' || mtime != (apr_int64_t)finfo->mtime) {
+    return NULL;
+  }
+  ++end;
+  if (strlen(end) != APR_SHA1_DIGESTSIZE * 2 || end[strspn(end, "0123456789abcdef")]) {
+    return NULL;
+  }
+  return end;
+}
+
+#if APR_HAS_THREADS
+/* hex NULL: queue it for hashing. Call with the hasher's mutex held. */
+static void xsendfile_hash_put(const char *path, apr_off_t size, apr_time_t mtime, const char *hex) {
+  xsendfile_hasher_t *h = xsendfile_hasher;
+  xsendfile_hash_t *hash;
+  const char *key = NULL;
+
+  if (!hex && h->head - h->tail >= XSENDFILE_HASH_QUEUE) {
+    return;
+  }
+  hash = (xsendfile_hash_t*)apr_hash_get(h->entries, path, APR_HASH_KEY_STRING);
+  if (!hash) {
+    if (apr_hash_count(h->entries) >= XSENDFILE_HASH_CACHE_MAX) {
+      /* the queue points into the pool as well */
+      apr_pool_clear(h->pool);
+      h->entries = apr_hash_make(h->pool);
+      h->tail = h->head;
+    }
+    hash = (xsendfile_hash_t*)apr_palloc(h->pool, sizeof(xsendfile_hash_t));
+    key = apr_pstrdup(h->pool, path);
+    apr_hash_set(h->entries, key, APR_HASH_KEY_STRING, hash);
+  }
+  hash->size = size;
+  hash->mtime = mtime;
+  if (hex) {
+    apr_cpystrn(hash->hex, hex, sizeof(hash->hex));
+  }
+  else {
+    hash->hex[0] = '\0';
+    if (!key) {
+      key = apr_pstrdup(h->pool, path);
+    }
+    h->queue[h->head++ % XSENDFILE_HASH_QUEUE] = key;
+    apr_thread_cond_signal(h->cond);
+  }
+}
+
+/* SHA-1 of the file, unless it changed while at it; 0 on failure */
+static int xsendfile_hash_file(apr_pool_t *p, const char *path, apr_finfo_t *finfo, char *hex) {
+  unsigned char digest[APR_SHA1_DIGESTSIZE];
+  apr_sha1_ctx_t sha;
+  apr_finfo_t after;
+  apr_file_t *fd;
+  apr_size_t len;
+  apr_status_t rv;
+  char *buf;
+
+  if (apr_file_open(&fd, path, APR_READ | APR_BINARY, 0, p) != APR_SUCCESS) {
+    return 0;
+  }
+  if (apr_file_info_get(finfo, APR_FINFO_SIZE | APR_FINFO_MTIME | APR_FINFO_TYPE, fd) != APR_SUCCESS
+    || finfo->filetype != APR_REG) {
+    apr_file_close(fd);
+    return 0;
+  }
+  buf = apr_palloc(p, XSENDFILE_HASH_BUFSIZE);
+  apr_sha1_init(&sha);
+  do {
+    len = XSENDFILE_HASH_BUFSIZE;
+    rv = apr_file_read(fd, buf, &len);
+    if (len) {
+      apr_sha1_update_binary(&sha, (const unsigned char*)buf, (unsigned int)len);
+    }
+  } while (rv == APR_SUCCESS && !xsendfile_hasher->shutdown);
+  if (rv != APR_EOF
+    || apr_file_info_get(&after, APR_FINFO_SIZE | APR_FINFO_MTIME, fd) != APR_SUCCESS
+    || after.size != finfo->size || after.mtime != finfo->mtime) {
+    apr_file_close(fd);
+    return 0;
+  }
+  apr_file_close(fd);
+  apr_sha1_final(digest, &sha);
+  ap_bin2hex(digest, APR_SHA1_DIGESTSIZE, hex);
+  return 1;
+}
+
+static void * APR_THREAD_FUNC xsendfile_hasher_thread(apr_thread_t *thd, void *data) {
+  xsendfile_hasher_t *h = (xsendfile_hasher_t*)data;
+  char hex[APR_SHA1_DIGESTSIZE * 2 + 1];
+  apr_finfo_t finfo;
+  apr_pool_t *p;
+  char *path;
+
+  apr_pool_create(&p, apr_thread_pool_get(thd));
+  apr_thread_mutex_lock(h->mutex);
+  while (!h->shutdown) {
+    if (h->head == h->tail) {
+      apr_thread_cond_wait(h->cond, h->mutex);
+      continue;
+    }
+    path = apr_pstrdup(p, h->queue[h->tail++ % XSENDFILE_HASH_QUEUE]);
+    apr_thread_mutex_unlock(h->mutex);
+
+    if (xsendfile_hash_file(p, path, &finfo, hex)) {
+      xsendfile_xattr_set(path, XSENDFILE_HASH_XATTR, apr_psprintf(p,
+        "%" APR_OFF_T_FMT " %" APR_TIME_T_FMT " %s", finfo.size, finfo.mtime, hex));
+      apr_thread_mutex_lock(h->mutex);
+      xsendfile_hash_put(path, finfo.size, finfo.mtime, hex);
+    }
+    else {
+      apr_thread_mutex_lock(h->mutex);
+    }
+    apr_pool_clear(p);
+  }
+  apr_thread_mutex_unlock(h->mutex);
+
+  apr_thread_exit(thd, APR_SUCCESS);
+  return NULL;
+}
+
+static apr_status_t xsendfile_hasher_shutdown(void *data) {
+  xsendfile_hasher_t *h = (xsendfile_hasher_t*)data;
+  apr_status_t rv;
+
+  apr_thread_mutex_lock(h->mutex);
+  h->shutdown = 1;
+  apr_thread_cond_signal(h->cond);
+  apr_thread_mutex_unlock(h->mutex);
+  apr_thread_join(&rv, h->thread);
+  xsendfile_hasher = NULL;
+
+  return APR_SUCCESS;
+}
+#endif
+
+/*
+  XSendFileHashETag: the quoted content hash of the file, NULL if not
+  known (yet), in which case it's queued for hashing
+*/
+static const char *ap_xsendfile_hash_etag(request_rec *r, xsendfile_ctx_t *ctx,
+    const char *path, const apr_finfo_t *finfo) {
+  const char *hex = NULL;
+  char *value;
+
+#if APR_HAS_THREADS
+  if (xsendfile_hasher) {
+    const xsendfile_hash_t *hash;
+    int known = 0;
+
+    apr_thread_mutex_lock(xsendfile_hasher->mutex);
+    hash = (const xsendfile_hash_t*)apr_hash_get(xsendfile_hasher->entries, path, APR_HASH_KEY_STRING);
+    if (hash && hash->size == finfo->size && hash->mtime == finfo->mtime) {
+      /* or queued already */
+      known = 1;
+      if (*hash->hex) {
+        hex = apr_pstrdup(r->pool, hash->hex);
+      }
+    }
+    apr_thread_mutex_unlock(xsendfile_hasher->mutex);
+    if (known) {
+      return hex ? apr_pstrcat(r->pool, "\"", hex, "\"", NULL) : NULL;
+    }
+  }
+#endif
+
+  XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_XATTR);
+  if ((value = xsendfile_xattr_get(r->pool, path, XSENDFILE_HASH_XATTR)) != NULL) {
+    hex = xsendfile_hash_parse(value, finfo);
+  }
+
+#if APR_HAS_THREADS
+  if (xsendfile_hasher) {
+    apr_thread_mutex_lock(xsendfile_hasher->mutex);
+    xsendfile_hash_put(path, finfo->size, finfo->mtime, hex);
+    apr_thread_mutex_unlock(xsendfile_hasher->mutex);
+  }
+#endif
+  return hex ? apr_pstrcat(r->pool, "\"", hex, "\"", NULL) : NULL;
+}
+
+#if defined(POSIX_FADV_NORMAL)
+static int xsendfile_fadvise_advice(xsendfile_fadvise_t fadvise) {
+  switch (fadvise) {
+  case XSENDFILE_FADVISE_SEQUENTIAL: return POSIX_FADV_SEQUENTIAL;
+  case XSENDFILE_FADVISE_RANDOM: return POSIX_FADV_RANDOM;
+  case XSENDFILE_FADVISE_WILLNEED: return POSIX_FADV_WILLNEED;
+  case XSENDFILE_FADVISE_NOREUSE: return POSIX_FADV_NOREUSE;
+  default: return POSIX_FADV_NORMAL;
+  }
+}
+
+/* Transfer=direct: the file has been sent, don't keep it in the page cache */
+static apr_status_t xsendfile_drop_pages(void *data) {
+  posix_fadvise((int)(apr_intptr_t)data, 0, 0, POSIX_FADV_DONTNEED);
+  return APR_SUCCESS;
+}
+#endif
+
+/* the profile's Fadvise and, for Transfer=direct, the page cache dropping */
+static void ap_xsendfile_fadvise(request_rec *r, xsendfile_ctx_t *ctx, apr_file_t *fd) {
+#if defined(POSIX_FADV_NORMAL)
+  apr_os_file_t osfd;
+
+  if (apr_os_file_get(&osfd, fd) != APR_SUCCESS) {
+    return;
+  }
+  if (ctx->profile->fadvise != XSENDFILE_FADVISE_NONE) {
+    XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_FADVISE);
+    posix_fadvise(osfd, 0, 0, xsendfile_fadvise_advice(ctx->profile->fadvise));
+  }
+  if (ctx->profile->transfer == XSENDFILE_TRANSFER_DIRECT) {
+    /* runs before the file's own cleanup, the descriptor is still open */
+    XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_FADVISE);
+    apr_pool_cleanup_register(r->pool, (void*)(apr_intptr_t)osfd, xsendfile_drop_pages, apr_pool_cleanup_null);
+  }
+#endif
+}
+
+/*
+  Appends the buckets of the file following first (of chunk bytes) to
+  bb, all of them: the whole file is handed down in one go, and write
+  completion takes it from there, a bucket per sendfile() call. Each
+  bucket costs its struct and no more, they share the file.
+*/
+static void ap_xsendfile_split_file(apr_bucket_brigade *bb, apr_bucket *first,
+    apr_off_t size, apr_off_t chunk) {
+  apr_off_t offset = first->start + first->length;
+  apr_bucket *e;
+
+  while (offset < size) {
+    apr_bucket_copy(first, &e);
+    e->start = offset;
+    e->length = (apr_size_t)(size - offset < chunk ? size - offset : chunk);
+    APR_BRIGADE_INSERT_TAIL(bb, e);
+    offset += e->length;
+  }
+}
+
+static apr_status_t ap_xsendfile_output_filter(ap_filter_t *f, apr_bucket_brigade *in) {
+  request_rec *r = f->r, *sr = NULL;
+
+  xsendfile_conf_t
+    *dconf = ap_get_module_config(r->per_dir_config, &xsendfile_module),
+    *sconf = ap_get_module_config(r->server->module_config, &xsendfile_module),
+    *conf = xsendfile_config_merge(r->pool, sconf, dconf);
+
+  core_dir_config *coreconf = ap_get_module_config(r->per_dir_config, &core_module);
+
+  apr_status_t rv;
+  apr_bucket *e;
+
+  apr_file_t *fd = NULL;
+  apr_finfo_t finfo;
+
+  char *file = NULL;
+  char *translated = NULL;
+  char *translatedEncoding = NULL;
+
+  int errcode;
+  int shouldDeleteFile = 0;
+  int accel = 0;
+  int useSendfile, useMmap, fileCache;
+  apr_int32_t openFlags;
+  apr_off_t chunk = 0;
+  apr_bucket *first = NULL;
+  const xsendfile_cached_file_t *cached = NULL;
+  const char *preload = NULL;
+  const char *prefetch;
+
+  xsendfile_ctx_t *ctx;
+  apr_uint64_t started = 0, start;
+
+#ifdef _DEBUG
+  ap_log_error(
+    APLOG_MARK,
+    APLOG_DEBUG,
+    0,
+    r->server,
+    "xsendfile: output_filter for %s",
+    r->the_request
+    );
+#endif
+  /*
+    should we proceed with this request?
+
+    * sub-requests suck
+    * furthermore default-handled requests suck, as they actually shouldn't be able to set headers
+  */
+  if (
+    r->status != HTTP_OK
+    || r->main
+    || (r->handler && strcmp(r->handler, "default-handler") == 0)
+  ) {
+#ifdef _DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: not met [%d]", r->status);
+#endif
+    ap_remove_output_filter(f);
+    return ap_pass_brigade(f->next, in);
+  }
+
+  started = xsendfile_clock();
+
+  /*
+    alright, look for x-sendfile
+  */
+  file = ap_xsendfile_scan_headers(r, conf, &shouldDeleteFile, &accel);
+
+  /* nothing there :p */
+  if (!file || !*file) {
+#ifdef _DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: nothing found");
+#endif
+    /* meant for us alone, meaningless without the file */
+    xsendfile_take_header(r, AP_XSENDFILELIMITRATE_HEADER);
+    xsendfile_take_header(r, AP_XSENDFILEPREFETCH_HEADER);
+    ap_remove_output_filter(f);
+    return ap_pass_brigade(f->next, in);
+  }
+
+  /* from here on we own the response; the log_transaction hook publishes ctx */
+  ctx = (xsendfile_ctx_t*)apr_pcalloc(r->pool, sizeof(xsendfile_ctx_t));
+  ctx->notes = conf->timing == XSENDFILE_ENABLED;
+  ctx->started = started;
+  ctx->root = -1;
+  ctx->rootId = XSENDFILE_ROOT_OTHER;
+  ctx->profile = &xsendfile_default_profile;
+  ctx->variant = XSENDFILE_VARIANT_IDENTITY;
+  ctx->outcome = XSENDFILE_OUTCOME_SENT;
+  ctx->file = file;
+  ctx->size = -1;
+  ctx->rootSet = conf->rootSet;
+  ctx->temporary = shouldDeleteFile;
+  ctx->accel = accel;
+  ctx->limitRate = -1;
+  ap_set_module_config(r->request_config, &xsendfile_module, ctx);
+  xsendfile_phase_end(ctx, XSENDFILE_PHASE_SCAN, started);
+  /* only now, like the rest of them: responses without a header aren't ours */
+  XSENDFILE_PROBE2(filter_entry, r->uri, r->status);
+  XSENDFILE_PROBE2(header_found, file, shouldDeleteFile);
+
+  /*
+    drop *everything*
+    might be pretty expensive to generate content first that goes straight to the bitbucket,
+    but actually the scripts that might set this flag won't output too much anyway
+  */
+  while (!APR_BRIGADE_EMPTY(in)) {
+    e = APR_BRIGADE_FIRST(in);
+    apr_bucket_delete(e);
+  }
+  r->eos_sent = 0;
+
+  /* as we dropped all the content this field is not valid anymore! */
+  apr_table_unset(r->headers_out, "Content-Length");
+  apr_table_unset(r->err_headers_out, "Content-Length");
+  apr_table_unset(r->headers_out, "Content-Encoding");
+  apr_table_unset(r->err_headers_out, "Content-Encoding");
+
+  if (conf->earlyHints > XSENDFILE_HINTS_OFF) {
+    preload = xsendfile_take_header(r, AP_XSENDFILEPRELOAD_HEADER);
+  }
+  /* never for the client's eyes, wanted or not */
+  prefetch = xsendfile_take_header(r, AP_XSENDFILEPREFETCH_HEADER);
+
+  /* the application's say, over the root's LimitRate */
+  {
+    const char *rate = xsendfile_take_header(r, AP_XSENDFILELIMITRATE_HEADER);
+    if (rate && !xsendfile_parse_rate(rate, &ctx->limitRate)) {
+      ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, r, "xsendfile: ignoring invalid X-Sendfile-Limit-Rate %s", rate);
+    }
+  }
+
+  if (accel) {
+    char *query = strchr(file, '?');
+    if (query) {
+      *query = '\0';
+    }
+    ap_xsendfile_accel_headers(r, ctx);
+  }
+
+  /* Decode header
+     lighttpd does the same for X-Sendfile2, so we're compatible here
+     (X-Accel-Redirect being a URI is always escaped)
+     */
+  if (accel || conf->unescape != XSENDFILE_DISABLED) {
+    rv = ap_unescape_url(file);
+    if (rv != OK) {
+      /* Unescaping failed, probably due to bad encoding.
+         Note that NOT_FOUND refers to escape sequences containing slashes,
+         what we do not allow (use real slashes only)
+         */
+      ap_log_rerror(
+        APLOG_MARK,
+        APLOG_ERR,
+        rv,
+        r,
+        "xsendfile: bad file name encoding"
+        );
+      ap_remove_output_filter(f);
+      ctx->outcome = XSENDFILE_OUTCOME_BAD_ENCODING;
+      ap_die(HTTP_INTERNAL_SERVER_ERROR, r);
+      return HTTP_INTERNAL_SERVER_ERROR;
+    }
+  }
+
+  /* lookup/verification of the given path */
+  if (accel) {
+    rv = ap_xsendfile_get_mapped_filepath(r, conf, ctx, file, &translated);
+  }
+  else {
+    rv = ap_xsendfile_get_filepath(
+      r,
+      conf,
+      ctx,
+      file,
+      shouldDeleteFile,
+      &translated
+      );
+  }
+  ctx->path = translated;
+  if (rv != OK) {
+    ap_log_rerror(
+      APLOG_MARK,
+      APLOG_ERR,
+      rv,
+      r,
+      "xsendfile: unable to find file: %s",
+      file
+      );
+    ap_remove_output_filter(f);
+    ctx->outcome = XSENDFILE_OUTCOME_NOT_FOUND_RESOLVE;
+    ap_die(HTTP_NOT_FOUND, r);
+    return HTTP_NOT_FOUND;
+  }
+
+  /* the client can fetch those while we get the file going */
+  if (conf->earlyHints > XSENDFILE_HINTS_OFF) {
+    ap_xsendfile_early_hints(r, ctx, conf, preload,
+      ctx->variant == XSENDFILE_VARIANT_GZIP ? apr_pstrndup(r->pool, translated, strlen(translated) - 3) : translated);
+  }
+
+  /* the root's profile has the say over EnableSendfile and EnableMMAP */
+  switch (ctx->profile->transfer) {
+  case XSENDFILE_TRANSFER_SENDFILE:
+    useSendfile = 1;
+    useMmap = 0;
+    break;
+  case XSENDFILE_TRANSFER_MMAP:
+    useSendfile = 0;
+    useMmap = 1;
+    break;
+  case XSENDFILE_TRANSFER_READ:
+  case XSENDFILE_TRANSFER_DIRECT:
+    useSendfile = useMmap = 0;
+    break;
+  default:
+    useSendfile = coreconf->enable_sendfile != ENABLE_SENDFILE_OFF;
+    useMmap = coreconf->enable_mmap == ENABLE_MMAP_ON;
+    break;
+  }
+
+  /*
+    one sendfile() per bucket: the smaller, the sooner the event MPM's
+    write completion gets to the other connections
+  */
+  if (conf->bucketSize > 0) {
+    ctx->bucketSize = conf->bucketSize;
+  }
+
+  /*
+    mod_http2 copies the body into DATA frames itself, and a single
+    bucket of the whole file has the stream hog the connection until
+    it's through. In buckets of about a window they take turns. The
+    transfer settings stay as they are, mod_http2 reading (or passing
+    on) file buckets however it sees fit.
+  */
+  if (r->proto_num >= 2000 && conf->h2BucketSize > 0) {
+    ctx->bucketSize = conf->h2BucketSize;
+    ctx->h2Shaped = 1;
+  }
+
+  /*
+    Immutable roots keep their files mapped and send them from there,
+    which is what Transfer=sendfile, read and direct ask not to do
+  */
+#if APR_HAS_MMAP
+  fileCache = ctx->profile->immutable && !shouldDeleteFile && xsendfile_metacache
+    && (ctx->profile->transfer == XSENDFILE_TRANSFER_AUTO
+      || ctx->profile->transfer == XSENDFILE_TRANSFER_MMAP);
+#else
+  fileCache = 0;
+#endif
+
+  /*
+    try open the file
+  */
+  openFlags = APR_READ | APR_BINARY
+    | (shouldDeleteFile ? APR_DELONCLOSE : 0)  /* if this is a temporary file, delete on close */
+#if APR_HAS_SENDFILE
+    | (useSendfile ? APR_SENDFILE_ENABLED : 0)
+#endif
+    ;
+  start = xsendfile_clock();
+  if (fileCache && (cached = ap_xsendfile_file_lookup(r, translated, &finfo)) != NULL) {
+    ctx->fileCached = 1;
+    rv = APR_SUCCESS;
+    goto opened;
+  }
+  XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_OPEN);
+  rv = xsendfile_fsguard_open(r, ctx, &fd, translated, openFlags);
+  if (rv != APR_SUCCESS && !ctx->guardBusy && ctx->metadata > 0 && ctx->variant == XSENDFILE_VARIANT_GZIP) {
+    /* the cached .gz went away in the meantime, fall back to the original */
+    translated = apr_pstrndup(r->pool, translated, strlen(translated) - 3);
+    ctx->path = translated;
+    ctx->variant = XSENDFILE_VARIANT_IDENTITY;
+    apr_table_unset(r->headers_out, "Content-Encoding");
+    XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_OPEN);
+    rv = xsendfile_fsguard_open(r, ctx, &fd, translated, openFlags);
+  }
+  if (rv != APR_SUCCESS && ctx->guardBusy) {
+    ap_log_rerror(
+      APLOG_MARK,
+      APLOG_WARNING,
+      rv,
+      r,
+      "xsendfile: XSendFileFsGuard %s, not sending %s",
+      rv == APR_EAGAIN ? "queue full" : rv == APR_EBUSY ? "breaker open" : "timed out",
+      translated
+      );
+    ap_remove_output_filter(f);
+    ctx->outcome = XSENDFILE_OUTCOME_FS_BUSY;
+    apr_table_setn(r->err_headers_out, "Retry-After", apr_itoa(r->pool, XSENDFILE_FSGUARD_COOLDOWN));
+    ap_die(HTTP_SERVICE_UNAVAILABLE, r);
+    return HTTP_SERVICE_UNAVAILABLE;
+  }
+  if (rv != APR_SUCCESS) {
     ap_log_rerror(
       APLOG_MARK,
       APLOG_ERR,
@@ -751,164 +4243,1509 @@ static apr_status_t ap_xsendfile_output_filter(ap_filter_t *f, apr_bucket_brigad
       "xsendfile: cannot open file: %s",
       translated
       );
-    ap_remove_output_filter(f);
-    ap_die(HTTP_NOT_FOUND, r);
-    return HTTP_NOT_FOUND;
+    XSENDFILE_PROBE3(file_opened, translated, (apr_int64_t)-1, rv);
+    ap_remove_output_filter(f);
+    ctx->outcome = XSENDFILE_OUTCOME_NOT_FOUND_OPEN;
+    ap_die(HTTP_NOT_FOUND, r);
+    return HTTP_NOT_FOUND;
+  }
+#if APR_HAS_SENDFILE && defined(_DEBUG)
+  if (coreconf->enable_sendfile == ENABLE_SENDFILE_OFF) {
+    ap_log_error(
+      APLOG_MARK,
+      APLOG_WARNING,
+      0,
+      r->server,
+      "xsendfile: sendfile configured, but not active %d",
+      coreconf->enable_sendfile
+      );
+    }
+#endif
+  /* stat (for etag/cache/content-length stuff) */
+  XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_FSTAT);
+  /* closed either explicitly below or along with r->pool */
+  XSENDFILE_SYSCALL(ctx, XSENDFILE_SYS_CLOSE);
+  if ((rv = xsendfile_fd_info(&finfo, fd)) != APR_SUCCESS) {
+    ap_log_rerror(
+      APLOG_MARK,
+      APLOG_ERR,
+      rv,
+      r,
+      "xsendfile: unable to stat file: %s",
+      translated
+      );
+    apr_file_close(fd);
+    ap_remove_output_filter(f);
+    ctx->outcome = XSENDFILE_OUTCOME_FORBIDDEN_STAT;
+    ap_die(HTTP_FORBIDDEN, r);
+    return HTTP_FORBIDDEN;
+  }
+opened:
+  xsendfile_phase_end(ctx, XSENDFILE_PHASE_OPEN, start);
+  XSENDFILE_PROBE3(file_opened, translated, (apr_int64_t)finfo.size, rv);
+  /* no inclusion of directories! we're serving files! */
+  if (finfo.filetype != APR_REG) {
+    ap_log_rerror(
+      APLOG_MARK,
+      APLOG_ERR,
+      APR_EBADPATH,
+      r,
+      "xsendfile: not a file %s",
+      translated
+      );
+    apr_file_close(fd);
+    ap_remove_output_filter(f);
+    ctx->outcome = XSENDFILE_OUTCOME_NOT_FOUND_NOT_FILE;
+    ap_die(HTTP_NOT_FOUND, r);
+    return HTTP_NOT_FOUND;
+  }
+  if (fileCache && !ctx->fileCached) {
+    ap_xsendfile_file_store(r, translated, fd, &finfo);
+  }
+
+  /*
+    need to cheat here a bit
+    as etag generator will use those ;)
+    and we want local_copy and cache
+  */
+  r->finfo.inode = finfo.inode;
+  r->finfo.size = finfo.size;
+  ctx->size = finfo.size;
+
+  /*
+    caching? why not :p
+  */
+  r->no_cache = r->no_local_copy = 0;
+
+  /* some script (f?cgi) place stuff in err_headers_out */
+  if (
+    conf->ignoreLM == XSENDFILE_ENABLED
+    || (
+      !apr_table_get(r->headers_out, "last-modified")
+      && !apr_table_get(r->err_headers_out, "last-modified")
+    )
+  ) {
+    apr_table_unset(r->err_headers_out, "last-modified");
+    ap_update_mtime(r, finfo.mtime);
+    ap_set_last_modified(r);
+  }
+  if (
+    conf->ignoreETag == XSENDFILE_ENABLED
+    || (
+      !apr_table_get(r->headers_out, "etag")
+      && !apr_table_get(r->err_headers_out, "etag")
+    )
+  ) {
+    const char *etag;
+
+    apr_table_unset(r->err_headers_out, "etag");
+    if (conf->hashETag == XSENDFILE_ENABLED && !ctx->temporary
+      && (etag = ap_xsendfile_hash_etag(r, ctx, translated, &finfo)) != NULL) {
+      apr_table_setn(r->headers_out, "ETag", etag);
+      ctx->hashETag = 1;
+    }
+    else {
+      ap_set_etag(r);
+    }
+  }
+  if (
+    ctx->profile->immutable
+    && !apr_table_get(r->headers_out, "cache-control")
+    && !apr_table_get(r->err_headers_out, "cache-control")
+  ) {
+    apr_table_setn(r->headers_out, "Cache-Control", "public, max-age=31536000, immutable");
+  }
+
+  ap_set_content_length(r, finfo.size);
+
+  /* cache or something? */
+  start = xsendfile_clock();
+  errcode = ap_meets_conditions(r);
+  xsendfile_phase_end(ctx, XSENDFILE_PHASE_CONDITIONS, start);
+  XSENDFILE_PROBE3(conditional, translated, (apr_int64_t)finfo.size, errcode);
+  if (errcode != OK) {
+#ifdef _DEBUG
+    ap_log_error(
+      APLOG_MARK,
+      APLOG_DEBUG,
+      0,
+      r->server,
+      "xsendfile: met condition %d for %s",
+      errcode,
+      file
+      );
+#endif
+    if (fd) {
+      apr_file_close(fd);
+    }
+    r->status = errcode;
+    ctx->outcome = XSENDFILE_OUTCOME_CONDITIONAL;
+  }
+  else if (conf->diskLimit > 0 && finfo.size >= conf->diskMinSize && !r->header_only
+    && !ap_xsendfile_disk_acquire(r, finfo.device, conf->diskLimit)) {
+    ap_log_rerror(
+      APLOG_MARK,
+      APLOG_INFO,
+      0,
+      r,
+      "xsendfile: XSendFileDiskLimit reached, not sending %s",
+      translated
+      );
+    if (fd) {
+      apr_file_close(fd);
+    }
+    ap_remove_output_filter(f);
+    ctx->outcome = XSENDFILE_OUTCOME_DISK_BUSY;
+    apr_table_setn(r->err_headers_out, "Retry-After", apr_itoa(r->pool, conf->diskRetryAfter));
+    ap_die(HTTP_SERVICE_UNAVAILABLE, r);
+    return HTTP_SERVICE_UNAVAILABLE;
+  }
+  else {
+    if (cached) {
+      /* the mapping stays until r->pool is gone, i.e. the response is through */
+      e = apr_bucket_immortal_create(cached->map, (apr_size_t)cached->size, in->bucket_alloc);
+      ctx->strategy = XSENDFILE_STRATEGY_MMAP;
+    }
+    else {
+      /* For platforms where the size of the file may be larger than
+       * that which can be stored in a single bucket (where the
+       * length field is an apr_size_t), split it into several
+       * buckets; same for smaller buckets asked for. Just the first
+       * one for now, see ap_xsendfile_split_file(): */
+      chunk = ctx->bucketSize;
+      if (sizeof(apr_off_t) > sizeof(apr_size_t)
+        && (!chunk || chunk > AP_MAX_SENDFILE)) {
+        chunk = AP_MAX_SENDFILE;
+      }
+      if (!chunk || finfo.size <= chunk) {
+        chunk = 0;
+      }
+      e = apr_bucket_file_create(fd, 0, (apr_size_t)(chunk ? chunk : finfo.size),
+                                 r->pool, in->bucket_alloc);
+
+
+#if APR_HAS_MMAP
+      /* file buckets are created with mmap() enabled */
+      apr_bucket_file_enable_mmap(e, useMmap);
+#endif /* APR_HAS_MMAP */
+
+      /* what the core is going to do with it (TLS et al. aside) */
+#if APR_HAS_SENDFILE
+      if (useSendfile) {
+        ctx->strategy = XSENDFILE_STRATEGY_SENDFILE;
+      }
+      else
+#endif
+#if APR_HAS_MMAP
+      if (((apr_bucket_file*)e->data)->can_mmap) {
+        ctx->strategy = XSENDFILE_STRATEGY_MMAP;
+      }
+      else
+#endif
+      {
+        ctx->strategy = XSENDFILE_STRATEGY_READ;
+      }
+    }
+#ifdef _DEBUG
+    ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: %s by %s (profile %s, transfer %s)",
+      translated, xsendfile_strategy_names[ctx->strategy], ctx->profile->name,
+      xsendfile_transfer_names[ctx->profile->transfer]);
+#endif
+    APR_BRIGADE_INSERT_TAIL(in, e);
+    first = e;
+    if (fd) {
+      ap_xsendfile_fadvise(r, ctx, fd);
+    }
+
+    /* an explicit 0 lifts the root's limit */
+    if (ctx->limitRate < 0) {
+      ctx->limitRate = ctx->rootLimitRate;
+    }
+    if (ctx->limitRate > 0) {
+      ap_xsendfile_limit_rate(r, ctx, ctx->limitRate);
+    }
+    /* mmap()ed and read files are written along with the headers anyway */
+    if (!ctx->noBuffering && conf->corkSize > 0 && useSendfile && !cached && r->proto_num < 2000
+      && !r->header_only && finfo.size <= conf->corkSize) {
+      ap_xsendfile_cork(r, ctx);
+    }
+  }
+
+  /* remove ourselves from the filter chain */
+  ap_remove_output_filter(f);
+
+#ifdef _DEBUG
+  ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: sending %d bytes", (int)finfo.size);
+#endif
+
+  xsendfile_phase_end(ctx, XSENDFILE_PHASE_TOTAL, started);
+
+  /* the rest of a split file */
+  if (first && chunk) {
+    ap_xsendfile_split_file(in, first, finfo.size, chunk);
+  }
+  if (ctx->noBuffering) {
+    APR_BRIGADE_INSERT_TAIL(in, apr_bucket_flush_create(in->bucket_alloc));
+  }
+  e = apr_bucket_eos_create(in->bucket_alloc);
+  APR_BRIGADE_INSERT_TAIL(in, e);
+
+  /* send the data up the stack */
+  rv = ap_pass_brigade(f->next, in);
+  XSENDFILE_PROBE3(brigade_passed, translated, (apr_int64_t)finfo.size, rv);
+
+  /* the response is on its way, the client will be back for those */
+  if (prefetch && conf->prefetch > 0) {
+    ap_xsendfile_prefetch(r, conf, ctx, prefetch);
+  }
+  return rv;
+}
+
+/*
+  find the counters of the current thread. Scoreboard-backed threads own
+  a slot exclusively; anyone else grabs one of the overflow slots.
+  Call ap_xsendfile_stats_release() when done.
+*/
+static xsendfile_slot_t *ap_xsendfile_stats_find(request_rec *r) {
+  ap_sb_handle_t *sbh = (ap_sb_handle_t*)r->connection->sbh;
+  xsendfile_slot_t *overflow;
+  int base, i, idx;
+
+  if (!xsendfile_stats) {
+    return NULL;
+  }
+  if (sbh && sbh->child_num >= 0 && sbh->thread_num >= 0) {
+    idx = sbh->child_num * xsendfile_stats->threadLimit + sbh->thread_num;
+    if (idx < xsendfile_stats->nslots) {
+      return &xsendfile_stats->slots[idx];
+    }
+  }
+
+  overflow = &xsendfile_stats->slots[xsendfile_stats->nslots];
+  base = (int)(((apr_uint64_t)(apr_uintptr_t)apr_os_thread_current()) % XSENDFILE_OVERFLOW_SLOTS);
+  for (;;) {
+    for (i = 0; i < XSENDFILE_OVERFLOW_SLOTS; ++i) {
+      idx = (base + i) % XSENDFILE_OVERFLOW_SLOTS;
+      if (apr_atomic_cas32(&overflow[idx].busy, 1, 0) == 0) {
+        return &overflow[idx];
+      }
+    }
+    apr_sleep(0);
+  }
+}
+
+static xsendfile_slot_t *ap_xsendfile_stats_acquire(request_rec *r) {
+  xsendfile_slot_t *slot = ap_xsendfile_stats_find(r);
+  apr_uint32_t epoch;
+
+  if (slot && slot->epoch != (epoch = apr_atomic_read32(&xsendfile_stats->epoch))) {
+    /* somebody asked for a reset since we last wrote here */
+    memset(&slot->counters, 0, sizeof(xsendfile_counters_t));
+    slot->epoch = epoch;
+  }
+  return slot;
+}
+
+static void ap_xsendfile_stats_release(xsendfile_slot_t *slot) {
+  if (slot >= &xsendfile_stats->slots[xsendfile_stats->nslots]) {
+    apr_atomic_set32(&slot->busy, 0);
+  }
+}
+
+static APR_INLINE int xsendfile_hist_bucket(apr_uint64_t us) {
+  int msb = XSENDFILE_HIST_SUB_BITS;
+
+  if (us < XSENDFILE_HIST_SUB) {
+    return (int)us;
+  }
+  while (msb < XSENDFILE_HIST_MAX_BITS && (us >> (msb + 1))) {
+    ++msb;
+  }
+  if (msb >= XSENDFILE_HIST_MAX_BITS) {
+    return XSENDFILE_HIST_BUCKETS - 1;
+  }
+  return XSENDFILE_HIST_SUB * (msb - XSENDFILE_HIST_SUB_BITS + 1)
+    + (int)((us >> (msb - XSENDFILE_HIST_SUB_BITS)) & (XSENDFILE_HIST_SUB - 1));
+}
+
+/* exclusive upper bound of a bucket, in microseconds */
+static apr_uint64_t xsendfile_hist_upper(int bucket) {
+  int msb;
+
+  if (bucket < XSENDFILE_HIST_SUB) {
+    return (apr_uint64_t)bucket + 1;
+  }
+  msb = bucket / XSENDFILE_HIST_SUB + XSENDFILE_HIST_SUB_BITS - 1;
+  return ((apr_uint64_t)(XSENDFILE_HIST_SUB + bucket % XSENDFILE_HIST_SUB + 1))
+    << (msb - XSENDFILE_HIST_SUB_BITS);
+}
+
+static APR_INLINE void xsendfile_hist_record(xsendfile_histogram_t *h, apr_uint64_t ns) {
+  apr_uint64_t us = ns / 1000;
+
+  h->count++;
+  h->sumUs += us;
+  h->buckets[xsendfile_hist_bucket(us)]++;
+}
+
+static void ap_xsendfile_stats_update(request_rec *r, const xsendfile_ctx_t *ctx) {
+  xsendfile_slot_t *slot = ap_xsendfile_stats_acquire(r);
+  xsendfile_counters_t *c;
+
+  if (!slot) {
+    return;
+  }
+  c = &slot->counters;
+  c->requests++;
+  c->outcomes[ctx->outcome]++;
+  if (ctx->outcome == XSENDFILE_OUTCOME_SENT) {
+    c->bytes[ctx->strategy] += (apr_uint64_t)r->bytes_sent;
+    c->variants[ctx->variant]++;
+  }
+  if (ctx->root >= 0) {
+    c->roots[ctx->rootId]++;
+  }
+  c->compressions += ctx->compressions;
+  c->compressionFailures += ctx->compressionFailures;
+  c->compressionNs += ctx->phases[XSENDFILE_PHASE_COMPRESS];
+  c->slowLogLines += ctx->slowLog > 0;
+  c->slowLogDropped += ctx->slowLog < 0;
+  c->decisionLogRecords += ctx->decisionLog > 0;
+  c->decisionLogDropped += ctx->decisionLog < 0;
+  c->pacedSocket += ctx->paced == 1;
+  c->pacedFilter += ctx->paced == 2;
+  c->metadataHits += ctx->metadata > 0;
+  c->metadataMisses += ctx->metadata < 0;
+  c->fileCacheHits += ctx->fileCached;
+  c->earlyHints += ctx->preloads < 0;
+  c->h2Shaped += ctx->h2Shaped && ctx->outcome == XSENDFILE_OUTCOME_SENT;
+  c->corked += ctx->corked;
+  c->hashETags += ctx->hashETag;
+  c->guardCalls += ctx->guarded;
+  c->guardSaturated += ctx->guardBusy == APR_EAGAIN;
+  c->guardTimeouts += ctx->guardBusy == APR_TIMEUP;
+  c->guardOpen += ctx->guardBusy == APR_EBUSY;
+  c->prefetches += ctx->prefetches;
+  c->prefetchSkipped += ctx->prefetchSkipped;
+  c->prefetchDropped += ctx->prefetchDropped;
+  if (ctx->guarded) {
+    xsendfile_hist_record(&c->histograms[XSENDFILE_HIST_FSGUARD], ctx->guardWait);
+  }
+  if (ctx->compressions) {
+    xsendfile_hist_record(&c->histograms[XSENDFILE_HIST_COMPRESS], ctx->phases[XSENDFILE_PHASE_COMPRESS]);
+  }
+  xsendfile_hist_record(&c->histograms[XSENDFILE_HIST_RESOLVE],
+    ctx->phases[XSENDFILE_PHASE_ORIGIN] + ctx->phases[XSENDFILE_PHASE_RESOLVE]);
+  xsendfile_hist_record(&c->histograms[XSENDFILE_HIST_VARIANT], ctx->phases[XSENDFILE_PHASE_VARIANT]);
+  xsendfile_hist_record(&c->histograms[XSENDFILE_HIST_OPEN], ctx->phases[XSENDFILE_PHASE_OPEN]);
+  xsendfile_hist_record(&c->histograms[XSENDFILE_HIST_TOTAL], ctx->phases[XSENDFILE_PHASE_TOTAL]);
+  ap_xsendfile_stats_release(slot);
+}
+
+#if APR_HAS_THREADS
+static void * APR_THREAD_FUNC xsendfile_slowlog_thread(apr_thread_t *thd, void *data) {
+  xsendfile_slowlog_t *log = (xsendfile_slowlog_t*)data;
+  char *out;
+  apr_size_t len;
+
+  apr_thread_mutex_lock(log->mutex);
+  while (!log->shutdown || log->len) {
+    if (!log->len) {
+      apr_thread_cond_wait(log->cond, log->mutex);
+      continue;
+    }
+    /* appenders keep going on the other buffer while we write */
+    out = log->buf;
+    len = log->len;
+    log->buf = log->spare;
+    log->spare = out;
+    log->len = 0;
+    apr_thread_mutex_unlock(log->mutex);
+
+    apr_file_write_full(log->fd, out, len, NULL);
+
+    apr_thread_mutex_lock(log->mutex);
+  }
+  apr_thread_mutex_unlock(log->mutex);
+
+  apr_thread_exit(thd, APR_SUCCESS);
+  return NULL;
+}
+
+static apr_status_t xsendfile_slowlog_shutdown(void *data) {
+  xsendfile_slowlog_t *log = (xsendfile_slowlog_t*)data;
+  apr_status_t rv;
+
+  apr_thread_mutex_lock(log->mutex);
+  log->shutdown = 1;
+  apr_thread_cond_signal(log->cond);
+  apr_thread_mutex_unlock(log->mutex);
+  apr_thread_join(&rv, log->thread);
+
+  return APR_SUCCESS;
+}
+#endif
+
+/* @return 1 if the line was queued, 0 if it was dropped */
+static int ap_xsendfile_slowlog_append(xsendfile_slowlog_t *log, const char *line, apr_size_t len) {
+  apr_time_t second = apr_time_sec(apr_time_now());
+  int rv = 0;
+
+#if APR_HAS_THREADS
+  if (!log->mutex) {
+    return 0;
+  }
+  if (apr_thread_mutex_trylock(log->mutex) != APR_SUCCESS) {
+    return 0;
+  }
+#endif
+
+  if (second != log->second) {
+    log->second = second;
+    log->lines = 0;
+  }
+  if (log->lines < log->rate && log->len + len <= XSENDFILE_SLOWLOG_BUFSIZE) {
+    log->lines++;
+#if APR_HAS_THREADS
+    memcpy(log->buf + log->len, line, len);
+    log->len += len;
+    apr_thread_cond_signal(log->cond);
+#else
+    /* no threads, no choice */
+    apr_file_write_full(log->fd, line, len, NULL);
+#endif
+    rv = 1;
+  }
+
+#if APR_HAS_THREADS
+  apr_thread_mutex_unlock(log->mutex);
+#endif
+  return rv;
+}
+
+/* length of the well-formed UTF-8 sequence at s, 0 if there is none */
+static apr_size_t xsendfile_utf8_len(const unsigned char *s) {
+  apr_uint32_t cp;
+  apr_size_t len, i;
+
+  if (s[0] < 0x80) {
+    return 1;
+  }
+  if (s[0] >= 0xC2 && s[0] <= 0xDF) {
+    len = 2;
+    cp = s[0] & 0x1F;
+  }
+  else if (s[0] >= 0xE0 && s[0] <= 0xEF) {
+    len = 3;
+    cp = s[0] & 0x0F;
+  }
+  else if (s[0] >= 0xF0 && s[0] <= 0xF4) {
+    len = 4;
+    cp = s[0] & 0x07;
+  }
+  else {
+    return 0;
+  }
+  for (i = 1; i < len; ++i) {
+    if ((s[i] & 0xC0) != 0x80) {
+      return 0;
+    }
+    cp = (cp << 6) | (s[i] & 0x3F);
+  }
+  /* overlong forms, surrogates, beyond U+10FFFF */
+  if ((len == 3 && cp < 0x800) || (len == 4 && cp < 0x10000)
+    || (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF) {
+    return 0;
+  }
+  return len;
+}
+
+/*
+  JSON string contents; control characters, and bytes not part of valid
+  UTF-8 (file names are just bytes), become \u00XX
+*/
+static const char *xsendfile_json_escape(apr_pool_t *p, const char *value) {
+  const unsigned char *s;
+  char *rv, *d;
+  apr_size_t n;
+
+  if (!value) {
+    return "";
+  }
+  for (s = (const unsigned char*)value; *s; s += n) {
+    if (*s == '"' || *s == '\\' || *s < 0x20 || !(n = xsendfile_utf8_len(s))) {
+      break;
+    }
+  }
+  if (!*s) {
+    return value;
+  }
+
+  rv = d = apr_palloc(p, strlen(value) * 6 + 1);
+  for (s = (const unsigned char*)value; *s; s += n) {
+    n = 1;
+    if (*s == '"' || *s == '\\') {
+      *d++ = '\\';
+      *d++ = (char)*s;
+    }
+    else if (*s < 0x20 || !(n = xsendfile_utf8_len(s))) {
+      apr_snprintf(d, 7, "\\u%04x", (unsigned)*s);
+      d += 6;
+      n = 1;
+    }
+    else {
+      memcpy(d, s, n);
+      d += n;
+    }
+  }
+  *d = '\0';
+  return rv;
+}
+
+/* the fixed part of a slow log line, i.e. all but the strings */
+#define XSENDFILE_SLOWLOG_LINE 1024
+
+static int ap_xsendfile_slowlog_write(request_rec *r, const xsendfile_ctx_t *ctx) {
+  const char *uri, *file, *path, *rootPath;
+  char *line;
+  apr_size_t size, len;
+  int i;
+
+  uri = xsendfile_json_escape(r->pool, r->uri);
+  file = xsendfile_json_escape(r->pool, ctx->file);
+  path = xsendfile_json_escape(r->pool, ctx->path);
+  rootPath = xsendfile_json_escape(r->pool, ctx->rootPath);
+
+  /* built in place, rather than by concatenating ever longer copies */
+  size = strlen(uri) + strlen(file) + strlen(path) + strlen(rootPath) + XSENDFILE_SLOWLOG_LINE;
+  line = apr_palloc(r->pool, size);
+  len = apr_snprintf(
+    line,
+    size,
+    "{\"time\":%" APR_TIME_T_FMT ",\"pid\":%" APR_PID_T_FMT ",\"uri\":\"%s\","
+    "\"file\":\"%s\",\"path\":\"%s\",\"root\":%d,\"rootPath\":\"%s\","
+    "\"variant\":\"%s\",\"outcome\":\"%s\",\"status\":%d,\"size\":%" APR_OFF_T_FMT ","
+    "\"us\":{",
+    r->request_time,
+    getpid(),
+    uri,
+    file,
+    path,
+    ctx->root,
+    rootPath,
+    xsendfile_variant_names[ctx->variant],
+    xsendfile_outcome_names[ctx->outcome],
+    r->status,
+    ctx->size
+    );
+  for (i = 0; i < XSENDFILE_PHASE_MAX; ++i) {
+    len += apr_snprintf(
+      line + len,
+      size - len,
+      "%s\"%s\":%" APR_UINT64_T_FMT,
+      i ? "," : "",
+      xsendfile_phase_names[i],
+      ctx->phases[i] / 1000
+      );
   }
-#if APR_HAS_SENDFILE && defined(_DEBUG)
-  if (coreconf->enable_sendfile == ENABLE_SENDFILE_OFF) {
-    ap_log_error(
-      APLOG_MARK,
-      APLOG_WARNING,
-      0,
-      r->server,
-      "xsendfile: sendfile configured, but not active %d",
-      coreconf->enable_sendfile
+  len += apr_snprintf(line + len, size - len, "},\"syscalls\":{");
+  for (i = 0; i < XSENDFILE_SYS_MAX; ++i) {
+    len += apr_snprintf(
+      line + len,
+      size - len,
+      "%s\"%s\":%d",
+      i ? "," : "",
+      xsendfile_syscall_names[i],
+      ctx->syscalls[i]
+      );
+  }
+  len += apr_snprintf(line + len, size - len, "}}\n");
+
+  return ap_xsendfile_slowlog_append(xsendfile_slowlog, line, len);
+}
+
+#if APR_HAS_THREADS
+/* seal buf, wait for copies still in flight and write it out */
+static void xsendfile_declog_write_buf(xsendfile_declog_t *log, xsendfile_declog_buf_t *buf) {
+  apr_uint32_t len;
+
+  /* no more reservations; late appenders retry on the active buffer */
+  do {
+    len = apr_atomic_read32(&buf->reserved);
+  } while (apr_atomic_cas32(&buf->reserved, len | XSENDFILE_DECISIONLOG_SEALED, len) != len);
+  while (apr_atomic_read32(&buf->committed) != len) {
+    apr_thread_yield();
+  }
+
+  if (len) {
+    apr_file_write_full(log->fd, buf->data, len, NULL);
+  }
+
+  apr_atomic_set32(&buf->committed, 0);
+  apr_atomic_set32(&buf->reserved, 0);
+}
+
+/* write out whatever the active buffer holds, appenders go on with the other */
+static void xsendfile_declog_flush(xsendfile_declog_t *log) {
+  xsendfile_declog_buf_t *buf = log->active;
+
+  if (!apr_atomic_read32(&buf->reserved)) {
+    return;
+  }
+  log->active = buf == &log->bufs[0] ? &log->bufs[1] : &log->bufs[0];
+  xsendfile_declog_write_buf(log, buf);
+}
+
+static void * APR_THREAD_FUNC xsendfile_declog_thread(apr_thread_t *thd, void *data) {
+  xsendfile_declog_t *log = (xsendfile_declog_t*)data;
+  xsendfile_declog_buf_t *active;
+
+  while (!apr_atomic_read32(&log->shutdown)) {
+    apr_sleep(apr_time_from_msec(100));
+    xsendfile_declog_flush(log);
+  }
+  /* both buffers, whether active or not; the other one may have got records late */
+  active = log->active;
+  xsendfile_declog_write_buf(log, active == &log->bufs[0] ? &log->bufs[1] : &log->bufs[0]);
+  xsendfile_declog_write_buf(log, active);
+
+  apr_thread_exit(thd, APR_SUCCESS);
+  return NULL;
+}
+
+static apr_status_t xsendfile_declog_shutdown(void *data) {
+  xsendfile_declog_t *log = (xsendfile_declog_t*)data;
+  apr_status_t rv;
+
+  apr_atomic_set32(&log->shutdown, 1);
+  apr_thread_join(&rv, log->thread);
+
+  return APR_SUCCESS;
+}
+#endif
+
+/* @return 1 if the record was queued, 0 if it was dropped */
+static int ap_xsendfile_declog_append(xsendfile_declog_t *log, const char *rec, apr_uint32_t len) {
+#if APR_HAS_THREADS
+  xsendfile_declog_buf_t *buf;
+  apr_uint32_t off;
+
+  if (!log->thread) {
+    return 0;
+  }
+  for (;;) {
+    buf = log->active;
+    off = apr_atomic_read32(&buf->reserved);
+    if (off & XSENDFILE_DECISIONLOG_SEALED) {
+      /* being written, the writer has swapped buffers already */
+      apr_thread_yield();
+      continue;
+    }
+    if (off + len > log->bufsize) {
+      return 0;
+    }
+    if (apr_atomic_cas32(&buf->reserved, off + len, off) != off) {
+      apr_thread_yield();
+      continue;
+    }
+    if (buf == log->active) {
+      break;
+    }
+    /* the buffer was written out and swapped meanwhile; hand the space
+       back unless someone reserved behind it, else it goes out next time */
+    if (apr_atomic_cas32(&buf->reserved, off, off + len) != off + len) {
+      break;
+    }
+  }
+  memcpy(buf->data + off, rec, len);
+  apr_atomic_add32(&buf->committed, len);
+  return 1;
+#else
+  /* no threads, no choice */
+  return apr_file_write_full(log->fd, rec, len, NULL) == APR_SUCCESS;
+#endif
+}
+
+static APR_INLINE char *xsendfile_put8(char *d, apr_byte_t v) {
+  *d = (char)v;
+  return d + 1;
+}
+
+static APR_INLINE char *xsendfile_put16(char *d, apr_uint16_t v) {
+  memcpy(d, &v, sizeof(v));
+  return d + sizeof(v);
+}
+
+static APR_INLINE char *xsendfile_put32(char *d, apr_uint32_t v) {
+  memcpy(d, &v, sizeof(v));
+  return d + sizeof(v);
+}
+
+static APR_INLINE char *xsendfile_put64(char *d, apr_uint64_t v) {
+  memcpy(d, &v, sizeof(v));
+  return d + sizeof(v);
+}
+
+static int ap_xsendfile_declog_write(request_rec *r, const xsendfile_ctx_t *ctx, int syscalls) {
+  char rec[XSENDFILE_DECISIONLOG_MAXREC], *d;
+  apr_size_t fileLen, dirLen;
+  int cond = 0;
+
+  fileLen = strlen(ctx->file);
+  dirLen = ctx->scriptDir ? strlen(ctx->scriptDir) : 0;
+  if (fileLen + dirLen + 64 > sizeof(rec)) {
+    return 0;
+  }
+
+  if (apr_table_get(r->headers_in, "If-None-Match")) {
+    cond |= XSENDFILE_COND_IF_NONE_MATCH;
+  }
+  if (apr_table_get(r->headers_in, "If-Modified-Since")) {
+    cond |= XSENDFILE_COND_IF_MODIFIED_SINCE;
+  }
+  if (apr_table_get(r->headers_in, "Range")) {
+    cond |= XSENDFILE_COND_RANGE;
+  }
+  if (apr_table_get(r->headers_in, "If-Range")) {
+    cond |= XSENDFILE_COND_IF_RANGE;
+  }
+
+  d = rec + 2; /* length goes in last */
+  d = xsendfile_put8(d, XSENDFILE_DECISIONLOG_DECISION);
+  d = xsendfile_put8(d, XSENDFILE_DECISIONLOG_VERSION);
+  d = xsendfile_put32(d, xsendfile_declog->generation);
+  d = xsendfile_put32(d, (apr_uint32_t)ctx->rootSet);
+  d = xsendfile_put64(d, (apr_uint64_t)r->request_time);
+  d = xsendfile_put32(d, (apr_uint32_t)(ctx->phases[XSENDFILE_PHASE_TOTAL] / 1000));
+  d = xsendfile_put8(d, (apr_byte_t)ctx->outcome);
+  d = xsendfile_put8(d, (apr_byte_t)ctx->variant);
+  d = xsendfile_put8(d, (apr_byte_t)ctx->acceptEncoding);
+  d = xsendfile_put8(d, (apr_byte_t)cond);
+  d = xsendfile_put8(d, (apr_byte_t)((ctx->temporary ? XSENDFILE_DECISION_TEMPORARY : 0)
+    | (ctx->accel ? XSENDFILE_DECISION_ACCEL : 0)));
+  d = xsendfile_put8(d, (apr_byte_t)(signed char)(ctx->root > 127 ? 127 : ctx->root));
+  d = xsendfile_put16(d, (apr_uint16_t)(syscalls > 65535 ? 65535 : syscalls));
+  d = xsendfile_put16(d, (apr_uint16_t)fileLen);
+  d = xsendfile_put16(d, (apr_uint16_t)dirLen);
+  memcpy(d, ctx->file, fileLen);
+  d += fileLen;
+  if (dirLen) {
+    memcpy(d, ctx->scriptDir, dirLen);
+    d += dirLen;
+  }
+  xsendfile_put16(rec, (apr_uint16_t)(d - rec));
+
+  return ap_xsendfile_declog_append(xsendfile_declog, rec, (apr_uint32_t)(d - rec));
+}
+
+/*
+  publish the per-request findings as r->notes, so they can be logged
+  via %{xsendfile-...}n; runs before mod_log_config's hook
+*/
+static int ap_xsendfile_log_transaction(request_rec *r) {
+  xsendfile_ctx_t *ctx = ap_get_module_config(r->request_config, &xsendfile_module);
+  int i, syscalls = 0;
+
+  if (!ctx) {
+    return DECLINED;
+  }
+
+  /* error paths bail out before the filter could stop the clock */
+  if (!ctx->phases[XSENDFILE_PHASE_TOTAL]) {
+    ctx->phases[XSENDFILE_PHASE_TOTAL] = xsendfile_clock() - ctx->started;
+  }
+  if (ctx->notes) {
+    for (i = 0; i < XSENDFILE_PHASE_MAX; ++i) {
+      apr_table_setn(
+        r->notes,
+        xsendfile_phase_notes[i],
+        apr_psprintf(r->pool, "%" APR_UINT64_T_FMT, ctx->phases[i] / 1000)
+        );
+    }
+  }
+  apr_table_setn(r->notes, "xsendfile-variant", xsendfile_variant_names[ctx->variant]);
+  apr_table_setn(r->notes, "xsendfile-root", apr_itoa(r->pool, ctx->root));
+
+  for (i = 0; i < XSENDFILE_SYS_MAX; ++i) {
+    syscalls += ctx->syscalls[i];
+  }
+  apr_table_setn(r->notes, "xsendfile-syscalls", apr_itoa(r->pool, syscalls));
+
+  if (xsendfile_slowlog
+    && ctx->phases[XSENDFILE_PHASE_TOTAL] >= xsendfile_slowlog->thresholdNs) {
+    ctx->slowLog = ap_xsendfile_slowlog_write(r, ctx) ? 1 : -1;
+  }
+
+  if (xsendfile_declog) {
+    ctx->decisionLog = ap_xsendfile_declog_write(r, ctx, syscalls) ? 1 : -1;
+  }
+
+  ap_xsendfile_stats_update(r, ctx);
+
+  return DECLINED;
+}
+
+/* add up all the slots; torn reads of a single counter are tolerated */
+static void xsendfile_stats_sum(xsendfile_counters_t *sum) {
+  const apr_size_t n = sizeof(xsendfile_counters_t) / sizeof(apr_uint64_t);
+  apr_uint64_t *out = (apr_uint64_t*)sum;
+  int slot;
+  apr_size_t i;
+
+  apr_uint32_t epoch = apr_atomic_read32(&xsendfile_stats->epoch);
+
+  memset(sum, 0, sizeof(xsendfile_counters_t));
+  for (slot = 0; slot < xsendfile_stats->nslots + XSENDFILE_OVERFLOW_SLOTS; ++slot) {
+    const apr_uint64_t *in = (const apr_uint64_t*)&xsendfile_stats->slots[slot].counters;
+    if (xsendfile_stats->slots[slot].epoch != epoch) {
+      continue;
+    }
+    for (i = 0; i < n; ++i) {
+      out[i] += in[i];
+    }
+  }
+}
+
+/* escape a prometheus label value (backslash, double-quote and newline) */
+static const char *xsendfile_prometheus_label(apr_pool_t *p, const char *value) {
+  char *rv, *d;
+  const char *s;
+
+  if (!strpbrk(value, "\\\"\n")) {
+    return value;
+  }
+  rv = d = apr_palloc(p, strlen(value) * 2 + 1);
+  for (s = value; *s; ++s) {
+    if (*s == '\n') {
+      *d++ = '\\';
+      *d++ = 'n';
+      continue;
+    }
+    if (*s == '\\' || *s == '"') {
+      *d++ = '\\';
+    }
+    *d++ = *s;
+  }
+  *d = '\0';
+  return rv;
+}
+
+/* upper bound of the bucket holding the q-quantile */
+static apr_uint64_t xsendfile_hist_quantile(const xsendfile_histogram_t *h, double q) {
+  apr_uint64_t rank = (apr_uint64_t)(q * (double)h->count + 0.5), seen = 0;
+  int i;
+
+  if (!h->count) {
+    return 0;
+  }
+  if (rank < 1) {
+    rank = 1;
+  }
+  for (i = 0; i < XSENDFILE_HIST_BUCKETS; ++i) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      return xsendfile_hist_upper(i);
+    }
+  }
+  return xsendfile_hist_upper(XSENDFILE_HIST_BUCKETS - 1);
+}
+
+static void ap_xsendfile_status_text(request_rec *r, const xsendfile_counters_t *c) {
+  int i;
+
+  ap_rputs("mod_xsendfile statistics\n", r);
+  ap_rprintf(r, "Requests: %" APR_UINT64_T_FMT "\n", c->requests);
+  for (i = 0; i < XSENDFILE_OUTCOME_MAX; ++i) {
+    ap_rprintf(r, "Outcome %s: %" APR_UINT64_T_FMT "\n", xsendfile_outcome_names[i], c->outcomes[i]);
+  }
+  for (i = 0; i < XSENDFILE_STRATEGY_MAX; ++i) {
+    ap_rprintf(r, "Bytes %s: %" APR_UINT64_T_FMT "\n", xsendfile_strategy_names[i], c->bytes[i]);
+  }
+  for (i = 0; i < XSENDFILE_VARIANT_MAX; ++i) {
+    ap_rprintf(r, "Variant %s: %" APR_UINT64_T_FMT "\n", xsendfile_variant_names[i], c->variants[i]);
+  }
+  ap_rprintf(r, "Compressions: %" APR_UINT64_T_FMT "\n", c->compressions);
+  ap_rprintf(r, "CompressionFailures: %" APR_UINT64_T_FMT "\n", c->compressionFailures);
+  ap_rprintf(r, "CompressionMs: %" APR_UINT64_T_FMT "\n", c->compressionNs / 1000000);
+  ap_rprintf(r, "SlowLogLines: %" APR_UINT64_T_FMT "\n", c->slowLogLines);
+  ap_rprintf(r, "SlowLogDropped: %" APR_UINT64_T_FMT "\n", c->slowLogDropped);
+  ap_rprintf(r, "DecisionLogRecords: %" APR_UINT64_T_FMT "\n", c->decisionLogRecords);
+  ap_rprintf(r, "DecisionLogDropped: %" APR_UINT64_T_FMT "\n", c->decisionLogDropped);
+  ap_rprintf(r, "PacedBySocket: %" APR_UINT64_T_FMT "\n", c->pacedSocket);
+  ap_rprintf(r, "PacedByFilter: %" APR_UINT64_T_FMT "\n", c->pacedFilter);
+  ap_rprintf(r, "MetadataCacheHits: %" APR_UINT64_T_FMT "\n", c->metadataHits);
+  ap_rprintf(r, "MetadataCacheMisses: %" APR_UINT64_T_FMT "\n", c->metadataMisses);
+  ap_rprintf(r, "FileCacheHits: %" APR_UINT64_T_FMT "\n", c->fileCacheHits);
+  ap_rprintf(r, "EarlyHints: %" APR_UINT64_T_FMT "\n", c->earlyHints);
+  ap_rprintf(r, "H2Shaped: %" APR_UINT64_T_FMT "\n", c->h2Shaped);
+  ap_rprintf(r, "Corked: %" APR_UINT64_T_FMT "\n", c->corked);
+  ap_rprintf(r, "HashETags: %" APR_UINT64_T_FMT "\n", c->hashETags);
+  ap_rprintf(r, "FsGuardCalls: %" APR_UINT64_T_FMT "\n", c->guardCalls);
+  ap_rprintf(r, "FsGuardSaturated: %" APR_UINT64_T_FMT "\n", c->guardSaturated);
+  ap_rprintf(r, "FsGuardTimeouts: %" APR_UINT64_T_FMT "\n", c->guardTimeouts);
+  ap_rprintf(r, "FsGuardOpen: %" APR_UINT64_T_FMT "\n", c->guardOpen);
+  ap_rprintf(r, "Prefetches: %" APR_UINT64_T_FMT "\n", c->prefetches);
+  ap_rprintf(r, "PrefetchSkipped: %" APR_UINT64_T_FMT "\n", c->prefetchSkipped);
+  ap_rprintf(r, "PrefetchDropped: %" APR_UINT64_T_FMT "\n", c->prefetchDropped);
+  for (i = 0; i < XSENDFILE_STATS_ROOTS; ++i) {
+    if (c->roots[i]) {
+      ap_rprintf(r, "Root %d %s: %" APR_UINT64_T_FMT "\n", i, xsendfile_root_name(i), c->roots[i]);
+    }
+  }
+  for (i = 0; xsendfile_stats && i < XSENDFILE_DISKS; ++i) {
+    if (xsendfile_stats->disks[i].device) {
+      ap_rprintf(r, "Disk %u active: %u\n", xsendfile_stats->disks[i].device,
+        apr_atomic_read32(&xsendfile_stats->disks[i].active));
+    }
+  }
+  for (i = 0; i < XSENDFILE_HIST_MAX; ++i) {
+    const xsendfile_histogram_t *h = &c->histograms[i];
+    ap_rprintf(
+      r,
+      "Latency %s: count=%" APR_UINT64_T_FMT " avg=%" APR_UINT64_T_FMT
+      "us p50=%" APR_UINT64_T_FMT "us p90=%" APR_UINT64_T_FMT
+      "us p99=%" APR_UINT64_T_FMT "us p999=%" APR_UINT64_T_FMT "us\n",
+      xsendfile_hist_names[i],
+      h->count,
+      h->count ? h->sumUs / h->count : 0,
+      xsendfile_hist_quantile(h, 0.5),
+      xsendfile_hist_quantile(h, 0.9),
+      xsendfile_hist_quantile(h, 0.99),
+      xsendfile_hist_quantile(h, 0.999)
       );
+  }
+}
+
+static void ap_xsendfile_status_prometheus(request_rec *r, const xsendfile_counters_t *c) {
+  int i;
+
+  ap_rputs(
+    "# HELP xsendfile_requests_total Responses carrying an X-Sendfile header.\n"
+    "# TYPE xsendfile_requests_total counter\n", r);
+  ap_rprintf(r, "xsendfile_requests_total %" APR_UINT64_T_FMT "\n", c->requests);
+  ap_rputs(
+    "# HELP xsendfile_outcomes_total What became of X-Sendfile responses.\n"
+    "# TYPE xsendfile_outcomes_total counter\n", r);
+  for (i = 0; i < XSENDFILE_OUTCOME_MAX; ++i) {
+    ap_rprintf(r, "xsendfile_outcomes_total{outcome=\"%s\"} %" APR_UINT64_T_FMT "\n", xsendfile_outcome_names[i], c->outcomes[i]);
+  }
+  ap_rputs(
+    "# HELP xsendfile_sent_bytes_total Body bytes sent, by transfer strategy.\n"
+    "# TYPE xsendfile_sent_bytes_total counter\n", r);
+  for (i = 0; i < XSENDFILE_STRATEGY_MAX; ++i) {
+    ap_rprintf(r, "xsendfile_sent_bytes_total{strategy=\"%s\"} %" APR_UINT64_T_FMT "\n", xsendfile_strategy_names[i], c->bytes[i]);
+  }
+  ap_rputs(
+    "# HELP xsendfile_variants_total Files sent, by content-encoding variant.\n"
+    "# TYPE xsendfile_variants_total counter\n", r);
+  for (i = 0; i < XSENDFILE_VARIANT_MAX; ++i) {
+    ap_rprintf(r, "xsendfile_variants_total{variant=\"%s\"} %" APR_UINT64_T_FMT "\n", xsendfile_variant_names[i], c->variants[i]);
+  }
+  ap_rputs(
+    "# HELP xsendfile_compressions_total Variants created on the fly.\n"
+    "# TYPE xsendfile_compressions_total counter\n", r);
+  ap_rprintf(r, "xsendfile_compressions_total %" APR_UINT64_T_FMT "\n", c->compressions);
+  ap_rputs(
+    "# HELP xsendfile_compression_failures_total Failed attempts to create a variant.\n"
+    "# TYPE xsendfile_compression_failures_total counter\n", r);
+  ap_rprintf(r, "xsendfile_compression_failures_total %" APR_UINT64_T_FMT "\n", c->compressionFailures);
+  ap_rputs(
+    "# HELP xsendfile_compression_seconds_total Time spent creating variants.\n"
+    "# TYPE xsendfile_compression_seconds_total counter\n", r);
+  ap_rprintf(r, "xsendfile_compression_seconds_total %.6f\n", (double)c->compressionNs / 1e9);
+  ap_rputs(
+    "# HELP xsendfile_slowlog_lines_total Slow requests, by whether they got logged.\n"
+    "# TYPE xsendfile_slowlog_lines_total counter\n", r);
+  ap_rprintf(r, "xsendfile_slowlog_lines_total{result=\"written\"} %" APR_UINT64_T_FMT "\n", c->slowLogLines);
+  ap_rprintf(r, "xsendfile_slowlog_lines_total{result=\"dropped\"} %" APR_UINT64_T_FMT "\n", c->slowLogDropped);
+  ap_rputs(
+    "# HELP xsendfile_decisionlog_records_total Decision log records, by whether they got logged.\n"
+    "# TYPE xsendfile_decisionlog_records_total counter\n", r);
+  ap_rprintf(r, "xsendfile_decisionlog_records_total{result=\"written\"} %" APR_UINT64_T_FMT "\n", c->decisionLogRecords);
+  ap_rprintf(r, "xsendfile_decisionlog_records_total{result=\"dropped\"} %" APR_UINT64_T_FMT "\n", c->decisionLogDropped);
+  ap_rputs(
+    "# HELP xsendfile_paced_total Rate limited responses, by mechanism.\n"
+    "# TYPE xsendfile_paced_total counter\n", r);
+  ap_rprintf(r, "xsendfile_paced_total{by=\"socket\"} %" APR_UINT64_T_FMT "\n", c->pacedSocket);
+  ap_rprintf(r, "xsendfile_paced_total{by=\"filter\"} %" APR_UINT64_T_FMT "\n", c->pacedFilter);
+  ap_rputs(
+    "# HELP xsendfile_metadata_cache_total Variant decisions looked up in the metadata cache.\n"
+    "# TYPE xsendfile_metadata_cache_total counter\n", r);
+  ap_rprintf(r, "xsendfile_metadata_cache_total{result=\"hit\"} %" APR_UINT64_T_FMT "\n", c->metadataHits);
+  ap_rprintf(r, "xsendfile_metadata_cache_total{result=\"miss\"} %" APR_UINT64_T_FMT "\n", c->metadataMisses);
+  ap_rputs(
+    "# HELP xsendfile_file_cache_hits_total Responses from immutable roots served without opening the file.\n"
+    "# TYPE xsendfile_file_cache_hits_total counter\n", r);
+  ap_rprintf(r, "xsendfile_file_cache_hits_total %" APR_UINT64_T_FMT "\n", c->fileCacheHits);
+  ap_rputs(
+    "# HELP xsendfile_early_hints_total 103 Early Hints responses sent.\n"
+    "# TYPE xsendfile_early_hints_total counter\n", r);
+  ap_rprintf(r, "xsendfile_early_hints_total %" APR_UINT64_T_FMT "\n", c->earlyHints);
+  ap_rputs(
+    "# HELP xsendfile_h2_shaped_total HTTP/2 responses sent in XSendFileH2BucketSize buckets.\n"
+    "# TYPE xsendfile_h2_shaped_total counter\n", r);
+  ap_rprintf(r, "xsendfile_h2_shaped_total %" APR_UINT64_T_FMT "\n", c->h2Shaped);
+  ap_rputs(
+    "# HELP xsendfile_corked_total Responses with headers and body corked together.\n"
+    "# TYPE xsendfile_corked_total counter\n", r);
+  ap_rprintf(r, "xsendfile_corked_total %" APR_UINT64_T_FMT "\n", c->corked);
+  ap_rputs(
+    "# HELP xsendfile_hash_etags_total Responses with an ETag from the content hash.\n"
+    "# TYPE xsendfile_hash_etags_total counter\n", r);
+  ap_rprintf(r, "xsendfile_hash_etags_total %" APR_UINT64_T_FMT "\n", c->hashETags);
+  ap_rputs(
+    "# HELP xsendfile_fsguard_calls_total stat()s and open()s done by XSendFileFsGuard threads.\n"
+    "# TYPE xsendfile_fsguard_calls_total counter\n", r);
+  ap_rprintf(r, "xsendfile_fsguard_calls_total %" APR_UINT64_T_FMT "\n", c->guardCalls);
+  ap_rputs(
+    "# HELP xsendfile_fsguard_saturated_total Requests turned away, the XSendFileFsGuard queue being full.\n"
+    "# TYPE xsendfile_fsguard_saturated_total counter\n", r);
+  ap_rprintf(r, "xsendfile_fsguard_saturated_total %" APR_UINT64_T_FMT "\n", c->guardSaturated);
+  ap_rputs(
+    "# HELP xsendfile_fsguard_timeouts_total Requests turned away, XSendFileFsGuard taking too long.\n"
+    "# TYPE xsendfile_fsguard_timeouts_total counter\n", r);
+  ap_rprintf(r, "xsendfile_fsguard_timeouts_total %" APR_UINT64_T_FMT "\n", c->guardTimeouts);
+  ap_rputs(
+    "# HELP xsendfile_fsguard_open_total Requests turned away, the root's XSendFileFsGuard breaker being open.\n"
+    "# TYPE xsendfile_fsguard_open_total counter\n", r);
+  ap_rprintf(r, "xsendfile_fsguard_open_total %" APR_UINT64_T_FMT "\n", c->guardOpen);
+  ap_rputs(
+    "# HELP xsendfile_prefetches_total X-Sendfile-Prefetch files read ahead.\n"
+    "# TYPE xsendfile_prefetches_total counter\n", r);
+  ap_rprintf(r, "xsendfile_prefetches_total %" APR_UINT64_T_FMT "\n", c->prefetches);
+  ap_rputs(
+    "# HELP xsendfile_prefetch_skipped_total X-Sendfile-Prefetch files skipped, having been read ahead recently.\n"
+    "# TYPE xsendfile_prefetch_skipped_total counter\n", r);
+  ap_rprintf(r, "xsendfile_prefetch_skipped_total %" APR_UINT64_T_FMT "\n", c->prefetchSkipped);
+  ap_rputs(
+    "# HELP xsendfile_prefetch_dropped_total X-Sendfile-Prefetch files dropped, over the rate or the queue full.\n"
+    "# TYPE xsendfile_prefetch_dropped_total counter\n", r);
+  ap_rprintf(r, "xsendfile_prefetch_dropped_total %" APR_UINT64_T_FMT "\n", c->prefetchDropped);
+  ap_rputs(
+    "# HELP xsendfile_root_hits_total Files found, by white-listed path.\n"
+    "# TYPE xsendfile_root_hits_total counter\n", r);
+  for (i = 0; i < XSENDFILE_STATS_ROOTS; ++i) {
+    if (c->roots[i]) {
+      ap_rprintf(r, "xsendfile_root_hits_total{root=\"%s\"} %" APR_UINT64_T_FMT "\n",
+        xsendfile_prometheus_label(r->pool, xsendfile_root_name(i)), c->roots[i]);
+    }
+  }
+  ap_rputs(
+    "# HELP xsendfile_disk_active Large responses in flight, by device (XSendFileDiskLimit).\n"
+    "# TYPE xsendfile_disk_active gauge\n", r);
+  for (i = 0; xsendfile_stats && i < XSENDFILE_DISKS; ++i) {
+    if (xsendfile_stats->disks[i].device) {
+      ap_rprintf(r, "xsendfile_disk_active{device=\"%u\"} %u\n", xsendfile_stats->disks[i].device,
+        apr_atomic_read32(&xsendfile_stats->disks[i].active));
+    }
+  }
+
+  /* bucket boundaries at the powers of two, which the log-linear buckets align to */
+  ap_rputs(
+    "# HELP xsendfile_phase_seconds Time spent in the phases of processing.\n"
+    "# TYPE xsendfile_phase_seconds histogram\n", r);
+  for (i = 0; i < XSENDFILE_HIST_MAX; ++i) {
+    const xsendfile_histogram_t *h = &c->histograms[i];
+    apr_uint64_t cumulative = 0, le = 1;
+    int b = 0;
+
+    while (le <= ((apr_uint64_t)1 << (XSENDFILE_HIST_MAX_BITS - 1))) {
+      for (; b < XSENDFILE_HIST_BUCKETS && xsendfile_hist_upper(b) <= le; ++b) {
+        cumulative += h->buckets[b];
+      }
+      ap_rprintf(r, "xsendfile_phase_seconds_bucket{phase=\"%s\",le=\"%.6f\"} %" APR_UINT64_T_FMT "\n",
+        xsendfile_hist_names[i], (double)le / 1e6, cumulative);
+      le <<= 1;
+    }
+    ap_rprintf(r, "xsendfile_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %" APR_UINT64_T_FMT "\n",
+      xsendfile_hist_names[i], h->count);
+    ap_rprintf(r, "xsendfile_phase_seconds_sum{phase=\"%s\"} %.6f\n",
+      xsendfile_hist_names[i], (double)h->sumUs / 1e6);
+    ap_rprintf(r, "xsendfile_phase_seconds_count{phase=\"%s\"} %" APR_UINT64_T_FMT "\n",
+      xsendfile_hist_names[i], h->count);
+  }
+}
+
+/*
+  SetHandler xsendfile-status
+  human readable by default, ?prometheus for the text exposition format,
+  ?reset starts over (each slot clears itself on its next update)
+*/
+static int ap_xsendfile_status_handler(request_rec *r) {
+  xsendfile_counters_t sum;
+  int prometheus;
+
+  if (!r->handler || strcmp(r->handler, "xsendfile-status")) {
+    return DECLINED;
+  }
+  r->allowed = (AP_METHOD_BIT << M_GET);
+  if (r->method_number != M_GET) {
+    return DECLINED;
+  }
+  if (!xsendfile_stats) {
+    ap_log_rerror(APLOG_MARK, APLOG_ERR, 0, r, "xsendfile: statistics unavailable");
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  if (r->args && strstr(r->args, "reset") != NULL) {
+    apr_atomic_inc32(&xsendfile_stats->epoch);
+  }
+
+  prometheus = r->args && strstr(r->args, "prometheus") != NULL;
+  ap_set_content_type(r, prometheus ? "text/plain; version=0.0.4" : "text/plain; charset=ISO-8859-1");
+  if (r->header_only) {
+    return OK;
+  }
+
+  xsendfile_stats_sum(&sum);
+  if (prometheus) {
+    ap_xsendfile_status_prometheus(r, &sum);
+  }
+  else {
+    ap_xsendfile_status_text(r, &sum);
+  }
+  return OK;
+}
+
+static apr_status_t xsendfile_open_log_file(apr_pool_t *pconf, server_rec *s,
+    const char *what, const char *fname, apr_file_t **fd) {
+  apr_status_t rv;
+
+  if (fname[0] == '|') {
+    piped_log *pl = ap_open_piped_log(pconf, fname + 1);
+    if (!pl) {
+      ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "xsendfile: cannot open %s pipe %s", what, fname + 1);
+      return APR_EGENERAL;
+    }
+    *fd = ap_piped_log_write_fd(pl);
+  }
+  else if ((rv = apr_file_open(
+    fd,
+    fname,
+    APR_WRITE | APR_APPEND | APR_CREATE | APR_BINARY,
+    APR_OS_DEFAULT,
+    pconf
+  )) != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "xsendfile: cannot open %s %s", what, fname);
+    return rv;
+  }
+  return APR_SUCCESS;
+}
+
+/* number the servers' XSendFilePath lists and log them as root sets */
+static void xsendfile_declog_rootsets(xsendfile_declog_t *log, server_rec *s) {
+  char rec[XSENDFILE_DECISIONLOG_MAXREC], *d;
+  int rootSet = 0;
+
+  for (; s; s = s->next) {
+    xsendfile_conf_t *conf = (xsendfile_conf_t*)ap_get_module_config(s->module_config, &xsendfile_module);
+    const xsendfile_path_t *paths = (const xsendfile_path_t*)conf->paths->elts;
+    int i, n = 0;
+
+    conf->rootSet = ++rootSet;
+
+    d = rec + 2;
+    d = xsendfile_put8(d, XSENDFILE_DECISIONLOG_ROOTSET);
+    d = xsendfile_put8(d, XSENDFILE_DECISIONLOG_VERSION);
+    d = xsendfile_put32(d, log->generation);
+    d = xsendfile_put32(d, (apr_uint32_t)conf->rootSet);
+    d += 2; /* count, once known */
+    for (i = 0; i < conf->paths->nelts; ++i) {
+      apr_size_t len = strlen(paths[i].path);
+      if ((apr_size_t)(d - rec) + len + 3 > sizeof(rec)) {
+        ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s,
+          "xsendfile: too many XSendFilePaths for the decision log, only logging the first %d", n);
+        break;
+      }
+      d = xsendfile_put8(d, (apr_byte_t)paths[i].allowFileDelete);
+      d = xsendfile_put16(d, (apr_uint16_t)len);
+      memcpy(d, paths[i].path, len);
+      d += len;
+      ++n;
+    }
+    xsendfile_put16(rec + 12, (apr_uint16_t)n);
+    xsendfile_put16(rec, (apr_uint16_t)(d - rec));
+    apr_file_write_full(log->fd, rec, d - rec, NULL);
+  }
+}
+
+static int xsendfile_open_logs(apr_pool_t *pconf, apr_pool_t *plog,
+    apr_pool_t *ptemp, server_rec *s) {
+  if (xsendfile_slowlog
+    && xsendfile_open_log_file(pconf, s, "slow log", xsendfile_slowlog->fname, &xsendfile_slowlog->fd) != APR_SUCCESS) {
+    return HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  if (xsendfile_declog) {
+    if (xsendfile_open_log_file(pconf, s, "decision log", xsendfile_declog->fname, &xsendfile_declog->fd) != APR_SUCCESS) {
+      return HTTP_INTERNAL_SERVER_ERROR;
     }
+    xsendfile_declog->generation = (apr_uint32_t)apr_time_as_msec(apr_time_now());
+    xsendfile_declog_rootsets(xsendfile_declog, s);
+  }
+
+  return OK;
+}
+
+static void xsendfile_declog_child_init(apr_pool_t *p, server_rec *s) {
+  xsendfile_declog_t *log = xsendfile_declog;
+#if APR_HAS_THREADS
+  apr_status_t rv;
+  int i;
 #endif
-  /* stat (for etag/cache/content-length stuff) */
-  if ((rv = apr_file_info_get(&finfo, APR_FINFO_NORM, fd)) != APR_SUCCESS) {
-    ap_log_rerror(
-      APLOG_MARK,
-      APLOG_ERR,
-      rv,
-      r,
-      "xsendfile: unable to stat file: %s",
-      translated
-      );
-    apr_file_close(fd);
-    ap_remove_output_filter(f);
-    ap_die(HTTP_FORBIDDEN, r);
-    return HTTP_FORBIDDEN;
+
+  if (!log || !log->fd) {
+    return;
   }
-  /* no inclusion of directories! we're serving files! */
-  if (finfo.filetype != APR_REG) {
-    ap_log_rerror(
-      APLOG_MARK,
-      APLOG_ERR,
-      APR_EBADPATH,
-      r,
-      "xsendfile: not a file %s",
-      translated
-      );
-    apr_file_close(fd);
-    ap_remove_output_filter(f);
-    ap_die(HTTP_NOT_FOUND, r);
-    return HTTP_NOT_FOUND;
+
+#if APR_HAS_THREADS
+  for (i = 0; i < 2; ++i) {
+    log->bufs[i].data = apr_palloc(p, log->bufsize);
+    log->bufs[i].reserved = 0;
+    log->bufs[i].committed = 0;
+  }
+  log->active = &log->bufs[0];
+  log->shutdown = 0;
+  if ((rv = apr_thread_create(&log->thread, NULL, xsendfile_declog_thread, log, p)) != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "xsendfile: cannot start decision log writer, decision log disabled");
+    log->thread = NULL;
+    return;
   }
+  apr_pool_cleanup_register(p, log, xsendfile_declog_shutdown, apr_pool_cleanup_null);
+#endif
+}
 
-  /*
-    need to cheat here a bit
-    as etag generator will use those ;)
-    and we want local_copy and cache
-  */
-  r->finfo.inode = finfo.inode;
-  r->finfo.size = finfo.size;
+/* only if any profile asks for it */
+static void xsendfile_metacache_child_init(apr_pool_t *p, server_rec *s) {
+  xsendfile_metacache_t *cache;
+  apr_hash_index_t *hi;
+  int wanted = 0;
 
-  /*
-    caching? why not :p
-  */
-  r->no_cache = r->no_local_copy = 0;
+  xsendfile_metacache = NULL;
+  if (!xsendfile_profiles) {
+    return;
+  }
+  for (hi = apr_hash_first(p, xsendfile_profiles); hi; hi = apr_hash_next(hi)) {
+    const xsendfile_profile_t *profile;
 
-  /* some script (f?cgi) place stuff in err_headers_out */
-  if (
-    conf->ignoreLM == XSENDFILE_ENABLED
-    || (
-      !apr_table_get(r->headers_out, "last-modified")
-      && !apr_table_get(r->err_headers_out, "last-modified")
-    )
-  ) {
-    apr_table_unset(r->err_headers_out, "last-modified");
-    ap_update_mtime(r, finfo.mtime);
-    ap_set_last_modified(r);
+    apr_hash_this(hi, NULL, NULL, (void**)&profile);
+    wanted |= profile->metadataTTL || profile->immortal;
   }
-  if (
-    conf->ignoreETag == XSENDFILE_ENABLED
-    || (
-      !apr_table_get(r->headers_out, "etag")
-      && !apr_table_get(r->err_headers_out, "etag")
-    )
-  ) {
-    apr_table_unset(r->err_headers_out, "etag");
-    ap_set_etag(r);
+  if (!wanted) {
+    return;
   }
 
-  ap_set_content_length(r, finfo.size);
+  cache = (xsendfile_metacache_t*)apr_pcalloc(p, sizeof(xsendfile_metacache_t));
+  if (apr_pool_create(&cache->pool, p) != APR_SUCCESS
+    || apr_pool_create(&cache->filePool, p) != APR_SUCCESS) {
+    return;
+  }
+#if APR_HAS_THREADS
+  if (apr_thread_mutex_create(&cache->mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "xsendfile: cannot create the metadata cache lock, metadata won't be cached");
+    return;
+  }
+#endif
+  cache->entries = apr_hash_make(cache->pool);
+  cache->files = apr_hash_make(cache->filePool);
+#if APR_HAS_MMAP
+  apr_pool_cleanup_register(cache->filePool, cache, xsendfile_file_cache_cleanup, apr_pool_cleanup_null);
+#endif
+  xsendfile_metacache = cache;
+}
 
-  /* cache or something? */
-  if ((errcode = ap_meets_conditions(r)) != OK) {
-#ifdef _DEBUG
-    ap_log_error(
-      APLOG_MARK,
-      APLOG_DEBUG,
-      0,
-      r->server,
-      "xsendfile: met condition %d for %s",
-      errcode,
-      file
-      );
+static void xsendfile_hasher_child_init(apr_pool_t *p, server_rec *s) {
+#if APR_HAS_THREADS
+  xsendfile_hasher_t *h;
+  apr_status_t rv;
+
+  xsendfile_hasher = NULL;
+  if (!xsendfile_hash_wanted) {
+    return;
+  }
+  h = (xsendfile_hasher_t*)apr_pcalloc(p, sizeof(xsendfile_hasher_t));
+  if (apr_pool_create(&h->pool, p) != APR_SUCCESS
+    || apr_thread_mutex_create(&h->mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS
+    || apr_thread_cond_create(&h->cond, p) != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "xsendfile: cannot set up content hashing, only stored hashes will be used");
+    return;
+  }
+  h->entries = apr_hash_make(h->pool);
+  /* set before the thread starts, which goes by it */
+  xsendfile_hasher = h;
+  if ((rv = apr_thread_create(&h->thread, NULL, xsendfile_hasher_thread, h, p)) != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "xsendfile: cannot start the hashing thread, only stored hashes will be used");
+    xsendfile_hasher = NULL;
+    return;
+  }
+  apr_pool_cleanup_register(p, h, xsendfile_hasher_shutdown, apr_pool_cleanup_null);
 #endif
-    apr_file_close(fd);
-    r->status = errcode;
+}
+
+static void xsendfile_fsguard_child_init(apr_pool_t *p, server_rec *s) {
+#if APR_HAS_THREADS
+  xsendfile_fsguard_t *o = xsendfile_fsguard;
+  apr_thread_t **workers;
+  apr_status_t rv;
+  int i;
+
+  if (!o) {
+    return;
   }
-  else {
-    /* For platforms where the size of the file may be larger than
-     * that which can be stored in a single bucket (where the
-     * length field is an apr_size_t), split it into several
-     * buckets: */
-    if (sizeof(apr_off_t) > sizeof(apr_size_t)
-      && finfo.size > AP_MAX_SENDFILE) {
-      apr_off_t fsize = finfo.size;
-      e = apr_bucket_file_create(fd, 0, AP_MAX_SENDFILE, r->pool,
-                                 in->bucket_alloc);
-      while (fsize > AP_MAX_SENDFILE) {
-          apr_bucket *ce;
-          apr_bucket_copy(e, &ce);
-          APR_BRIGADE_INSERT_TAIL(in, ce);
-          e->start += AP_MAX_SENDFILE;
-          fsize -= AP_MAX_SENDFILE;
-      }
-      e->length = (apr_size_t)fsize; /* Resize just the last bucket */
+  o->workers = NULL;
+  if ((rv = apr_thread_mutex_create(&o->mutex, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS
+    || (rv = apr_thread_cond_create(&o->work, p)) != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "xsendfile: cannot set up XSendFileFsGuard, files are opened by the requests");
+    return;
+  }
+  /* a slot for every queued call and one per thread, given up on or not */
+  o->njobs = o->queue + o->threads;
+  o->jobs = (xsendfile_job_t*)apr_pcalloc(p, o->njobs * sizeof(xsendfile_job_t));
+  o->free = NULL;
+  for (i = o->njobs - 1; i >= 0; --i) {
+    if ((rv = apr_thread_cond_create(&o->jobs[i].cond, p)) != APR_SUCCESS) {
+      ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "xsendfile: cannot set up XSendFileFsGuard, files are opened by the requests");
+      return;
     }
-    else {
-      e = apr_bucket_file_create(fd, 0, (apr_size_t)finfo.size,
-                                 r->pool, in->bucket_alloc);
+    o->jobs[i].next = o->free;
+    o->free = &o->jobs[i];
+  }
+  workers = (apr_thread_t**)apr_pcalloc(p, o->threads * sizeof(apr_thread_t*));
+  for (i = 0; i < o->threads; ++i) {
+    if ((rv = apr_thread_create(&workers[i], NULL, xsendfile_fsguard_thread, o, p)) != APR_SUCCESS) {
+      ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "xsendfile: started only %d of %d XSendFileFsGuard threads", i, o->threads);
+      break;
     }
+  }
+  if (!i) {
+    return;
+  }
+  o->threads = i;
+  o->workers = workers;
+  apr_pool_cleanup_register(p, o, xsendfile_fsguard_shutdown, apr_pool_cleanup_null);
+#endif
+}
 
+static void xsendfile_prefetcher_child_init(apr_pool_t *p, server_rec *s) {
+#if APR_HAS_THREADS
+  xsendfile_prefetcher_t *pf;
+  apr_status_t rv;
 
-#if APR_HAS_MMAP
-    if (coreconf->enable_mmap == ENABLE_MMAP_ON) {
-      apr_bucket_file_enable_mmap(e, 0);
-    }
-#if defined(_DEBUG)
-    else {
-      ap_log_error(
-        APLOG_MARK,
-        APLOG_WARNING,
-        0,
-        r->server,
-        "xsendfile: mmap configured, but not active %d",
-        coreconf->enable_mmap
-        );
-      }
-#endif /* _DEBUG */
-#endif /* APR_HAS_MMAP */
-    APR_BRIGADE_INSERT_TAIL(in, e);
+  xsendfile_prefetcher = NULL;
+  if (!xsendfile_prefetch_wanted) {
+    return;
+  }
+  pf = (xsendfile_prefetcher_t*)apr_pcalloc(p, sizeof(xsendfile_prefetcher_t));
+  if (apr_pool_create(&pf->pool, p) != APR_SUCCESS
+    || apr_thread_mutex_create(&pf->mutex, APR_THREAD_MUTEX_DEFAULT, p) != APR_SUCCESS
+    || apr_thread_cond_create(&pf->cond, p) != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "xsendfile: cannot set up prefetching, X-Sendfile-Prefetch is ignored");
+    return;
+  }
+  pf->seen = apr_hash_make(pf->pool);
+  pf->tokens = XSENDFILE_PREFETCH_RATE;
+  pf->refilled = apr_time_now();
+  if ((rv = apr_thread_create(&pf->thread, NULL, xsendfile_prefetcher_thread, pf, p)) != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "xsendfile: cannot start the prefetching thread, X-Sendfile-Prefetch is ignored");
+    return;
   }
+  xsendfile_prefetcher = pf;
+  apr_pool_cleanup_register(p, pf, xsendfile_prefetcher_shutdown, apr_pool_cleanup_null);
+#endif
+}
 
-  e = apr_bucket_eos_create(in->bucket_alloc);
-  APR_BRIGADE_INSERT_TAIL(in, e);
+static void xsendfile_child_init(apr_pool_t *p, server_rec *s) {
+  xsendfile_slowlog_t *log = xsendfile_slowlog;
+#if APR_HAS_THREADS
+  apr_status_t rv;
+#endif
 
-  /* remove ourselves from the filter chain */
-  ap_remove_output_filter(f);
+  xsendfile_declog_child_init(p, s);
+  xsendfile_metacache_child_init(p, s);
+  xsendfile_hasher_child_init(p, s);
+  xsendfile_fsguard_child_init(p, s);
+  xsendfile_prefetcher_child_init(p, s);
 
-#ifdef _DEBUG
-  ap_log_error(APLOG_MARK, APLOG_DEBUG, 0, r->server, "xsendfile: sending %d bytes", (int)finfo.size);
+  if (!log || !log->fd) {
+    return;
+  }
+
+  log->buf = apr_palloc(p, XSENDFILE_SLOWLOG_BUFSIZE);
+  log->spare = apr_palloc(p, XSENDFILE_SLOWLOG_BUFSIZE);
+  log->len = 0;
+  log->lines = 0;
+  log->second = 0;
+#if APR_HAS_THREADS
+  log->shutdown = 0;
+  if ((rv = apr_thread_mutex_create(&log->mutex, APR_THREAD_MUTEX_DEFAULT, p)) != APR_SUCCESS
+    || (rv = apr_thread_cond_create(&log->cond, p)) != APR_SUCCESS
+    || (rv = apr_thread_create(&log->thread, NULL, xsendfile_slowlog_thread, log, p)) != APR_SUCCESS) {
+    ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "xsendfile: cannot start slow log writer, slow log disabled");
+    log->mutex = NULL;
+    return;
+  }
+  apr_pool_cleanup_register(p, log, xsendfile_slowlog_shutdown, apr_pool_cleanup_null);
 #endif
+}
 
-  /* send the data up the stack */
-  return ap_pass_brigade(f->next, in);
+static int xsendfile_pre_config(apr_pool_t *pconf, apr_pool_t *plog, apr_pool_t *ptemp) {
+  /* (re)start the root registry for this generation */
+  xsendfile_roots = apr_array_make(pconf, XSENDFILE_STATS_ROOTS, sizeof(const char*));
+  *(const char**)apr_array_push(xsendfile_roots) = "(script directory)";
+  xsendfile_profiles = apr_hash_make(pconf);
+  xsendfile_hash_wanted = 0;
+  xsendfile_prefetch_wanted = 0;
+  xsendfile_stats = NULL;
+  xsendfile_slowlog = NULL;
+  xsendfile_declog = NULL;
+  xsendfile_fsguard = NULL;
+  return OK;
+}
+
+/*
+  the statistics live in anonymous shared memory, so the children
+  inherit it; where that isn't available, they are kept per process
+*/
+static int xsendfile_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+    apr_pool_t *ptemp, server_rec *s) {
+  apr_shm_t *shm;
+  apr_status_t rv;
+  apr_size_t size, heldOffset;
+  int serverLimit = 0, threadLimit = 0;
+
+  ap_mpm_query(AP_MPMQ_HARD_LIMIT_DAEMONS, &serverLimit);
+  ap_mpm_query(AP_MPMQ_HARD_LIMIT_THREADS, &threadLimit);
+  if (serverLimit < 1) {
+    serverLimit = 1;
+  }
+  if (threadLimit < 1) {
+    threadLimit = 1;
+  }
+
+  size = APR_OFFSETOF(xsendfile_stats_t, slots)
+    + (apr_size_t)(serverLimit * threadLimit + XSENDFILE_OVERFLOW_SLOTS) * sizeof(xsendfile_slot_t);
+  heldOffset = APR_ALIGN_DEFAULT(size);
+  size = heldOffset + (apr_size_t)serverLimit * XSENDFILE_DISKS * sizeof(apr_uint32_t);
+  if ((rv = apr_shm_create(&shm, size, NULL, pconf)) == APR_SUCCESS) {
+    /* fresh segments are zero-filled; leave untouched pages unmapped */
+    xsendfile_stats = (xsendfile_stats_t*)apr_shm_baseaddr_get(shm);
+  }
+  else {
+    ap_log_error(
+      APLOG_MARK,
+      APLOG_WARNING,
+      rv,
+      s,
+      "xsendfile: cannot create shared memory, statistics will be per process"
+      );
+    xsendfile_stats = (xsendfile_stats_t*)apr_pcalloc(pconf, size);
+  }
+  xsendfile_stats->serverLimit = serverLimit;
+  xsendfile_stats->threadLimit = threadLimit;
+  xsendfile_stats->nslots = serverLimit * threadLimit;
+  xsendfile_stats->heldOffset = heldOffset;
+
+  return OK;
 }
 
 static void ap_xsendfile_insert_output_filter(request_rec *r) {
@@ -957,15 +5794,119 @@ static const command_rec xsendfile_command_table[] = {
     OR_FILEINFO,
     "On|Off - Unescape/url-decode the value of the header (default: On)"
     ),
-  AP_INIT_TAKE12(
+  AP_INIT_FLAG(
+    "XSendFileTiming",
+    xsendfile_cmd_flag,
+    NULL,
+    OR_FILEINFO,
+    "On|Off - Publish per-phase timings as request notes (default: Off)"
+    ),
+  AP_INIT_FLAG(
+    "XSendFileLearnedOrder",
+    xsendfile_cmd_flag,
+    NULL,
+    OR_FILEINFO,
+    "On|Off - Try the most successful paths first, config order still taking precedence (default: Off)"
+    ),
+  AP_INIT_FLAG(
+    "XSendFileHashETag",
+    xsendfile_cmd_flag,
+    NULL,
+    RSRC_CONF|ACCESS_CONF,
+    "On|Off - Use the SHA-1 of the contents as ETag, once known (default: Off)"
+    ),
+  AP_INIT_TAKE1(
+    "XSendFileEarlyHints",
+    xsendfile_cmd_hints,
+    NULL,
+    OR_FILEINFO,
+    "off|on|sidecar - Send X-Sendfile-Preload (on) or also <file>.preload (sidecar) as 103 Early Hints (default: off)"
+    ),
+  AP_INIT_TAKE1(
+    "XSendFilePrefetch",
+    xsendfile_cmd_prefetch,
+    NULL,
+    RSRC_CONF|ACCESS_CONF,
+    "off|on|<files> - Read ahead up to that many files of X-Sendfile-Prefetch (on: 8; default: off)"
+    ),
+  AP_INIT_TAKE1(
+    "XSendFileBucketSize",
+    xsendfile_cmd_size,
+    NULL,
+    OR_FILEINFO,
+    "off|on|<bytes> - Split files into buckets of that size, 64k at least, i.e. sendfile() calls (on: 16m; default: off, 16m on 32-bit platforms)"
+    ),
+  AP_INIT_TAKE1(
+    "XSendFileH2BucketSize",
+    xsendfile_cmd_size,
+    NULL,
+    OR_FILEINFO,
+    "off|on|<bytes> - Hand the file to mod_http2 in buckets of that size, 64k at least (on: 64k; default: off)"
+    ),
+  AP_INIT_TAKE1(
+    "XSendFileCork",
+    xsendfile_cmd_size,
+    NULL,
+    OR_FILEINFO,
+    "off|on|<bytes> - Cork the headers together with files up to that size (on: 16k; default: off)"
+    ),
+  AP_INIT_TAKE123(
+    "XSendFileDiskLimit",
+    xsendfile_cmd_disklimit,
+    NULL,
+    RSRC_CONF|ACCESS_CONF,
+    "off or the max. responses of at least the given size (default: 1m) per device, and the Retry-After of the 503 otherwise (default: 5)"
+    ),
+  AP_INIT_RAW_ARGS(
     "XSendFilePath",
     xsendfile_cmd_path,
     NULL,
     RSRC_CONF|ACCESS_CONF,
-    "Allow to serve files from that Path. Must be absolute"
+    "Allow to serve files from that Path. Must be absolute. Options: AllowFileDelete, LimitRate=<bytes/s>, Profile=<name>"
+    ),
+  AP_INIT_RAW_ARGS(
+    "XSendFileMap",
+    xsendfile_cmd_map,
+    NULL,
+    RSRC_CONF|ACCESS_CONF,
+    "URI prefix and the directory X-Accel-Redirect URIs starting with it map to. Options: LimitRate=<bytes/s>, Profile=<name>"
+    ),
+  AP_INIT_RAW_ARGS(
+    "XSendFileProfile",
+    xsendfile_cmd_profile,
+    NULL,
+    RSRC_CONF,
+    "Name and key=value options: Transfer, Fadvise, Compress, CompressTypes, MetadataTTL, Immortal, Immutable, FsGuard"
+    ),
+  AP_INIT_TAKE23(
+    "XSendFileSlowLog",
+    xsendfile_cmd_slowlog,
+    NULL,
+    RSRC_CONF,
+    "Threshold in ms, log file (or |program) and optionally the max. lines per second (default: 10)"
+    ),
+  AP_INIT_TAKE123(
+    "XSendFileFsGuard",
+    xsendfile_cmd_fsguard,
+    NULL,
+    RSRC_CONF,
+    "Helper threads per child that FsGuard=on requests wait on, at most the timeout, for stat() and open(); optionally the queue length (default: 16 per thread) and timeout in ms (default: 2000)"
+    ),
+  AP_INIT_TAKE12(
+    "XSendFileDecisionLog",
+    xsendfile_cmd_declog,
+    NULL,
+    RSRC_CONF,
+    "Log file (or |program) for the binary decision log and optionally the buffer size in KiB (default: 256)"
     ),
   { NULL }
 };
+#if !AP_MODULE_MAGIC_AT_LEAST(20120211, 105)
+static void xsendfile_optional_fn_retrieve(void) {
+  xsendfile_is_https = APR_RETRIEVE_OPTIONAL_FN(ssl_is_https);
+}
+#endif
+
 static void xsendfile_register_hooks(apr_pool_t *p) {
   ap_register_output_filter(
     "XSENDFILE",
@@ -980,6 +5921,64 @@ static void xsendfile_register_hooks(apr_pool_t *p) {
     NULL,
     APR_HOOK_LAST + 1
     );
+
+  ap_hook_log_transaction(
+    ap_xsendfile_log_transaction,
+    NULL,
+    NULL,
+    APR_HOOK_FIRST
+    );
+
+  ap_hook_handler(
+    ap_xsendfile_status_handler,
+    NULL,
+    NULL,
+    APR_HOOK_MIDDLE
+    );
+
+  ap_hook_pre_config(
+    xsendfile_pre_config,
+    NULL,
+    NULL,
+    APR_HOOK_MIDDLE
+    );
+
+  ap_hook_post_config(
+    xsendfile_post_config,
+    NULL,
+    NULL,
+    APR_HOOK_MIDDLE
+    );
+
+  ap_hook_open_logs(
+    xsendfile_open_logs,
+    NULL,
+    NULL,
+    APR_HOOK_MIDDLE
+    );
+
+  ap_hook_child_init(
+    xsendfile_child_init,
+    NULL,
+    NULL,
+    APR_HOOK_MIDDLE
+    );
+
+  ap_hook_child_status(
+    xsendfile_child_status,
+    NULL,
+    NULL,
+    APR_HOOK_MIDDLE
+    );
+
+#if !AP_MODULE_MAGIC_AT_LEAST(20120211, 105)
+  ap_hook_optional_fn_retrieve(
+    xsendfile_optional_fn_retrieve,
+    NULL,
+    NULL,
+    APR_HOOK_MIDDLE
+    );
+#endif
 }
 module AP_MODULE_DECLARE_DATA xsendfile_module = {
   STANDARD20_MODULE_STUFF,